@@ -0,0 +1,144 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include <sqlite>
+
+#include "logging.hpp"
+
+namespace sqldsml {
+  // Runs database jobs on a dedicated thread in the order they are submitted. While jobs
+  // are queued or running the writer owns the database: other threads must not use the
+  // connection, nor add to caches that draw ids from an allocator. submit() blocks while
+  // max_queued jobs are already waiting, so a producer cannot run ahead of the disk.
+  class background_writer {
+  public:
+    background_writer(sqlite::database::type_ptr db, const size_t max_queued = 1) :
+      db_(db),
+      max_queued_(max_queued == 0 ? 1 : max_queued),
+      stopping_(false),
+      thread_(&background_writer::run, this) {
+    }
+
+    // Finishes the queued jobs before returning
+    ~background_writer() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+      }
+      job_queued_.notify_one();
+      thread_.join();
+    }
+
+    // The future is ready once the job has run and holds its result
+    std::future<bool> submit(const std::function<bool(sqlite::database::type_ptr)>& job) {
+      std::packaged_task<bool()> task(std::bind(job, db_));
+      std::future<bool> result = task.get_future();
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        job_taken_.wait(lock, [this]() { return jobs_.size() < max_queued_; });
+        jobs_.push_back(std::move(task));
+      }
+      job_queued_.notify_one();
+      return result;
+    }
+
+    // Blocks until every job submitted so far has run
+    void wait() {
+      submit([](sqlite::database::type_ptr) { return true; }).wait();
+    }
+
+  private:
+    background_writer(background_writer const&) = delete;
+    void operator=(background_writer const&) = delete;
+
+    void run() {
+      for (;;) {
+        std::packaged_task<bool()> task;
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          job_queued_.wait(lock, [this]() { return stopping_ || (jobs_.size() != 0); });
+          if (jobs_.size() == 0) break;
+          task = std::move(jobs_.front());
+          jobs_.pop_front();
+        }
+        job_taken_.notify_all();
+        task();
+      }
+      SQLDSML_HPP_LOG("background_writer stopped");
+    }
+
+    sqlite::database::type_ptr db_;
+    size_t max_queued_;
+    bool stopping_;
+    std::deque<std::packaged_task<bool()>> jobs_;
+    std::mutex mutex_;
+    std::condition_variable job_queued_;
+    std::condition_variable job_taken_;
+    std::thread thread_;
+  };
+
+  // Two instances of buffer_t, typically a struct of the caches of one batch: the front
+  // one is filled by the ingesting thread while the back one is written by a
+  // background_writer. flush() waits for the previous write of the back buffer, swaps the
+  // buffers and submits the filled one, so parsing of the next batch overlaps its write.
+  // Entities of one buffer only link to entities of the same buffer.
+  template <typename buffer_t>
+  class double_buffer {
+  public:
+    typedef buffer_t buffer_type;
+
+    template <typename... args_t>
+    double_buffer(const args_t&... args) :
+      front_(new buffer_type(args...)),
+      back_(new buffer_type(args...)) {
+    }
+
+    ~double_buffer() {
+      wait();
+    }
+
+    buffer_type& front() {
+      return *front_;
+    }
+
+    // Buffer handed to the writer by the last flush(); safe to read once that flush's
+    // future is ready, and until the next flush()
+    buffer_type& back() {
+      return *back_;
+    }
+
+    // write(buffer) runs on the writer thread, e.g. syncs the caches of the buffer and
+    // clears the ones that should not be kept for the next fill. The future is ready once
+    // it has returned, i.e. when the ids of the buffer are resolved.
+    template <typename write_t>
+    std::shared_future<bool> flush(background_writer& writer, const write_t& write) {
+      wait();
+      std::swap(front_, back_);
+      buffer_type* b = back_.get();
+      in_flight_ = writer.submit([b, write](sqlite::database::type_ptr) { return write(*b); }).share();
+      return in_flight_;
+    }
+
+    // Blocks until the last flush() has been written
+    void wait() {
+      if (in_flight_.valid()) in_flight_.wait();
+    }
+
+  private:
+    double_buffer(double_buffer const&) = delete;
+    void operator=(double_buffer const&) = delete;
+
+    std::unique_ptr<buffer_type> front_;
+    std::unique_ptr<buffer_type> back_;
+    std::shared_future<bool> in_flight_;
+  };
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace sqldsml {
+  // Second chance (CLOCK) eviction over cache slots. A slot gets its reference bit when it
+  // is found again after being added, so entities seen only once go first; the hand clears
+  // reference bits as it passes and evicts the first unreferenced slot. Owners mark slots
+  // that must stay in memory (e.g. not written yet) with pin bits, pinned slots are skipped.
+  class clock_eviction {
+  public:
+    static const unsigned char referenced = 1;
+
+    clock_eviction() :
+      hand_(0) {
+    }
+
+    clock_eviction(const clock_eviction& other) :
+      flags_(other.flags_),
+      hand_(other.hand_) {
+    }
+
+    clock_eviction(clock_eviction&& other) :
+      flags_(std::move(other.flags_)),
+      hand_(other.hand_) {
+    }
+
+    void swap(clock_eviction& other) {
+      std::swap(flags_, other.flags_);
+      std::swap(hand_, other.hand_);
+    }
+
+    clock_eviction& operator=(const clock_eviction& other) {
+      clock_eviction tmp(other);
+      swap(tmp);
+      return *this;
+    }
+
+    void add(const size_t slot) {
+      if (slot >= flags_.size()) flags_.resize(slot + 1, 0);
+      flags_[slot] = 0;
+    }
+
+    void touch(const size_t slot) {
+      flags_[slot] |= referenced;
+    }
+
+    void pin(const size_t slot, const unsigned char bits) {
+      flags_[slot] |= bits;
+    }
+
+    void unpin(const size_t slot, const unsigned char bits) {
+      flags_[slot] &= ~bits;
+    }
+
+    // Evicts up to n slots for which can_evict(slot) holds, calling evict(slot) on each.
+    // Gives up after two turns of the hand.
+    template <typename can_evict_t, typename evict_t>
+    size_t evict(const size_t n, const can_evict_t& can_evict, const evict_t& evict) {
+      size_t n_evicted = 0;
+      for (size_t step = 0; (n_evicted < n) && (step < 2 * flags_.size()); ++step) {
+        if (hand_ >= flags_.size()) hand_ = 0;
+        const size_t slot = hand_++;
+        if ((flags_[slot] & ~referenced) || !can_evict(slot)) continue;
+        if (flags_[slot] & referenced) {
+          flags_[slot] &= ~referenced;
+          continue;
+        }
+        evict(slot);
+        flags_[slot] = 0;
+        ++n_evicted;
+      }
+      return n_evicted;
+    }
+
+    void clear() {
+      flags_.clear();
+      hand_ = 0;
+    }
+
+  private:
+    std::vector<unsigned char> flags_;
+    size_t hand_;
+  };
+}
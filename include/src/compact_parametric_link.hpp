@@ -0,0 +1,106 @@
+#pragma once
+
+#include <tuple>
+
+namespace sqldsml {
+  // Link between two entities that refers to them by their slots in the owning entity
+  // caches instead of by shared pointers. The composite id is resolved once both
+  // endpoints have ids and is kept in the link afterwards.
+  template <typename entity1_cache_t, typename entity2_cache_t, typename parameters_t>
+  class compact_parametric_link {
+  public:
+    typedef compact_parametric_link<entity1_cache_t, entity2_cache_t, parameters_t> type;
+    typedef entity1_cache_t entity1_cache_type;
+    typedef entity2_cache_t entity2_cache_type;
+    typedef typename entity1_cache_type::slot_type entity1_slot_type;
+    typedef typename entity2_cache_type::slot_type entity2_slot_type;
+    typedef typename entity1_cache_type::id_type entity1_id_type;
+    typedef typename entity2_cache_type::id_type entity2_id_type;
+    typedef parameters_t parameters_type;
+    typedef decltype(std::tuple_cat(entity1_id_type(), entity2_id_type())) id_type;
+    typedef std::tuple<entity1_slot_type, entity2_slot_type> endpoints_type;
+
+    compact_parametric_link(const entity1_slot_type entity1,
+                            const entity2_slot_type entity2,
+                            const parameters_type& parameters) :
+      id_(id_type()),
+      parameters_(parameters),
+      entity1_(entity1),
+      entity2_(entity2) {
+    }
+
+    compact_parametric_link(const compact_parametric_link& other) :
+      id_(other.id_),
+      parameters_(other.parameters_),
+      entity1_(other.entity1_),
+      entity2_(other.entity2_) {
+    }
+
+    compact_parametric_link(compact_parametric_link&& other) :
+      id_(std::move(other.id_)),
+      parameters_(std::move(other.parameters_)),
+      entity1_(other.entity1_),
+      entity2_(other.entity2_) {
+    }
+
+    void swap(compact_parametric_link& other) {
+      if (this != &other) {
+        std::swap(id_, other.id_);
+        std::swap(parameters_, other.parameters_);
+        std::swap(entity1_, other.entity1_);
+        std::swap(entity2_, other.entity2_);
+      }
+    }
+
+    compact_parametric_link& operator=(const compact_parametric_link& other) {
+      compact_parametric_link tmp(other);
+      swap(tmp);
+      return *this;
+    }
+
+    compact_parametric_link& operator=(compact_parametric_link&& other) {
+      swap(other);
+      return *this;
+    }
+
+    // Null id until both endpoints have ids in their caches
+    const id_type& id(const entity1_cache_type& entity1_cache,
+                      const entity2_cache_type& entity2_cache) {
+      if (id_ == id_type()) {
+        const auto& entity1 = entity1_cache.at(entity1_);
+        const auto& entity2 = entity2_cache.at(entity2_);
+        if ((entity1->id() != entity1_id_type()) &&
+            (entity2->id() != entity2_id_type())) {
+          id_ = id_type(std::tuple_cat(entity1->id(), entity2->id()));
+        }
+      }
+      return id_;
+    }
+
+    bool resolved() const {
+      return id_ != id_type();
+    }
+
+    const parameters_type& parameters() const {
+      return parameters_;
+    }
+
+    entity1_slot_type entity1() const {
+      return entity1_;
+    }
+
+    entity2_slot_type entity2() const {
+      return entity2_;
+    }
+
+    endpoints_type endpoints() const {
+      return endpoints_type(entity1_, entity2_);
+    }
+
+  protected:
+    id_type id_;
+    parameters_type parameters_;
+    entity1_slot_type entity1_;
+    entity2_slot_type entity2_;
+  };
+}
@@ -0,0 +1,301 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <sqlite>
+
+#include "compact_parametric_link.hpp"
+#include "logging.hpp"
+#include "open_addressing_map.hpp"
+#include "statement.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+
+namespace sqldsml {
+  template <typename compact_link_t>
+  class compact_parametric_link_cache;
+
+  // Cache of compact links stored by value. Endpoint slots refer to the entity caches
+  // given at construction, so links must be written out (create_links) and cleared
+  // no later than any of those caches is cleared.
+  template <typename compact_link_t>
+  class compact_parametric_link_cache {
+  public:
+    typedef compact_parametric_link_cache<compact_link_t> type;
+    typedef compact_link_t link_type;
+    typedef typename link_type::entity1_cache_type entity1_cache_type;
+    typedef typename link_type::entity2_cache_type entity2_cache_type;
+    typedef typename link_type::entity1_slot_type entity1_slot_type;
+    typedef typename link_type::entity2_slot_type entity2_slot_type;
+    typedef typename link_type::parameters_type parameters_type;
+    typedef typename link_type::id_type id_type;
+    typedef typename link_type::endpoints_type endpoints_type;
+    typedef uint32_t slot_type;
+    typedef std::vector<link_type> link_container_type;
+    typedef open_addressing_map<endpoints_type, slot_type> endpoints_index_type;
+
+    template <typename id_fields_container_t,
+              typename parameter_fields_container_t>
+    compact_parametric_link_cache(sqlite::database::type_ptr db,
+                                  entity1_cache_type& entity1_cache,
+                                  entity2_cache_type& entity2_cache,
+                                  const std::string& table_name,
+                                  const id_fields_container_t& id_fields,
+                                  const parameter_fields_container_t& parameter_fields) :
+      entity1_cache_(&entity1_cache),
+      entity2_cache_(&entity2_cache),
+      db_(db),
+      table_name_(table_name),
+      id_fields_(id_fields.begin(), id_fields.end()),
+      parameter_fields_(parameter_fields.begin(), parameter_fields.end()) {
+    }
+
+    compact_parametric_link_cache(const type& other) :
+      all_links_(other.all_links_),
+      endpoints_index_(other.endpoints_index_),
+      pending_(other.pending_),
+      entity1_cache_(other.entity1_cache_),
+      entity2_cache_(other.entity2_cache_),
+      db_(other.db_),
+      table_name_(other.table_name_),
+      id_fields_(other.id_fields_),
+      parameter_fields_(other.parameter_fields_),
+      select_ids_(other.select_ids_),
+      insert_(other.insert_),
+      counters_(other.counters_) {
+    }
+
+    compact_parametric_link_cache(type&& other) :
+      all_links_(std::move(other.all_links_)),
+      endpoints_index_(std::move(other.endpoints_index_)),
+      pending_(std::move(other.pending_)),
+      entity1_cache_(other.entity1_cache_),
+      entity2_cache_(other.entity2_cache_),
+      db_(std::move(other.db_)),
+      table_name_(std::move(other.table_name_)),
+      id_fields_(std::move(other.id_fields_)),
+      parameter_fields_(std::move(other.parameter_fields_)),
+      select_ids_(std::move(other.select_ids_)),
+      insert_(std::move(other.insert_)),
+      counters_(other.counters_) {
+    }
+
+    void swap(type& other) {
+      std::swap(all_links_, other.all_links_);
+      endpoints_index_.swap(other.endpoints_index_);
+      std::swap(pending_, other.pending_);
+      std::swap(entity1_cache_, other.entity1_cache_);
+      std::swap(entity2_cache_, other.entity2_cache_);
+      std::swap(db_, other.db_);
+      std::swap(table_name_, other.table_name_);
+      std::swap(id_fields_, other.id_fields_);
+      std::swap(parameter_fields_, other.parameter_fields_);
+      std::swap(select_ids_, other.select_ids_);
+      insert_.swap(other.insert_);
+      std::swap(counters_, other.counters_);
+    }
+
+    type& operator=(const type& other) {
+      type tmp(other);
+      swap(tmp);
+      return *this;
+    }
+
+    ~compact_parametric_link_cache() {
+      SQLDSML_HPP_LOG("compact_parametric_link_cache::~compact_parametric_link_cache");
+    }
+
+    // Returned pointers and references are valid until the next add() or clear()
+    link_type* find_by_endpoints(const endpoints_type& endpoints) {
+      auto found = endpoints_index_.find(endpoints);
+      counters_.lookup(found != nullptr);
+      if (found != nullptr) {
+        return &all_links_[*found];
+      } else {
+        return nullptr;
+      }
+    }
+
+    link_type* find_by_slots(const entity1_slot_type entity1, const entity2_slot_type entity2) {
+      return find_by_endpoints(endpoints_type(entity1, entity2));
+    }
+
+    link_type& add(const link_type& link) {
+      const slot_type new_slot = static_cast<slot_type>(all_links_.size());
+      auto inserted = endpoints_index_.insert(link.endpoints(), new_slot);
+      counters_.add(!inserted.second);
+      if (inserted.second) {
+        assert(all_links_.size() < std::numeric_limits<slot_type>::max());
+        all_links_.push_back(link);
+        pending_.push_back(new_slot);
+      }
+      return all_links_[*inserted.first];
+    }
+
+    link_type& add(const entity1_slot_type entity1,
+                   const entity2_slot_type entity2,
+                   const parameters_type& parameters) {
+      return add(link_type(entity1, entity2, parameters));
+    }
+
+    typename link_container_type::iterator begin() {
+      return all_links_.begin();
+    }
+
+    typename link_container_type::iterator end() {
+      return all_links_.end();
+    }
+
+    size_t size() {
+      return all_links_.size();
+    }
+
+    void reserve(const size_t n) {
+      all_links_.reserve(n);
+      endpoints_index_.reserve(n);
+    }
+
+    // load_ids() resolves more pending keys than this through a temporary table join
+    // instead of batched selects
+    void set_load_join_threshold(const size_t join_threshold) {
+      select_ids_.set_join_threshold(join_threshold);
+    }
+
+    // Links added since the last create_links() that are not written yet
+    size_t pending_size() const {
+      return pending_.size();
+    }
+
+    // Writes the links added since the last sync, links whose endpoints have no ids yet
+    // stay pending. Links whose insert failed are looked up, those already in the table
+    // are taken off pending. Returns false if some links are left pending.
+    bool sync() {
+      if (create_links() != 0) load_ids();
+      return pending_.size() == 0;
+    }
+
+    void clear() {
+      pending_.clear();
+      all_links_.clear();
+      endpoints_index_.clear();
+    }
+
+    link_container_type& all_links() {
+      return all_links_;
+    }
+
+    cache_stats stats() const {
+      cache_stats s;
+      s.statements_prepared = select_ids_.prepare_count() + insert_.prepare_count();
+      counters_.fill(s);
+      return s;
+    }
+
+    void reset_stats() {
+      counters_.reset();
+    }
+
+    // Looks up pending links by the ids of their endpoints and takes those already in the
+    // table off pending, so create_links() does not insert them again. Returns the number
+    // of links found.
+    size_t load_ids() {
+      assert(id_fields_.size() == std::tuple_size<id_type>::value);
+      cache_counters::timer t(counters_, &cache_stats::load_seconds, &cache_stats::load_ids_seconds);
+      trace_span span("load_ids", table_name_);
+      open_addressing_map<id_type, unsigned char> requested;
+      std::vector<id_type> ids;
+      for (auto slot : pending_) {
+        const id_type id(all_links_[slot].id(*entity1_cache_, *entity2_cache_));
+        if ((id != id_type()) && requested.insert(id, 0).second) {
+          ids.push_back(id);
+        }
+      }
+      std::vector<const id_type*> keys;
+      keys.reserve(ids.size());
+      for (auto &id : ids) {
+        keys.push_back(&id);
+      }
+
+      auto build_prefix = [this]() {
+        return "SELECT " + quoted_fields(id_fields_) + " FROM `" + table_name_ + "`";
+      };
+      const size_t n_selected = select_ids_.run(db_, build_prefix, id_fields_, keys, [&requested](const id_type& r) {
+          auto found = requested.find(r);
+          if (found != nullptr) {
+            *found = 1;
+          }
+        });
+      assert(n_selected <= keys.size());
+      std::vector<slot_type> still_pending;
+      for (auto slot : pending_) {
+        auto found = requested.find(all_links_[slot].id(*entity1_cache_, *entity2_cache_));
+        if ((found == nullptr) || (*found == 0)) {
+          still_pending.push_back(slot);
+        }
+      }
+      pending_.swap(still_pending);
+      counters_.loaded(keys.size(), n_selected);
+      span.rows(n_selected);
+      SQLDSML_HPP_LOG_INFO(std::string("load_ids() loaded ") + std::to_string(n_selected) + " out of requested " + std::to_string(keys.size()));
+      return n_selected;
+    }
+
+    // Inserts pending links whose endpoints have ids. Links whose insert fails stay pending
+    // and are not counted as inserted; returns their number.
+    size_t create_links() {
+      typedef decltype(std::tuple_cat(id_type(), parameters_type())) insert_record_type;
+      cache_counters::timer t(counters_, &cache_stats::insert_seconds, &cache_stats::insert_ids_seconds);
+      trace_span span("create_links", table_name_);
+      sqlite::query& insert = insert_.get(db_, [this]() {
+          return "INSERT INTO `" + table_name_ + "` (" + quoted_fields(id_fields_) + ", " +
+            quoted_fields(parameter_fields_) + ") VALUES (" +
+            placeholders(id_fields_.size() + parameter_fields_.size()) + ")";
+        });
+      savepoint sp(db_, "sqldsml_create_links");
+      std::vector<slot_type> unresolved;
+      size_t n_inserted = 0;
+      size_t n_failed = 0;
+      for (auto slot : pending_) {
+        auto &l = all_links_[slot];
+        const id_type& id = l.id(*entity1_cache_, *entity2_cache_);
+        if (id != id_type()) {
+          const int rc = execute_tuple(insert, insert_record_type(std::tuple_cat(id, l.parameters())));
+          if (rc == SQLITE_DONE) {
+            ++n_inserted;
+            continue;
+          }
+          SQLDSML_HPP_LOG_WARN(std::string("create_links() insert failed with code ") + std::to_string(rc));
+          ++n_failed;
+        }
+        unresolved.push_back(slot);
+      }
+      sp.release();
+      counters_.inserted(n_inserted);
+      span.rows(n_inserted);
+      SQLDSML_HPP_LOG_INFO(std::string("create_links() inserted ") + std::to_string(n_inserted) +
+                      " out of " + std::to_string(pending_.size()));
+      pending_.swap(unresolved);
+      return n_failed;
+    }
+
+  private:
+    link_container_type all_links_;
+    endpoints_index_type endpoints_index_;
+    std::vector<slot_type> pending_;
+    entity1_cache_type* entity1_cache_;
+    entity2_cache_type* entity2_cache_;
+    sqlite::database::type_ptr db_;
+    std::string table_name_;
+    std::vector<std::string> id_fields_;
+    std::vector<std::string> parameter_fields_;
+    keyed_select<id_type, id_type> select_ids_;
+    prepared_query insert_;
+    cache_counters counters_;
+  };
+}
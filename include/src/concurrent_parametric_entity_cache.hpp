@@ -0,0 +1,322 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sqlite>
+
+#include "direct_index.hpp"
+#include "logging.hpp"
+#include "parametric_entity_cache.hpp"
+#include "statement.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+#include "tuple_hash.hpp"
+
+namespace sqldsml {
+  // parametric_entity_cache that can be filled from several threads. Entities are spread
+  // over shard_count shards by the hash of their parameters, each shard is a
+  // parametric_entity_cache behind its own mutex, so add() and find_by_parameters() from
+  // different threads only contend when they hit the same shard. sync() locks every shard
+  // and resolves the pending entities of all of them in one savepoint, with one keyed
+  // select and one insert pass; ids of returned entities must not be read while a sync()
+  // is running. Id allocators are not supported, they are not thread-safe.
+  template <typename parametric_entity_t,
+            typename storage_t = heap_entity_storage<parametric_entity_t>,
+            size_t shard_count = 16>
+  class concurrent_parametric_entity_cache {
+  public:
+    typedef concurrent_parametric_entity_cache<parametric_entity_t, storage_t, shard_count> type;
+    typedef parametric_entity_cache<parametric_entity_t, storage_t> shard_cache_type;
+    typedef parametric_entity_t parametric_entity_type;
+    typedef typename shard_cache_type::parametric_entity_type_ptr parametric_entity_type_ptr;
+    typedef typename shard_cache_type::parameters_type parameters_type;
+    typedef typename shard_cache_type::id_type id_type;
+
+    static_assert(shard_count > 0, "concurrent cache needs at least one shard");
+
+    template <typename id_fields_container_t,
+              typename parameter_fields_container_t>
+    concurrent_parametric_entity_cache(sqlite::database::type_ptr db,
+                                       const std::string& table_name,
+                                       const id_fields_container_t& id_fields,
+                                       const parameter_fields_container_t& parameter_fields) :
+      db_(db),
+      table_name_(table_name),
+      id_fields_(id_fields.begin(), id_fields.end()),
+      parameter_fields_(parameter_fields.begin(), parameter_fields.end()) {
+      shards_.reserve(shard_count);
+      for (size_t i = 0; i < shard_count; ++i) {
+        shards_.emplace_back(new shard(db, table_name, id_fields, parameter_fields));
+      }
+    }
+
+    ~concurrent_parametric_entity_cache() {
+      SQLDSML_HPP_LOG("concurrent_parametric_entity_cache::~concurrent_parametric_entity_cache");
+    }
+
+    parametric_entity_type_ptr find_by_parameters(const parameters_type& parameters) const {
+      shard& s = shard_of(parameters);
+      std::lock_guard<std::mutex> lock(s.mutex);
+      return s.cache.find_by_parameters(parameters);
+    }
+
+    parametric_entity_type_ptr add(const parametric_entity_type& parametric_entity) {
+      shard& s = shard_of(parametric_entity.parameters());
+      std::lock_guard<std::mutex> lock(s.mutex);
+      return s.cache.add(parametric_entity);
+    }
+
+    // Calls fn on every cached entity (null for evicted ones) with all shards locked
+    template <typename fn_t>
+    void for_each(const fn_t& fn) {
+      all_locks locks(shards_);
+      for (auto &s : shards_) {
+        for (auto &f : s->cache) {
+          fn(f);
+        }
+      }
+    }
+
+    size_t size() {
+      all_locks locks(shards_);
+      size_t n = 0;
+      for (auto &s : shards_) {
+        n += s->cache.size();
+      }
+      return n;
+    }
+
+    // Number of cached entities per shard, to check how evenly the parameters spread
+    std::vector<size_t> shard_sizes() {
+      all_locks locks(shards_);
+      std::vector<size_t> sizes;
+      sizes.reserve(shard_count);
+      for (auto &s : shards_) {
+        sizes.push_back(s->cache.size());
+      }
+      return sizes;
+    }
+
+    size_t pending_size() {
+      all_locks locks(shards_);
+      size_t n = 0;
+      for (auto &s : shards_) {
+        n += s->cache.pending_size();
+      }
+      return n;
+    }
+
+    void reserve(const size_t n) {
+      all_locks locks(shards_);
+      for (auto &s : shards_) {
+        s->cache.reserve(n / shard_count + 1);
+      }
+    }
+
+    // Capacity of the whole cache, split evenly between the shards
+    void set_capacity(const size_t capacity) {
+      all_locks locks(shards_);
+      for (auto &s : shards_) {
+        s->cache.set_capacity(capacity == 0 ? 0 : capacity / shard_count + 1);
+      }
+    }
+
+    void set_load_join_threshold(const size_t join_threshold) {
+      all_locks locks(shards_);
+      select_ids_.set_join_threshold(join_threshold);
+      for (auto &s : shards_) {
+        s->cache.set_load_join_threshold(join_threshold);
+      }
+    }
+
+    // Syncs all shards in one savepoint while adds are blocked: pending entities of every
+    // shard are looked up together, then the missing ones are inserted. If the savepoint
+    // cannot be released it is rolled back and sync() returns false, but ids already
+    // assigned in memory are not, so the cache should be cleared. Returns false as well if
+    // entities are left pending.
+    bool sync() {
+      trace_span span("concurrent_parametric_entity_cache::sync", "");
+      all_locks locks(shards_);
+      savepoint sp(db_, "sqldsml_concurrent_sync");
+      std::vector<parametric_entity_type_ptr> pending;
+      for (auto &s : shards_) {
+        s->cache.for_each_pending([&pending](const parametric_entity_type_ptr& f) {
+            pending.push_back(f);
+          });
+      }
+      if (pending.size() != 0) {
+        load_ids(pending);
+        insert_ids(pending);
+      }
+      bool ok = true;
+      for (auto &s : shards_) {
+        ok = s->cache.finish_sync() && ok;
+      }
+      const int rc = sp.release();
+      if (rc != SQLITE_DONE) {
+        SQLDSML_HPP_LOG_WARN(std::string("concurrent_parametric_entity_cache::sync failed with code ") + std::to_string(rc));
+        return false;
+      }
+      return ok;
+    }
+
+    void clear() {
+      all_locks locks(shards_);
+      for (auto &s : shards_) {
+        s->cache.clear();
+      }
+    }
+
+    cache_stats stats() {
+      all_locks locks(shards_);
+      cache_stats total;
+      for (auto &s : shards_) {
+        total += s->cache.stats();
+      }
+      total.statements_prepared += select_ids_.prepare_count() + insert_.prepare_count() +
+        last_rowid_.prepare_count();
+      counters_.fill(total);
+      return total;
+    }
+
+    void reset_stats() {
+      all_locks locks(shards_);
+      counters_.reset();
+      for (auto &s : shards_) {
+        s->cache.reset_stats();
+      }
+    }
+
+  private:
+    struct shard {
+      template <typename id_fields_container_t,
+                typename parameter_fields_container_t>
+      shard(sqlite::database::type_ptr db,
+            const std::string& table_name,
+            const id_fields_container_t& id_fields,
+            const parameter_fields_container_t& parameter_fields) :
+        cache(db, table_name, id_fields, parameter_fields) {
+      }
+
+      std::mutex mutex;
+      shard_cache_type cache;
+    };
+
+    typedef std::vector<std::unique_ptr<shard>> shards_type;
+
+    // Locks every shard in index order, so two whole cache operations cannot deadlock
+    class all_locks {
+    public:
+      all_locks(const shards_type& shards) :
+        shards_(shards) {
+        for (auto &s : shards_) {
+          s->mutex.lock();
+        }
+      }
+
+      ~all_locks() {
+        for (auto &s : shards_) {
+          s->mutex.unlock();
+        }
+      }
+
+    private:
+      all_locks(all_locks const&) = delete;
+      void operator=(all_locks const&) = delete;
+
+      const shards_type& shards_;
+    };
+
+    concurrent_parametric_entity_cache(concurrent_parametric_entity_cache const&) = delete;
+    void operator=(concurrent_parametric_entity_cache const&) = delete;
+
+    typedef decltype(std::tuple_cat(id_type(), parameters_type())) select_record_type;
+    typedef typename parameters_index_traits<parameters_type, uint32_t>::type pending_index_type;
+
+    // Sets the ids of the pending entities of all shards found in the table
+    void load_ids(const std::vector<parametric_entity_type_ptr>& pending) {
+      cache_counters::timer t(counters_, &cache_stats::load_seconds, &cache_stats::load_ids_seconds);
+      trace_span span("load_ids", table_name_);
+      pending_index_type index;
+      index.reserve(pending.size());
+      std::vector<const parameters_type*> keys;
+      keys.reserve(pending.size());
+      for (size_t i = 0; i < pending.size(); ++i) {
+        index.insert(pending[i]->parameters(), static_cast<uint32_t>(i));
+        keys.push_back(&pending[i]->parameters());
+      }
+      auto build_prefix = [this]() {
+        return "SELECT " + quoted_fields(id_fields_) + ", " + quoted_fields(parameter_fields_) +
+          " FROM `" + table_name_ + "`";
+      };
+      const size_t n_selected = select_ids_.run(db_, build_prefix, parameter_fields_, keys,
+                                                [&index, &pending](const select_record_type& r) {
+          auto found = index.find(sqlite::tuple_tail(r));
+          if (found != nullptr) {
+            pending[*found]->id() = id_type(std::get<0>(r));
+          }
+        });
+      counters_.loaded(keys.size(), n_selected);
+      span.rows(n_selected);
+      SQLDSML_HPP_LOG_INFO(std::string("concurrent_parametric_entity_cache::load_ids() loaded ") +
+                           std::to_string(n_selected) + " out of requested " + std::to_string(keys.size()));
+    }
+
+    // Inserts the pending entities of all shards still without ids; entities whose insert
+    // fails stay pending
+    void insert_ids(const std::vector<parametric_entity_type_ptr>& pending) {
+      cache_counters::timer t(counters_, &cache_stats::insert_seconds, &cache_stats::insert_ids_seconds);
+      trace_span span("insert_ids", table_name_);
+      sqlite::query& insert = insert_.get(db_, [this]() {
+          return "INSERT INTO `" + table_name_ + "` (" + quoted_fields(parameter_fields_) +
+            ") VALUES (" + placeholders(parameter_fields_.size()) + ")";
+        });
+      sqlite::query& last_rowid = last_rowid_.get(db_, []() { return std::string("SELECT last_insert_rowid()"); });
+      size_t n_inserted = 0;
+      for (auto &f : pending) {
+        if (f->id() != id_type()) continue;
+        const int rc = execute_tuple(insert, f->parameters());
+        if (rc == SQLITE_DONE) {
+          typename std::tuple_element<0, id_type>::type id;
+          last_rowid.step();
+          last_rowid.get(0, id);
+          last_rowid.reset();
+          f->id() = id_type(id);
+          ++n_inserted;
+        } else {
+          SQLDSML_HPP_LOG_WARN(std::string("concurrent_parametric_entity_cache::insert_ids() insert failed with code ") +
+                               std::to_string(rc));
+        }
+      }
+      counters_.inserted(n_inserted);
+      span.rows(n_inserted);
+    }
+
+    shard& shard_of(const parameters_type& parameters) const {
+      // Finalize the hash as open_addressing_map does, std::hash of integers is the
+      // identity on common implementations and strided keys would share a shard
+      uint64_t h = tuple_hash<parameters_type>()(parameters);
+      h ^= h >> 33;
+      h *= 0xff51afd7ed558ccdULL;
+      h ^= h >> 33;
+      h *= 0xc4ceb9fe1a85ec53ULL;
+      h ^= h >> 33;
+      return *shards_[static_cast<size_t>(h % shard_count)];
+    }
+
+    sqlite::database::type_ptr db_;
+    std::string table_name_;
+    std::vector<std::string> id_fields_;
+    std::vector<std::string> parameter_fields_;
+    shards_type shards_;
+    keyed_select<select_record_type, parameters_type> select_ids_;
+    prepared_query insert_;
+    prepared_query last_rowid_;
+    cache_counters counters_;
+  };
+}
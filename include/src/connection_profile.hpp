@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <sqlite>
+
+#include "logging.hpp"
+#include "statement.hpp"
+
+namespace sqldsml {
+  // PRAGMA settings for a connection doing ingestion. Empty strings and negative numbers
+  // leave a setting as it is. checkpoint_every schedules wal_checkpoint calls every that
+  // many syncs of a sync_coordinator, after its transaction commits, so the WAL is folded
+  // back between flushes; a zero or large wal_autocheckpoint keeps SQLite from doing it
+  // within one. A checkpoint of checkpoint_mode that does not complete is retried at once
+  // in escalation_mode, if set.
+  struct connection_profile {
+    connection_profile() :
+      cache_size_kib(-1),
+      mmap_size(-1),
+      wal_autocheckpoint(-1),
+      checkpoint_every(0),
+      checkpoint_mode("PASSIVE") {
+    }
+
+    // Initial load of a database nobody else reads: no fsyncs, large page cache and the
+    // WAL truncated after every sync. A crash may corrupt the database.
+    static connection_profile bulk_load() {
+      connection_profile p;
+      p.journal_mode = "WAL";
+      p.synchronous = "OFF";
+      p.cache_size_kib = 256 * 1024;
+      p.mmap_size = int64_t(1) << 30;
+      p.temp_store = "MEMORY";
+      p.wal_autocheckpoint = 0;
+      p.checkpoint_every = 1;
+      p.checkpoint_mode = "TRUNCATE";
+      return p;
+    }
+
+    // Continuous ingestion next to readers: durable up to the last checkpoint. Scheduled
+    // checkpoints are PASSIVE and never wait for readers, but while readers keep old
+    // snapshots open they cannot complete and the WAL keeps growing. Two things bound it:
+    // an incomplete checkpoint escalates to RESTART, which waits for readers as long as the
+    // busy handler allows and makes the next writer start the WAL over; and a large
+    // wal_autocheckpoint (64 MiB of 4 KiB pages) backs up the schedule. The price is an
+    // occasional commit that runs a checkpoint, and writers that wait for the RESTART.
+    static connection_profile steady_state() {
+      connection_profile p;
+      p.journal_mode = "WAL";
+      p.synchronous = "NORMAL";
+      p.cache_size_kib = 64 * 1024;
+      p.mmap_size = int64_t(256) << 20;
+      p.temp_store = "MEMORY";
+      p.wal_autocheckpoint = 16384;
+      p.checkpoint_every = 4;
+      p.checkpoint_mode = "PASSIVE";
+      p.escalation_mode = "RESTART";
+      return p;
+    }
+
+    // Must be called outside of a transaction, the journal mode cannot change within one.
+    // Returns false if a setting was not taken, e.g. WAL on an in-memory database.
+    bool apply(const sqlite::database::type_ptr& db) const {
+      bool ok = true;
+      if (journal_mode.size() != 0) {
+        sqlite::query q(db, "PRAGMA journal_mode = " + journal_mode);
+        q.step();
+        std::string mode;
+        if (q.result_code() == SQLITE_ROW) q.get(0, mode);
+        if (!same_name(mode, journal_mode)) {
+          SQLDSML_HPP_LOG_WARN("connection_profile::apply journal_mode is " + mode + ", not " + journal_mode);
+          ok = false;
+        }
+      }
+      if (synchronous.size() != 0) ok = pragma(db, "synchronous = " + synchronous) && ok;
+      if (cache_size_kib >= 0) ok = pragma(db, "cache_size = -" + std::to_string(cache_size_kib)) && ok;
+      if (mmap_size >= 0) ok = pragma(db, "mmap_size = " + std::to_string(mmap_size)) && ok;
+      if (temp_store.size() != 0) ok = pragma(db, "temp_store = " + temp_store) && ok;
+      if (wal_autocheckpoint >= 0) ok = pragma(db, "wal_autocheckpoint = " + std::to_string(wal_autocheckpoint)) && ok;
+      SQLDSML_HPP_LOG_INFO(std::string("connection_profile::apply ") + (ok ? "applied" : "partly applied"));
+      return ok;
+    }
+
+    // Runs a checkpoint of checkpoint_mode, then one of escalation_mode if the first could
+    // not complete, e.g. a PASSIVE one while readers hold old pages; returns false if the
+    // last one run did not complete either
+    bool checkpoint(const sqlite::database::type_ptr& db) const {
+      if (run_checkpoint(db, checkpoint_mode)) return true;
+      if (escalation_mode.size() == 0) return false;
+      SQLDSML_HPP_LOG_INFO("connection_profile::checkpoint escalating to " + escalation_mode);
+      return run_checkpoint(db, escalation_mode);
+    }
+
+    std::string journal_mode;
+    std::string synchronous;
+    int64_t cache_size_kib;
+    int64_t mmap_size;
+    std::string temp_store;
+    int64_t wal_autocheckpoint;
+    size_t checkpoint_every;
+    std::string checkpoint_mode;
+    std::string escalation_mode;
+
+  private:
+    static bool run_checkpoint(const sqlite::database::type_ptr& db, const std::string& mode) {
+      sqlite::query q(db, "PRAGMA wal_checkpoint(" + mode + ")");
+      q.step();
+      int64_t busy = 1;
+      int64_t log_frames = 0;
+      int64_t checkpointed_frames = 0;
+      if (q.result_code() == SQLITE_ROW) {
+        q.get(0, busy);
+        q.get(1, log_frames);
+        q.get(2, checkpointed_frames);
+      }
+      SQLDSML_HPP_LOG_INFO("connection_profile::checkpoint " + mode + " " + std::to_string(checkpointed_frames) +
+                           " of " + std::to_string(log_frames) + " frames");
+      return (busy == 0) && (checkpointed_frames == log_frames);
+    }
+
+    static bool pragma(const sqlite::database::type_ptr& db, const std::string& setting) {
+      const int rc = execute(db, "PRAGMA " + setting);
+      if ((rc != SQLITE_DONE) && (rc != SQLITE_ROW)) {
+        SQLDSML_HPP_LOG_WARN("connection_profile::apply PRAGMA " + setting + " failed with code " + std::to_string(rc));
+        return false;
+      }
+      return true;
+    }
+
+    static bool same_name(const std::string& a, const std::string& b) {
+      if (a.size() != b.size()) return false;
+      for (size_t i = 0; i < a.size(); ++i) {
+        if (std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i]))) return false;
+      }
+      return true;
+    }
+  };
+}
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "open_addressing_map.hpp"
+
+namespace sqldsml {
+  // Map from single integer tuples to unsigned integers (cache slots) addressed directly by
+  // the key. Keys in [0, max_direct_key) live in a paged array allocated page by page as
+  // keys show up, so dense ranges such as feature indexes need no hashing and a lookup is
+  // a page table load and an element load. Other keys go to a hash map. The maximum mapped
+  // value is reserved to mark empty elements. Same interface as open_addressing_map.
+  template <typename key_t, typename mapped_t>
+  class direct_index {
+  public:
+    typedef direct_index<key_t, mapped_t> type;
+    typedef key_t key_type;
+    typedef mapped_t mapped_type;
+    typedef typename std::tuple_element<0, key_type>::type integral_type;
+    typedef std::vector<mapped_type> page_type;
+
+    static const size_t page_bits = 12;
+    static const uint64_t max_direct_key = uint64_t(1) << 28;
+
+    static_assert(std::tuple_size<key_type>::value == 1, "direct_index key must be a single element tuple");
+    static_assert(std::is_integral<integral_type>::value, "direct_index key must be integral");
+    static_assert(std::is_unsigned<mapped_type>::value, "direct_index mapped type must be unsigned");
+
+    direct_index() :
+      size_(0) {
+    }
+
+    direct_index(const type& other) :
+      pages_(other.pages_),
+      overflow_(other.overflow_),
+      size_(other.size_) {
+    }
+
+    direct_index(type&& other) :
+      pages_(std::move(other.pages_)),
+      overflow_(std::move(other.overflow_)),
+      size_(other.size_) {
+      other.size_ = 0;
+    }
+
+    void swap(type& other) {
+      std::swap(pages_, other.pages_);
+      overflow_.swap(other.overflow_);
+      std::swap(size_, other.size_);
+    }
+
+    type& operator=(const type& other) {
+      type tmp(other);
+      swap(tmp);
+      return *this;
+    }
+
+    mapped_type* find(const key_type& key) {
+      const uint64_t k = static_cast<uint64_t>(std::get<0>(key));
+      if (k >= max_direct_key) return overflow_.find(key);
+      const size_t page = static_cast<size_t>(k >> page_bits);
+      if ((page >= pages_.size()) || pages_[page].empty()) return nullptr;
+      mapped_type* found = &pages_[page][k & page_mask()];
+      return (*found != vacant()) ? found : nullptr;
+    }
+
+    const mapped_type* find(const key_type& key) const {
+      return const_cast<type*>(this)->find(key);
+    }
+
+    // Returns pointer to the mapped value and true if it was inserted, false if key was already present
+    std::pair<mapped_type*, bool> insert(const key_type& key, const mapped_type& mapped) {
+      assert(mapped != vacant());
+      const uint64_t k = static_cast<uint64_t>(std::get<0>(key));
+      if (k >= max_direct_key) {
+        auto inserted = overflow_.insert(key, mapped);
+        if (inserted.second) ++size_;
+        return inserted;
+      }
+      const size_t page = static_cast<size_t>(k >> page_bits);
+      if (page >= pages_.size()) pages_.resize(page + 1);
+      if (pages_[page].empty()) pages_[page].assign(page_size(), vacant());
+      mapped_type* element = &pages_[page][k & page_mask()];
+      if (*element != vacant()) return std::make_pair(element, false);
+      *element = mapped;
+      ++size_;
+      return std::make_pair(element, true);
+    }
+
+    bool erase(const key_type& key) {
+      mapped_type* found = find(key);
+      if (found == nullptr) return false;
+      if (static_cast<uint64_t>(std::get<0>(key)) >= max_direct_key) {
+        overflow_.erase(key);
+      } else {
+        *found = vacant();
+      }
+      --size_;
+      return true;
+    }
+
+    // Pages are allocated as keys are inserted. The overflow map only holds keys past
+    // max_direct_key, few if any, so reserving it for n keys would waste memory; does nothing.
+    void reserve(const size_t) {
+    }
+
+    void clear() {
+      pages_.clear();
+      overflow_.clear();
+      size_ = 0;
+    }
+
+    size_t size() const {
+      return size_;
+    }
+
+    bool empty() const {
+      return size_ == 0;
+    }
+
+    template <typename function_t>
+    void for_each(function_t f) {
+      for (size_t page = 0; page < pages_.size(); ++page) {
+        for (size_t i = 0; i < pages_[page].size(); ++i) {
+          if (pages_[page][i] != vacant()) {
+            f(key_type(static_cast<integral_type>((uint64_t(page) << page_bits) | i)), pages_[page][i]);
+          }
+        }
+      }
+      overflow_.for_each(f);
+    }
+
+  private:
+    static mapped_type vacant() {
+      return std::numeric_limits<mapped_type>::max();
+    }
+
+    static size_t page_size() {
+      return size_t(1) << page_bits;
+    }
+
+    static uint64_t page_mask() {
+      return page_size() - 1;
+    }
+
+    std::vector<page_type> pages_;
+    open_addressing_map<key_type, mapped_type> overflow_;
+    size_t size_;
+  };
+
+  // Index from parameters to cache slots: direct_index for single integer parameters (e.g.
+  // a feature index or a natural sample id), open_addressing_map otherwise
+  template <typename key_t, typename mapped_t>
+  struct parameters_index_traits {
+    typedef open_addressing_map<key_t, mapped_t> type;
+  };
+
+  template <typename integral_t, typename mapped_t>
+  struct parameters_index_traits<std::tuple<integral_t>, mapped_t> {
+    typedef typename std::conditional<std::is_integral<integral_t>::value && std::is_unsigned<mapped_t>::value,
+                                      direct_index<std::tuple<integral_t>, mapped_t>,
+                                      open_addressing_map<std::tuple<integral_t>, mapped_t>>::type type;
+  };
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+namespace sqldsml {
+  // Default storage policy for entity caches: every entity is a separate heap allocation.
+  // make() constructs the entity from a copy of another one or from its parameters.
+  template <typename entity_t>
+  class heap_entity_storage {
+  public:
+    typedef entity_t entity_type;
+    typedef std::shared_ptr<entity_type> entity_type_ptr;
+
+    template <typename source_t>
+    entity_type_ptr make(const source_t& source) {
+      return entity_type_ptr(new entity_type(source));
+    }
+
+    void clear() {
+    }
+  };
+
+  // Arena storage policy for entity caches: entities are constructed in place in
+  // contiguous chunks of chunk_size entities. Returned pointers share ownership of the
+  // chunk (aliasing shared_ptr), so there is one allocation per chunk and handles stay
+  // valid for as long as they are held, even after the cache is cleared.
+  template <typename entity_t, size_t chunk_size = 4096>
+  class arena_entity_storage {
+  public:
+    typedef arena_entity_storage<entity_t, chunk_size> type;
+    typedef entity_t entity_type;
+    typedef std::shared_ptr<entity_type> entity_type_ptr;
+
+    static_assert(chunk_size > 0, "arena chunk size must be positive");
+
+    arena_entity_storage() {
+    }
+
+    // Copies never append to the chunk of the original
+    arena_entity_storage(const type&) {
+    }
+
+    arena_entity_storage(type&& other) :
+      current_(std::move(other.current_)) {
+    }
+
+    type& operator=(const type&) {
+      current_.reset();
+      return *this;
+    }
+
+    type& operator=(type&& other) {
+      current_ = std::move(other.current_);
+      return *this;
+    }
+
+    template <typename source_t>
+    entity_type_ptr make(const source_t& source) {
+      if ((current_ == nullptr) || (current_->size == chunk_size)) {
+        current_ = std::make_shared<chunk>();
+      }
+      return entity_type_ptr(current_, current_->emplace(source));
+    }
+
+    // Drops the arena's reference to the current chunk, chunks are freed as soon as
+    // the last entity pointer into them is released
+    void clear() {
+      current_.reset();
+    }
+
+  private:
+    struct chunk {
+      chunk() :
+        size(0) {
+      }
+
+      ~chunk() {
+        for (size_t i = 0; i < size; ++i) {
+          at(i)->~entity_type();
+        }
+      }
+
+      entity_type* at(const size_t i) {
+        return reinterpret_cast<entity_type*>(&storage[i]);
+      }
+
+      template <typename source_t>
+      entity_type* emplace(const source_t& source) {
+        entity_type* p = new (at(size)) entity_type(source);
+        ++size;
+        return p;
+      }
+
+      typename std::aligned_storage<sizeof(entity_type), alignof(entity_type)>::type storage[chunk_size];
+      size_t size;
+    };
+
+    std::shared_ptr<chunk> current_;
+  };
+}
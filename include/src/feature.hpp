@@ -4,6 +4,7 @@
 
 #include <tuple>
 
+#include "concurrent_parametric_entity_cache.hpp"
 #include "logging.hpp"
 #include "parametric_entity.hpp"
 #include "parametric_entity_cache.hpp"
@@ -16,9 +17,17 @@ namespace sqldsml {
     using parametric_entity<std::tuple<int64_t>, parameters_t>::parametric_entity;
   };
 
-  template <typename feature_t>
-  class feature_cache : public parametric_entity_cache<feature_t> {
-    using parametric_entity_cache<feature_t>::parametric_entity_cache;
+  template <typename feature_t,
+            typename storage_t = heap_entity_storage<feature_t>>
+  class feature_cache : public parametric_entity_cache<feature_t, storage_t> {
+    using parametric_entity_cache<feature_t, storage_t>::parametric_entity_cache;
+  };
+
+  template <typename feature_t,
+            typename storage_t = heap_entity_storage<feature_t>,
+            size_t shard_count = 16>
+  class concurrent_feature_cache : public concurrent_parametric_entity_cache<feature_t, storage_t, shard_count> {
+    using concurrent_parametric_entity_cache<feature_t, storage_t, shard_count>::concurrent_parametric_entity_cache;
   };
 
   template <typename parameters_t>
@@ -26,9 +35,10 @@ namespace sqldsml {
     using relational_parametric_entity<parameters_t>::relational_parametric_entity;
   };
   
-  template <typename feature_t>
-  class relational_feature_cache : public relational_parametric_entity_cache<feature_t> {
-    using relational_parametric_entity_cache<feature_t>::relational_parametric_entity_cache;
+  template <typename feature_t,
+            typename storage_t = heap_entity_storage<feature_t>>
+  class relational_feature_cache : public relational_parametric_entity_cache<feature_t, storage_t> {
+    using relational_parametric_entity_cache<feature_t, storage_t>::relational_parametric_entity_cache;
   };
 
 }
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <sqlite>
+
+#include "logging.hpp"
+#include "statement.hpp"
+
+namespace sqldsml {
+  // Hands out ids for a table from blocks reserved in a sequence table, so entities can get
+  // their ids when they are added to a cache instead of after the rows are written.
+  // Reservation is a write transaction on the sequence row, so several processes sharing
+  // the database get disjoint blocks. Every writer of the table must take its ids from the
+  // same sequence, otherwise AUTOINCREMENT inserts may collide with reserved ids.
+  class sequence_id_allocator {
+  public:
+    typedef std::shared_ptr<sequence_id_allocator> type_ptr;
+
+    sequence_id_allocator(sqlite::database::type_ptr db,
+                          const std::string& table_name,
+                          const std::string& id_field = "id",
+                          const int64_t block_size = 4096,
+                          const std::string& sequence_table_name = "sqldsml_sequence") :
+      db_(db),
+      table_name_(table_name),
+      id_field_(id_field),
+      block_size_(block_size),
+      sequence_table_name_(sequence_table_name),
+      next_(0),
+      end_(0) {
+      const int rc = execute(db_, "CREATE TABLE IF NOT EXISTS `" + sequence_table_name_ + "` \
+(`name` TEXT PRIMARY KEY, `next_id` INTEGER NOT NULL)");
+      if (rc != SQLITE_DONE) {
+        SQLDSML_HPP_LOG_WARN("sequence_id_allocator could not create `" + sequence_table_name_ + "`, code " +
+                             std::to_string(rc));
+      }
+    }
+
+    // Returns 0 (null id) if a block could not be reserved, the entity is then resolved
+    // through the database as usual
+    int64_t next() {
+      if ((next_ == end_) && !reserve()) {
+        return 0;
+      }
+      return next_++;
+    }
+
+    // Ids reserved by this allocator but not handed out yet are simply skipped
+    int64_t remaining() const {
+      return end_ - next_;
+    }
+
+  private:
+    sequence_id_allocator(sequence_id_allocator const&) = delete;
+    void operator=(sequence_id_allocator const&) = delete;
+
+    // Runs a statement taking the table name as its only parameter
+    int execute_for_table(const std::string& query_str) {
+      sqlite::query q(db_, query_str);
+      q.bind(1, table_name_);
+      q.step();
+      return q.result_code();
+    }
+
+    bool reserve() {
+      // First statement of the savepoint writes, so the write lock is taken before
+      // the sequence is read back
+      savepoint sp(db_, "sqldsml_reserve_ids");
+      int rc = execute_for_table("INSERT OR IGNORE INTO `" + sequence_table_name_ + "` (`name`, `next_id`) \
+SELECT ?, IFNULL(MAX(`" + id_field_ + "`), 0) + 1 FROM `" + table_name_ + "`");
+      if (rc == SQLITE_DONE) {
+        rc = execute_for_table("UPDATE `" + sequence_table_name_ + "` SET `next_id` = `next_id` + " +
+                               std::to_string(block_size_) + " WHERE `name` = ?");
+      }
+      if (rc != SQLITE_DONE) {
+        SQLDSML_HPP_LOG_WARN(std::string("sequence_id_allocator::reserve failed for ") + table_name_ +
+                        " with code " + std::to_string(rc));
+        return false;
+      }
+      int64_t end = 0;
+      {
+        sqlite::query select(db_, "SELECT `next_id` FROM `" + sequence_table_name_ + "` WHERE `name` = ?");
+        select.bind(1, table_name_);
+        select.step();
+        if (select.result_code() != SQLITE_ROW) {
+          return false;
+        }
+        select.get(0, end);
+      }
+      if (sp.release() != SQLITE_DONE) {
+        return false;
+      }
+      next_ = end - block_size_;
+      end_ = end;
+      SQLDSML_HPP_LOG_INFO(std::string("sequence_id_allocator reserved ") + table_name_ + " ids " +
+                      std::to_string(next_) + " to " + std::to_string(end_ - 1));
+      return true;
+    }
+
+    sqlite::database::type_ptr db_;
+    std::string table_name_;
+    std::string id_field_;
+    int64_t block_size_;
+    std::string sequence_table_name_;
+    int64_t next_;
+    int64_t end_;
+  };
+}
@@ -1,53 +1,217 @@
 #pragma once
 
+// Log levels; messages below SQLDSML_HPP_LOG_LEVEL are compiled out together with the
+// expressions that format them
+#define SQLDSML_HPP_LOG_LEVEL_DEBUG 0
+#define SQLDSML_HPP_LOG_LEVEL_INFO 1
+#define SQLDSML_HPP_LOG_LEVEL_WARN 2
+
 #if defined(SQLDSML_HPP_LOG_FILENAME)
 
+#if !defined(SQLDSML_HPP_LOG_LEVEL)
+#define SQLDSML_HPP_LOG_LEVEL SQLDSML_HPP_LOG_LEVEL_DEBUG
+#endif
+
+// Messages the ring holds before producers start dropping them, a power of two
+#if !defined(SQLDSML_HPP_LOG_RING_SIZE)
+#define SQLDSML_HPP_LOG_RING_SIZE 65536
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <ctime>
 #include <fstream>
+#include <memory>
 #include <sstream>
+#include <string>
+#include <thread>
 #include <iostream>
 
 namespace sqldsml {
+  struct log_entry {
+    log_entry() :
+      level(0) {
+    }
+
+    int level;
+    std::chrono::system_clock::time_point time;
+    std::string message;
+  };
+
+  // Bounded lock-free queue of log entries for many producers and one consumer. Every
+  // cell carries a sequence number telling whether it is free for the producer at that
+  // position or filled for the consumer, so producers only contend on one counter.
+  class log_ring {
+  public:
+    log_ring(const size_t size) :
+      cells_(new cell[size]),
+      mask_(size - 1),
+      enqueue_pos_(0),
+      dequeue_pos_(0) {
+      for (size_t i = 0; i < size; ++i) {
+        cells_[i].sequence.store(i, std::memory_order_relaxed);
+      }
+    }
+
+    // Returns false if the ring is full
+    bool push(log_entry&& e) {
+      size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+      cell* c;
+      for (;;) {
+        c = &cells_[pos & mask_];
+        const size_t seq = c->sequence.load(std::memory_order_acquire);
+        const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+          if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        } else if (diff < 0) {
+          return false;
+        } else {
+          pos = enqueue_pos_.load(std::memory_order_relaxed);
+        }
+      }
+      c->entry = std::move(e);
+      c->sequence.store(pos + 1, std::memory_order_release);
+      return true;
+    }
+
+    // Only called from the consumer thread
+    bool pop(log_entry& e) {
+      const size_t pos = dequeue_pos_;
+      cell& c = cells_[pos & mask_];
+      if (c.sequence.load(std::memory_order_acquire) != pos + 1) return false;
+      e = std::move(c.entry);
+      c.sequence.store(pos + mask_ + 1, std::memory_order_release);
+      dequeue_pos_ = pos + 1;
+      return true;
+    }
+
+  private:
+    log_ring(log_ring const&) = delete;
+    void operator=(log_ring const&) = delete;
+
+    struct cell {
+      std::atomic<size_t> sequence;
+      log_entry entry;
+    };
+
+    std::unique_ptr<cell[]> cells_;
+    size_t mask_;
+    std::atomic<size_t> enqueue_pos_;
+    size_t dequeue_pos_;
+  };
+
+  // Producers only stamp the message and push it to the ring; a background thread formats
+  // the timestamps and writes whatever has accumulated in one batch per wakeup. Messages
+  // that find the ring full are dropped and counted, a note about them is written with
+  // the next batch.
   class logging {
   public:
+    static_assert((SQLDSML_HPP_LOG_RING_SIZE & (SQLDSML_HPP_LOG_RING_SIZE - 1)) == 0,
+                  "SQLDSML_HPP_LOG_RING_SIZE must be a power of two");
+
     static logging& get_instance() {
       static logging instance;
       return instance;
     }
 
-    void log(const std::string& s) {
-      log_to_stream(log_, s);
+    void log(const int level, std::string&& s) {
+      log_entry e;
+      e.level = level;
+      e.time = std::chrono::system_clock::now();
+      e.message = std::move(s);
+      if (!ring_.push(std::move(e))) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+
+    void log(const int level, const std::string& s) {
+      log(level, std::string(s));
     }
-  
+
   private:
-    logging() {
+    logging() :
+      ring_(SQLDSML_HPP_LOG_RING_SIZE),
+      dropped_(0),
+      stopping_(false) {
       log_.open(SQLDSML_HPP_LOG_FILENAME);
-      log("Sqlite header-only library logging started");
+      log(SQLDSML_HPP_LOG_LEVEL_INFO, "Sqlite header-only library logging started");
+      writer_ = std::thread(&logging::run, this);
     }
+
+    // Writes out everything logged before exit
+    ~logging() {
+      stopping_.store(true, std::memory_order_release);
+      writer_.join();
+    }
+
     logging(logging const&) = delete;
     void operator=(logging const&) = delete;
 
-    void log_to_stream(std::ofstream& out, const std::string& s) {
-      std::time_t now = std::time(0);
+    void run() {
+      std::string batch;
+      for (;;) {
+        const bool stopping = stopping_.load(std::memory_order_acquire);
+        drain(batch);
+        if (stopping) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+    }
+
+    void drain(std::string& batch) {
+      log_entry e;
+      while (ring_.pop(e)) {
+        format(batch, e.level, e.time, e.message);
+      }
+      const size_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+      if (dropped != 0) {
+        format(batch, SQLDSML_HPP_LOG_LEVEL_WARN, std::chrono::system_clock::now(),
+               std::to_string(dropped) + " log messages dropped, ring full");
+      }
+      if (batch.size() != 0) {
+        log_.write(batch.data(), batch.size());
+        log_.flush();
+        batch.clear();
+      }
+    }
+
+    static void format(std::string& out, const int level,
+                       const std::chrono::system_clock::time_point& time, const std::string& s) {
+      std::time_t t = std::chrono::system_clock::to_time_t(time);
       std::tm stm;
 #if defined(_MSC_VER) || defined(WIN32) || defined(_WIN32)
-      localtime_s(&stm, &now);
+      localtime_s(&stm, &t);
 #else
-      localtime_r(&now, &stm);
+      localtime_r(&t, &stm);
 #endif
       char buffer[256];
       std::strftime(buffer, 256, "%Y.%m.%d %H:%M:%S", &stm);
-      out << buffer << " ";
-      out << s;
-      out << "\n";
-      log_.flush();
+      static const char* const level_names[] = {"DEBUG", "INFO", "WARN"};
+      out += buffer;
+      out += " ";
+      out += level_names[level];
+      out += " ";
+      out += s;
+      out += "\n";
     }
 
+    log_ring ring_;
+    std::atomic<size_t> dropped_;
+    std::atomic<bool> stopping_;
     std::ofstream log_;
+    std::thread writer_;
   };
 }
 
-#define SQLDSML_HPP_LOG(X) ::sqldsml::logging::get_instance().log(X);
+#define SQLDSML_HPP_LOG_AT(L, X)                                        \
+  do {                                                                  \
+    if (L >= SQLDSML_HPP_LOG_LEVEL) ::sqldsml::logging::get_instance().log(L, X); \
+  } while (0)
 #else
-#define SQLDSML_HPP_LOG(X)
+#define SQLDSML_HPP_LOG_AT(L, X) do {} while (0)
 #endif
+
+#define SQLDSML_HPP_LOG(X) SQLDSML_HPP_LOG_AT(SQLDSML_HPP_LOG_LEVEL_DEBUG, X)
+#define SQLDSML_HPP_LOG_INFO(X) SQLDSML_HPP_LOG_AT(SQLDSML_HPP_LOG_LEVEL_INFO, X)
+#define SQLDSML_HPP_LOG_WARN(X) SQLDSML_HPP_LOG_AT(SQLDSML_HPP_LOG_LEVEL_WARN, X)
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "tuple_hash.hpp"
+
+namespace sqldsml {
+  // Linear probing hash map with power of two capacity and backward shift deletion.
+  // Keys and mapped values must be default constructible.
+  template <typename key_t, typename mapped_t, typename hash_t = tuple_hash<key_t>>
+  class open_addressing_map {
+  public:
+    typedef open_addressing_map<key_t, mapped_t, hash_t> type;
+    typedef key_t key_type;
+    typedef mapped_t mapped_type;
+    typedef std::pair<key_type, mapped_type> value_type;
+
+    open_addressing_map() :
+      size_(0) {
+    }
+
+    open_addressing_map(const type& other) :
+      entries_(other.entries_),
+      used_(other.used_),
+      size_(other.size_),
+      hash_(other.hash_) {
+    }
+
+    open_addressing_map(type&& other) :
+      entries_(std::move(other.entries_)),
+      used_(std::move(other.used_)),
+      size_(other.size_),
+      hash_(std::move(other.hash_)) {
+      other.size_ = 0;
+    }
+
+    void swap(type& other) {
+      std::swap(entries_, other.entries_);
+      std::swap(used_, other.used_);
+      std::swap(size_, other.size_);
+      std::swap(hash_, other.hash_);
+    }
+
+    type& operator=(const type& other) {
+      type tmp(other);
+      swap(tmp);
+      return *this;
+    }
+
+    mapped_type* find(const key_type& key) {
+      if (size_ == 0) return nullptr;
+      for (size_t i = bucket(key); used_[i]; i = next(i)) {
+        if (entries_[i].first == key) return &entries_[i].second;
+      }
+      return nullptr;
+    }
+
+    const mapped_type* find(const key_type& key) const {
+      return const_cast<type*>(this)->find(key);
+    }
+
+    // Returns pointer to the mapped value and true if it was inserted, false if key was already present
+    std::pair<mapped_type*, bool> insert(const key_type& key, const mapped_type& mapped) {
+      if ((size_ + 1) * 10 > entries_.size() * 7) {
+        rehash(entries_.size() == 0 ? 16 : entries_.size() * 2);
+      }
+      size_t i = bucket(key);
+      for (; used_[i]; i = next(i)) {
+        if (entries_[i].first == key) return std::make_pair(&entries_[i].second, false);
+      }
+      entries_[i] = value_type(key, mapped);
+      used_[i] = 1;
+      ++size_;
+      return std::make_pair(&entries_[i].second, true);
+    }
+
+    bool erase(const key_type& key) {
+      if (size_ == 0) return false;
+      size_t i = bucket(key);
+      for (; used_[i]; i = next(i)) {
+        if (entries_[i].first == key) break;
+      }
+      if (!used_[i]) return false;
+      // Shift back following entries of the probe chain so lookups need no tombstones
+      size_t hole = i;
+      for (size_t j = next(i); used_[j]; j = next(j)) {
+        const size_t home = bucket(entries_[j].first);
+        if (((j - home) & mask()) >= ((j - hole) & mask())) {
+          entries_[hole] = std::move(entries_[j]);
+          hole = j;
+        }
+      }
+      entries_[hole] = value_type();
+      used_[hole] = 0;
+      --size_;
+      return true;
+    }
+
+    void reserve(const size_t n) {
+      size_t capacity = 16;
+      while (capacity * 7 < n * 10) capacity *= 2;
+      if (capacity > entries_.size()) rehash(capacity);
+    }
+
+    void clear() {
+      entries_.clear();
+      used_.clear();
+      size_ = 0;
+    }
+
+    size_t size() const {
+      return size_;
+    }
+
+    bool empty() const {
+      return size_ == 0;
+    }
+
+    template <typename function_t>
+    void for_each(function_t f) {
+      for (size_t i = 0; i < entries_.size(); ++i) {
+        if (used_[i]) f(entries_[i].first, entries_[i].second);
+      }
+    }
+
+  private:
+    size_t mask() const {
+      return entries_.size() - 1;
+    }
+
+    size_t next(const size_t i) const {
+      return (i + 1) & mask();
+    }
+
+    size_t bucket(const key_type& key) const {
+      // Finalize the hash, tuple_hash of pointers and small integers has weak low bits
+      uint64_t h = hash_(key);
+      h ^= h >> 33;
+      h *= 0xff51afd7ed558ccdULL;
+      h ^= h >> 33;
+      return static_cast<size_t>(h) & mask();
+    }
+
+    void rehash(const size_t capacity) {
+      std::vector<value_type> old_entries(capacity);
+      std::vector<unsigned char> old_used(capacity, 0);
+      std::swap(old_entries, entries_);
+      std::swap(old_used, used_);
+      for (size_t i = 0; i < old_entries.size(); ++i) {
+        if (old_used[i]) {
+          size_t j = bucket(old_entries[i].first);
+          while (used_[j]) j = next(j);
+          entries_[j] = std::move(old_entries[i]);
+          used_[j] = 1;
+        }
+      }
+    }
+
+    std::vector<value_type> entries_;
+    std::vector<unsigned char> used_;
+    size_t size_;
+    hash_t hash_;
+  };
+}
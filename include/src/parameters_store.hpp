@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "direct_index.hpp"
+
+namespace sqldsml {
+  // Interning store for the parameters of relational entities. intern() returns one
+  // canonical shared pointer per distinct parameters value, so entities built from it share
+  // a single allocation and are found by the caches' pointer index without a content
+  // lookup. Each value also gets a dense handle, equal handles meaning equal parameters.
+  // Values are held until clear(), which invalidates handles but not held pointers.
+  template <typename parameters_t>
+  class parameters_store {
+  public:
+    typedef parameters_store<parameters_t> type;
+    typedef parameters_t parameters_type;
+    typedef std::shared_ptr<parameters_type> parameters_type_ptr;
+    typedef uint32_t handle_type;
+    typedef typename parameters_index_traits<parameters_type, handle_type>::type index_type;
+
+    parameters_store() {
+    }
+
+    parameters_store(const type& other) :
+      all_parameters_(other.all_parameters_),
+      index_(other.index_) {
+    }
+
+    parameters_store(type&& other) :
+      all_parameters_(std::move(other.all_parameters_)),
+      index_(std::move(other.index_)) {
+    }
+
+    void swap(type& other) {
+      std::swap(all_parameters_, other.all_parameters_);
+      index_.swap(other.index_);
+    }
+
+    type& operator=(const type& other) {
+      type tmp(other);
+      swap(tmp);
+      return *this;
+    }
+
+    // Handle of parameters, adding a copy of them if they are new
+    handle_type intern_handle(const parameters_type& parameters) {
+      assert(all_parameters_.size() < std::numeric_limits<handle_type>::max());
+      auto inserted = index_.insert(parameters, static_cast<handle_type>(all_parameters_.size()));
+      if (inserted.second) {
+        all_parameters_.push_back(std::make_shared<parameters_type>(parameters));
+      }
+      return *inserted.first;
+    }
+
+    const parameters_type_ptr& intern(const parameters_type& parameters) {
+      return all_parameters_[intern_handle(parameters)];
+    }
+
+    // Adopts parameters as the canonical pointer if their value is new, so no copy is made
+    const parameters_type_ptr& intern(const parameters_type_ptr& parameters) {
+      assert(all_parameters_.size() < std::numeric_limits<handle_type>::max());
+      auto inserted = index_.insert(*parameters, static_cast<handle_type>(all_parameters_.size()));
+      if (inserted.second) {
+        all_parameters_.push_back(parameters);
+      }
+      return all_parameters_[*inserted.first];
+    }
+
+    // Null if the parameters were never interned
+    parameters_type_ptr find(const parameters_type& parameters) const {
+      auto found = index_.find(parameters);
+      if (found != nullptr) {
+        return all_parameters_[*found];
+      } else {
+        return nullptr;
+      }
+    }
+
+    const parameters_type_ptr& at(const handle_type handle) const {
+      return all_parameters_[handle];
+    }
+
+    size_t size() const {
+      return all_parameters_.size();
+    }
+
+    void reserve(const size_t n) {
+      all_parameters_.reserve(n);
+      index_.reserve(n);
+    }
+
+    void clear() {
+      all_parameters_.clear();
+      index_.clear();
+    }
+
+  private:
+    std::vector<parameters_type_ptr> all_parameters_;
+    index_type index_;
+  };
+}
@@ -2,20 +2,36 @@
 
 #include <algorithm>
 #include <cassert>
-#include <sqlite_buffered>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <sqlite>
+
+#include "clock_eviction.hpp"
+#include "direct_index.hpp"
+#include "entity_storage.hpp"
+#include "id_allocator.hpp"
+#include "statement.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
 
 namespace sqldsml {
-  template <typename parametric_entity_t>
+  template <typename parametric_entity_t,
+            typename storage_t = heap_entity_storage<parametric_entity_t>>
   class parametric_entity_cache;
 
-  template <typename parametric_entity_t>
+  template <typename parametric_entity_t,
+            typename storage_t>
   class parametric_entity_cache {
   public:
-    typedef parametric_entity_cache<parametric_entity_t> type;
+    typedef parametric_entity_cache<parametric_entity_t, storage_t> type;
     typedef parametric_entity_t parametric_entity_type;
+    typedef storage_t storage_type;
     typedef typename parametric_entity_type::type_ptr parametric_entity_type_ptr;
     typedef typename parametric_entity_type::parameters_type parameters_type;
-    typedef std::set<parametric_entity_type_ptr> parametric_entity_container_type;
+    typedef std::vector<parametric_entity_type_ptr> parametric_entity_container_type;
+    typedef uint32_t slot_type;
+    typedef typename parameters_index_traits<parameters_type, slot_type>::type parameters_index_type;
     typedef typename parametric_entity_type::id_type id_type;
 
     template <typename id_fields_container_t,
@@ -27,31 +43,83 @@ namespace sqldsml {
       db_(db),
       table_name_(table_name),
       id_fields_(id_fields.begin(), id_fields.end()),
-      parameter_fields_(parameter_fields.begin(), parameter_fields.end()) {
+      parameter_fields_(parameter_fields.begin(), parameter_fields.end()),
+      capacity_(0),
+      evict_at_(0),
+      preloaded_(false),
+      evicted_(false) {
     }
 
     parametric_entity_cache(const type& other) :
+      storage_(other.storage_),
       all_entities_(other.all_entities_),
+      parameters_index_(other.parameters_index_),
       db_(other.db_),
       table_name_(other.table_name_),
       id_fields_(other.id_fields_),
-      parameter_fields_(other.parameter_fields_) {
+      parameter_fields_(other.parameter_fields_),
+      id_allocator_(other.id_allocator_),
+      pending_(other.pending_),
+      unsaved_(other.unsaved_),
+      select_ids_(other.select_ids_),
+      insert_(other.insert_),
+      insert_allocated_(other.insert_allocated_),
+      last_rowid_(other.last_rowid_),
+      capacity_(other.capacity_),
+      evict_at_(other.evict_at_),
+      preloaded_(other.preloaded_),
+      evicted_(other.evicted_),
+      free_slots_(other.free_slots_),
+      clock_(other.clock_),
+      counters_(other.counters_) {
     }
 
     parametric_entity_cache(type&& other) :
+      storage_(std::move(other.storage_)),
       all_entities_(std::move(other.all_entities_)),
+      parameters_index_(std::move(other.parameters_index_)),
       db_(std::move(other.db_)),
       table_name_(std::move(other.table_name_)),
-      id_fields_(std::move(other.id_fidelds_)),
-      parameter_fields_(std::move(other.parameter_fields_)) {
+      id_fields_(std::move(other.id_fields_)),
+      parameter_fields_(std::move(other.parameter_fields_)),
+      id_allocator_(std::move(other.id_allocator_)),
+      pending_(std::move(other.pending_)),
+      unsaved_(std::move(other.unsaved_)),
+      select_ids_(std::move(other.select_ids_)),
+      insert_(std::move(other.insert_)),
+      insert_allocated_(std::move(other.insert_allocated_)),
+      last_rowid_(std::move(other.last_rowid_)),
+      capacity_(other.capacity_),
+      evict_at_(other.evict_at_),
+      preloaded_(other.preloaded_),
+      evicted_(other.evicted_),
+      free_slots_(std::move(other.free_slots_)),
+      clock_(std::move(other.clock_)),
+      counters_(other.counters_) {
     }
 
     void swap(type& other) {
+      std::swap(storage_, other.storage_);
       std::swap(all_entities_, other.all_entities_);
+      parameters_index_.swap(other.parameters_index_);
       std::swap(db_, other.db_);
       std::swap(table_name_, other.table_name_);
       std::swap(id_fields_, other.id_fields_);
       std::swap(parameter_fields_, other.parameter_fields_);
+      std::swap(id_allocator_, other.id_allocator_);
+      std::swap(pending_, other.pending_);
+      std::swap(unsaved_, other.unsaved_);
+      std::swap(select_ids_, other.select_ids_);
+      insert_.swap(other.insert_);
+      insert_allocated_.swap(other.insert_allocated_);
+      last_rowid_.swap(other.last_rowid_);
+      std::swap(capacity_, other.capacity_);
+      std::swap(evict_at_, other.evict_at_);
+      std::swap(preloaded_, other.preloaded_);
+      std::swap(evicted_, other.evicted_);
+      std::swap(free_slots_, other.free_slots_);
+      clock_.swap(other.clock_);
+      std::swap(counters_, other.counters_);
     }
 
     type& operator=(const type& other) {
@@ -65,28 +133,65 @@ namespace sqldsml {
     }
 
     parametric_entity_type_ptr find_by_parameters(const parameters_type& parameters) const {
-      auto found = std::find_if(all_entities_.begin(),
-				all_entities_.end(), [&parameters](const parametric_entity_type_ptr& f) {
-                                  return parameters == f->parameters();
-                                });
-      if (found != all_entities_.end()) {
-        return *found;
+      auto found = parameters_index_.find(parameters);
+      counters_.lookup(found != nullptr);
+      if (found != nullptr) {
+        clock_.touch(*found);
+        return all_entities_[*found];
       } else {
         return nullptr;
       }
     }
     
+    // Slot of the entity in the cache; stays valid until the cache is cleared or, with a
+    // capacity set, the entity is evicted
+    slot_type add_slot(const parametric_entity_type& parametric_entity) {
+      return add_slot(parametric_entity.parameters(), parametric_entity);
+    }
+
     parametric_entity_type_ptr add(const parametric_entity_type& parametric_entity) {
-      auto found = find_by_parameters(parametric_entity.parameters());
-      if (found == nullptr) {
-        SQLDSML_HPP_LOG("add not found, cache size " + std::to_string(all_entities_.size()));
-        parametric_entity_type_ptr f(new parametric_entity_type(parametric_entity));
-        all_entities_.insert(f);
-        return f;
-      } else {
-        SQLDSML_HPP_LOG("add found, cache size " + std::to_string(all_entities_.size()));
-        return found;
+      return all_entities_[add_slot(parametric_entity)];
+    }
+
+    // Adds an entity for each of keys and appends the entities to entities in the order of
+    // keys. Entities are constructed from their parameters only when missing. All keys are
+    // looked up before any is inserted, so the containers grow once for all of the misses.
+    // Nothing is evicted while the batch is added, so all of the returned entities are
+    // still cached when the caller links them; the next add() or sync() evicts.
+    void add_by_parameters(const std::vector<const parameters_type*>& keys,
+                           parametric_entity_container_type& entities) {
+      const size_t first = entities.size();
+      entities.reserve(first + keys.size());
+      size_t n_missing = 0;
+      for (auto key : keys) {
+        auto found = parameters_index_.find(*key);
+        if (found != nullptr) {
+          counters_.add(true);
+          clock_.touch(*found);
+          entities.push_back(all_entities_[*found]);
+        } else {
+          entities.push_back(nullptr);
+          ++n_missing;
+        }
+      }
+      if (n_missing == 0) return;
+      const size_t n_needed = all_entities_.size() + n_missing;
+      if (all_entities_.capacity() < n_needed) {
+        reserve(std::max(n_needed, all_entities_.capacity() * 2));
       }
+      const size_t evict_at = evict_at_;
+      evict_at_ = std::numeric_limits<size_t>::max();
+      // Keys repeated within the batch are found again here once the first one is added
+      for (size_t i = 0; i < keys.size(); ++i) {
+        if (entities[first + i] == nullptr) {
+          entities[first + i] = all_entities_[add_slot(*keys[i], *keys[i])];
+        }
+      }
+      evict_at_ = evict_at;
+    }
+
+    const parametric_entity_type_ptr& at(const slot_type slot) const {
+      return all_entities_[slot];
     }
 
     typename parametric_entity_container_type::iterator begin() {
@@ -97,80 +202,427 @@ namespace sqldsml {
       return all_entities_.end();
     }
 
+    // Number of entities in the cache, not counting evicted ones
     size_t size() {
-      return all_entities_.size();
+      return all_entities_.size() - free_slots_.size();
+    }
+
+    void reserve(const size_t n) {
+      all_entities_.reserve(n);
+      parameters_index_.reserve(n);
+    }
+
+    // Bounds the number of cached entities (0, the default, is unbounded). Once the cache
+    // is full, adding an entity evicts entities that have ids and are written, those not
+    // found again since they were added first (CLOCK); entities not written yet are never
+    // evicted, so the cache may grow past its capacity until the next sync. Evicted entities
+    // leave null pointers in iteration and their slots are reused, so compact links to this
+    // cache must be written before it evicts. Held entity pointers stay valid; with arena
+    // storage their memory is reclaimed only once whole chunks are released.
+    void set_capacity(const size_t capacity) {
+      capacity_ = capacity;
+      evict_at_ = capacity;
+    }
+
+    // With an allocator set, entities missing from the cache get their ids in add() and
+    // are written with those explicit ids before any other insert. sync() then never
+    // inserts rows without an allocated id: entities whose block reservation failed stay
+    // pending until a reservation succeeds. Allocating in add() is only safe when no
+    // matching row can already exist in the table, e.g. for a new dictionary or after
+    // preload(). Once the cache has evicted entities that no longer holds, so entities
+    // added afterwards are looked up at sync and only the missing ones get ids.
+    void set_id_allocator(const sequence_id_allocator::type_ptr& id_allocator) {
+      id_allocator_ = id_allocator;
+    }
+
+    // load_ids() resolves more pending keys than this through a temporary table join
+    // instead of batched selects
+    void set_load_join_threshold(const size_t join_threshold) {
+      select_ids_.set_join_threshold(join_threshold);
+    }
+
+    // Entities added since the last sync that have no id yet
+    size_t pending_size() const {
+      return pending_.size();
+    }
+
+    // Resolves ids of the entities added since the last sync: writes entities with
+    // allocated ids, loads ids of existing rows and inserts the missing ones. Cost depends
+    // on the number of new entities only. Returns false if some entities are left without
+    // a written row, they stay pending and are retried at the next sync.
+    bool sync() {
+      trace_span span("sync", table_name_);
+      const size_t n_failed = write_allocated_ids();
+      if (pending_.size() != 0) {
+        // Entities whose allocated id was not written may exist with another id
+        if (!preloaded_ || (n_failed != 0)) load_ids();
+        if (id_allocator_ != nullptr) {
+          for (auto slot : pending_) {
+            allocate_id(slot);
+          }
+          prune_pending();
+          write_allocated_ids();
+        } else {
+          insert_ids();
+        }
+      }
+      return finish_sync();
+    }
+
+    // Calls fn on each entity added since the last sync that has no id yet, so the owner
+    // of several caches can resolve all of them with one query per step (see
+    // concurrent_parametric_entity_cache::sync()) and then call finish_sync()
+    template <typename fn_t>
+    void for_each_pending(const fn_t& fn) {
+      for (auto slot : pending_) {
+        auto &f = all_entities_[slot];
+        if (f->id() == id_type()) fn(f);
+      }
+    }
+
+    // Takes entities whose ids are set off pending and evicts as needed; returns false if
+    // some entities are left pending
+    bool finish_sync() {
+      prune_pending();
+      if (capacity_ != 0) {
+        evict_at_ = capacity_;
+        if (size() > capacity_) evict();
+      }
+      return pending_.size() == 0;
     }
 
     void clear() {
+      preloaded_ = false;
+      evicted_ = false;
+      evict_at_ = capacity_;
+      free_slots_.clear();
+      clock_.clear();
+      pending_.clear();
+      unsaved_.clear();
       all_entities_.clear();
+      storage_.clear();
+      parameters_index_.clear();
     }
 
     parametric_entity_container_type& all_entities() {
       return all_entities_;
     }
 
-    size_t load_ids() {
-      typedef decltype(std::tuple_cat(id_type(), parameters_type())) select_record_type;
-      typedef sqlite::buffered::input_query_by_keys_base<
-        select_record_type,
-        parameters_type,
-        sqlite::default_value_access_policy> select_query_type;
+    cache_stats stats() const {
+      cache_stats s;
+      s.statements_prepared = select_ids_.prepare_count() + insert_.prepare_count() +
+        insert_allocated_.prepare_count() + last_rowid_.prepare_count();
+      counters_.fill(s);
+      return s;
+    }
 
+    void reset_stats() {
+      counters_.reset();
+    }
 
+    // Loads the whole table into the cache with one forward scan, reserving room from a
+    // count of its rows first; cached entities without ids get theirs. While the cache
+    // stays preloaded, sync() inserts entities missing from it without looking them up,
+    // which is only right if no other connection writes the table. Evicting entities or
+    // clearing the cache ends this. With a capacity set, the scan stops at the capacity
+    // and the cache is not marked preloaded.
+    size_t preload() {
       assert(id_fields_.size() == 1);
-      std::string query_prefix_str;
-      for (auto &f : id_fields_) {
-        if (query_prefix_str.size() != 0) query_prefix_str += ", ";
-        query_prefix_str += "`" + f + "`";
-      }
+      cache_counters::timer t(counters_, &cache_stats::load_seconds, &cache_stats::load_ids_seconds);
+      trace_span span("preload", table_name_);
+      const std::string from = " FROM `" + table_name_ + "`";
+      sqlite::query count(db_, "SELECT count(*)" + from);
+      count.step();
+      int64_t n_rows = 0;
+      count.get(0, n_rows);
+      size_t n_reserved = size() + static_cast<size_t>(n_rows);
+      if (capacity_ != 0) n_reserved = std::min(n_reserved, capacity_);
+      reserve(n_reserved);
 
-      for (auto &f : parameter_fields_) {
-        query_prefix_str += ", `" + f + "`";
-      }
-      query_prefix_str = "SELECT " + query_prefix_str + " FROM `" + table_name_ + "` WHERE ";
-
-      size_t n_requested = 0;
-      select_query_type select(db_, query_prefix_str, parameter_fields_);
-      for (auto &f : all_entities_) {
+      sqlite::query q(db_, "SELECT " + quoted_fields(id_fields_) + ", " + quoted_fields(parameter_fields_) + from);
+      size_t n_loaded = 0;
+      bool complete = true;
+      for (q.step(); q.result_code() == SQLITE_ROW; q.step()) {
+        if ((capacity_ != 0) && (size() >= capacity_)) {
+          complete = false;
+          break;
+        }
+        select_record_type r;
+        get_tuple(q, r);
+        const parameters_type parameters(sqlite::tuple_tail(r));
+        auto found = parameters_index_.find(parameters);
+        const slot_type slot = (found != nullptr) ? *found : make_slot(parameters, parameters);
+        auto &f = all_entities_[slot];
         if (f->id() == id_type()) {
-          select.add_key(f->parameters());
-          ++n_requested;
+          f->id() = id_type(std::get<0>(r));
         }
+        ++n_loaded;
+      }
+      if (complete && (q.result_code() != SQLITE_DONE)) {
+        SQLDSML_HPP_LOG_WARN(std::string("preload() scan failed with code ") + std::to_string(q.result_code()));
+        complete = false;
       }
+      prune_pending();
+      preloaded_ = complete;
+      counters_.loaded(n_loaded, n_loaded);
+      span.rows(n_loaded);
+      SQLDSML_HPP_LOG_INFO(std::string("preload() loaded ") + std::to_string(n_loaded) + " of " + std::to_string(n_rows));
+      return n_loaded;
+    }
 
-      size_t n_selected = 0;
-      for (auto r : select) {
-        auto found = find_by_parameters(sqlite::tuple_tail(r));
-        if (found != nullptr) {
-          found->id() = id_type(std::get<0>(r));
-          SQLDSML_HPP_LOG(std::string("found for ") + std::to_string(std::get<1>(r)) + ", id = " +
-                          std::to_string(std::get<0>(r)));
+    // True while every row of the table is known to be in the cache
+    bool preloaded() const {
+      return preloaded_;
+    }
+
+    size_t load_ids() {
+      assert(id_fields_.size() == 1);
+      cache_counters::timer t(counters_, &cache_stats::load_seconds, &cache_stats::load_ids_seconds);
+      trace_span span("load_ids", table_name_);
+      std::vector<const parameters_type*> keys;
+      for (auto slot : pending_) {
+        auto &f = all_entities_[slot];
+        if (f->id() == id_type()) {
+          keys.push_back(&f->parameters());
         }
-        ++n_selected;
       }
-      assert(n_selected <= n_requested);
-      SQLDSML_HPP_LOG(std::string("load_ids() loaded ") + std::to_string(n_selected) + " out of requested " + std::to_string(n_requested));
+
+      auto build_prefix = [this]() {
+        return "SELECT " + quoted_fields(id_fields_) + ", " + quoted_fields(parameter_fields_) +
+          " FROM `" + table_name_ + "`";
+      };
+      const size_t n_selected = select_ids_.run(db_, build_prefix, parameter_fields_, keys, [this](const select_record_type& r) {
+          auto found = parameters_index_.find(sqlite::tuple_tail(r));
+          if (found != nullptr) {
+            all_entities_[*found]->id() = id_type(std::get<0>(r));
+            SQLDSML_HPP_LOG(std::string("found for ") + std::to_string(std::get<1>(r)) + ", id = " +
+                            std::to_string(std::get<0>(r)));
+          }
+        });
+      assert(n_selected <= keys.size());
+      counters_.loaded(keys.size(), n_selected);
+      span.rows(n_selected);
+      prune_pending();
+      SQLDSML_HPP_LOG_INFO(std::string("load_ids() loaded ") + std::to_string(n_selected) + " out of requested " + std::to_string(keys.size()));
       return n_selected;
     }
 
     void create_ids() {
-      typedef ::sqlite::buffered::insert_query_base<parameters_type,
-                                                    ::sqlite::default_value_access_policy> insert_type;
-      insert_type insert(db_, table_name_, parameter_fields_);
-      for (auto &f : all_entities_) {
+      // Allocated ids go first, so rows inserted without one cannot take a reserved id
+      const size_t n_allocated = create_allocated_ids();
+      cache_counters::timer t(counters_, &cache_stats::insert_seconds, &cache_stats::insert_ids_seconds);
+      trace_span span("create_ids", table_name_);
+      sqlite::query& insert = insert_query();
+      savepoint sp(db_, "sqldsml_create_ids");
+      size_t n_inserted = 0;
+      for (auto slot : pending_) {
+        auto &f = all_entities_[slot];
+        if ((f->id() == id_type()) && (execute_tuple(insert, f->parameters()) == SQLITE_DONE)) {
+          ++n_inserted;
+        }
+      }
+      sp.release();
+      counters_.inserted(n_inserted);
+      span.rows(n_inserted + n_allocated);
+    }
+
+    // Inserts entities that have no id one row at a time and assigns each the rowid of its
+    // insert, so no load_ids() round trip is needed afterwards. The id field must be the
+    // table's INTEGER PRIMARY KEY.
+    size_t insert_ids() {
+      assert(id_fields_.size() == 1);
+      const size_t n_allocated = create_allocated_ids();
+      cache_counters::timer t(counters_, &cache_stats::insert_seconds, &cache_stats::insert_ids_seconds);
+      trace_span span("insert_ids", table_name_);
+      sqlite::query& insert = insert_query();
+      sqlite::query& last_rowid = last_rowid_.get(db_, []() { return std::string("SELECT last_insert_rowid()"); });
+      savepoint sp(db_, "sqldsml_insert_ids");
+      size_t n_inserted = 0;
+      for (auto slot : pending_) {
+        auto &f = all_entities_[slot];
         if (f->id() == id_type()) {
-          insert.push_back(f->parameters());
+          const int rc = execute_tuple(insert, f->parameters());
+          if (rc == SQLITE_DONE) {
+            typename std::tuple_element<0, id_type>::type id;
+            last_rowid.step();
+            last_rowid.get(0, id);
+            last_rowid.reset();
+            f->id() = id_type(id);
+            ++n_inserted;
+          } else {
+            SQLDSML_HPP_LOG_WARN(std::string("insert_ids() insert failed with code ") + std::to_string(rc));
+          }
         }
       }
-      insert.flush();
+      sp.release();
+      prune_pending();
+      counters_.inserted(n_inserted);
+      SQLDSML_HPP_LOG_INFO(std::string("insert_ids() inserted ") + std::to_string(n_inserted));
+      const size_t n_written = n_inserted + n_allocated;
+      span.rows(n_written);
+      return n_written;
     }
 
-    
   private:
+    typedef decltype(std::tuple_cat(id_type(), parameters_type())) select_record_type;
+    typedef decltype(std::tuple_cat(id_type(), parameters_type())) insert_record_type;
+
+    sqlite::query& insert_query() {
+      return insert_.get(db_, [this]() {
+          return "INSERT INTO `" + table_name_ + "` (" + quoted_fields(parameter_fields_) +
+            ") VALUES (" + placeholders(parameter_fields_.size()) + ")";
+        });
+    }
+
+    // Constructs missing entities from source, an entity or its parameters
+    template <typename source_t>
+    slot_type add_slot(const parameters_type& parameters, const source_t& source) {
+      auto found = parameters_index_.find(parameters);
+      if (found != nullptr) {
+        SQLDSML_HPP_LOG("add found, cache size " + std::to_string(all_entities_.size()));
+        counters_.add(true);
+        clock_.touch(*found);
+        return *found;
+      }
+      SQLDSML_HPP_LOG("add not found, cache size " + std::to_string(all_entities_.size()));
+      counters_.add(false);
+      if ((capacity_ != 0) && (size() >= evict_at_)) {
+        evict();
+      }
+      const slot_type new_slot = make_slot(parameters, source);
+      if ((id_allocator_ != nullptr) && !evicted_) {
+        allocate_id(new_slot);
+      }
+      if (all_entities_[new_slot]->id() == id_type()) {
+        pending_.push_back(new_slot);
+      }
+      return new_slot;
+    }
+
+    // Puts a new entity in a free slot or at the end and indexes it
+    template <typename source_t>
+    slot_type make_slot(const parameters_type& parameters, const source_t& source) {
+      slot_type new_slot;
+      if (free_slots_.size() != 0) {
+        new_slot = free_slots_.back();
+        free_slots_.pop_back();
+        all_entities_[new_slot] = storage_.make(source);
+      } else {
+        assert(all_entities_.size() < std::numeric_limits<slot_type>::max());
+        new_slot = static_cast<slot_type>(all_entities_.size());
+        all_entities_.push_back(storage_.make(source));
+      }
+      parameters_index_.insert(parameters, new_slot);
+      clock_.add(new_slot);
+      return new_slot;
+    }
+
+    static const unsigned char unsaved_pin = 2;
+
+    // Evicts written entities until the cache is an eighth below its capacity. If too few
+    // are written, eviction is retried once the cache has grown by another eighth or at
+    // the next sync.
+    void evict() {
+      const size_t target = capacity_ - capacity_ / 8;
+      if (size() > target) {
+        auto can_evict = [this](const size_t slot) {
+          auto &f = all_entities_[slot];
+          return (f != nullptr) && (f->id() != id_type());
+        };
+        auto evict_slot = [this](const size_t slot) {
+          parameters_index_.erase(all_entities_[slot]->parameters());
+          all_entities_[slot].reset();
+          free_slots_.push_back(static_cast<slot_type>(slot));
+        };
+        const size_t n_evicted = clock_.evict(size() - target, can_evict, evict_slot);
+        if (n_evicted != 0) {
+          preloaded_ = false;
+          evicted_ = true;
+        }
+        counters_.evicted(n_evicted);
+        SQLDSML_HPP_LOG_INFO(std::string("evict() evicted ") + std::to_string(n_evicted));
+      }
+      evict_at_ = std::max(capacity_, size() + capacity_ / 8 + 1);
+    }
+
+    void prune_pending() {
+      auto resolved = [this](const slot_type slot) {
+        return all_entities_[slot]->id() != id_type();
+      };
+      pending_.erase(std::remove_if(pending_.begin(), pending_.end(), resolved), pending_.end());
+    }
+
+    void allocate_id(const slot_type slot) {
+      auto &f = all_entities_[slot];
+      if (f->id() == id_type()) {
+        f->id() = id_type(id_allocator_->next());
+        if (f->id() != id_type()) {
+          unsaved_.push_back(slot);
+          clock_.pin(slot, unsaved_pin);
+        }
+      }
+    }
+
+    // Writes entities whose ids came from the allocator. An entity whose insert fails
+    // loses its id, which has no row behind it, and goes back to pending to be looked up.
+    size_t create_allocated_ids() {
+      if (unsaved_.size() == 0) return 0;
+      cache_counters::timer t(counters_, &cache_stats::insert_seconds, &cache_stats::create_allocated_seconds);
+      sqlite::query& insert = insert_allocated_.get(db_, [this]() {
+          return "INSERT INTO `" + table_name_ + "` (" + quoted_fields(id_fields_) + ", " +
+            quoted_fields(parameter_fields_) + ") VALUES (" +
+            placeholders(id_fields_.size() + parameter_fields_.size()) + ")";
+        });
+      savepoint sp(db_, "sqldsml_create_allocated_ids");
+      size_t n_inserted = 0;
+      for (auto slot : unsaved_) {
+        auto &f = all_entities_[slot];
+        const int rc = execute_tuple(insert, insert_record_type(std::tuple_cat(f->id(), f->parameters())));
+        clock_.unpin(slot, unsaved_pin);
+        if (rc == SQLITE_DONE) {
+          ++n_inserted;
+        } else {
+          SQLDSML_HPP_LOG_WARN(std::string("create_allocated_ids() insert failed with code ") + std::to_string(rc));
+          f->id() = id_type();
+          pending_.push_back(slot);
+        }
+      }
+      sp.release();
+      counters_.inserted(n_inserted);
+      unsaved_.clear();
+      return n_inserted;
+    }
+
+    // create_allocated_ids() as a phase of sync(); returns the number of failed inserts
+    size_t write_allocated_ids() {
+      if (unsaved_.size() == 0) return 0;
+      trace_span span("create_allocated_ids", table_name_);
+      const size_t n_unsaved = unsaved_.size();
+      const size_t n_allocated = create_allocated_ids();
+      span.rows(n_allocated);
+      return n_unsaved - n_allocated;
+    }
+
+    storage_type storage_;
     parametric_entity_container_type all_entities_;
+    parameters_index_type parameters_index_;
     sqlite::database::type_ptr db_;
     std::string table_name_;
     std::vector<std::string> id_fields_;
     std::vector<std::string> parameter_fields_;
+    sequence_id_allocator::type_ptr id_allocator_;
+    std::vector<slot_type> pending_;
+    std::vector<slot_type> unsaved_;
+    keyed_select<select_record_type, parameters_type> select_ids_;
+    prepared_query insert_;
+    prepared_query insert_allocated_;
+    prepared_query last_rowid_;
+    size_t capacity_;
+    size_t evict_at_;
+    bool preloaded_;
+    bool evicted_;
+    std::vector<slot_type> free_slots_;
+    mutable clock_eviction clock_;
+    mutable cache_counters counters_;
   };
 }
@@ -20,6 +20,7 @@ namespace sqldsml {
     typedef std::shared_ptr<parameters_type> parameters_type_ptr;
     typedef decltype(std::tuple_cat(typename entity1_type::id_type(),
                                     typename entity2_type::id_type())) id_type;
+    typedef std::tuple<const entity1_type*, const entity2_type*> endpoints_type;
 
     parametric_link(const entity1_type_ptr& entity1,
                     const entity2_type_ptr& entity2,
@@ -77,6 +78,18 @@ namespace sqldsml {
       return parameters_;
     }
 
+    const entity1_type_ptr& entity1() const {
+      return entity1_;
+    }
+
+    const entity2_type_ptr& entity2() const {
+      return entity2_;
+    }
+
+    endpoints_type endpoints() const {
+      return endpoints_type(entity1_.get(), entity2_.get());
+    }
+
   protected:
     entity1_type_ptr entity1_;
     entity2_type_ptr entity2_;
@@ -2,7 +2,19 @@
 
 #include <algorithm>
 #include <cassert>
-#include <sqlite_buffered>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <sqlite>
+
+#include "open_addressing_map.hpp"
+#include "statement.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+#include "tuple_hash.hpp"
 
 namespace sqldsml {
   template <typename parametric_entity_t>
@@ -15,8 +27,19 @@ namespace sqldsml {
     typedef parametric_entity_t parametric_entity_type;
     typedef typename parametric_entity_type::type_ptr parametric_entity_type_ptr;
     typedef typename parametric_entity_type::parameters_type parameters_type;
-    typedef std::set<parametric_entity_type_ptr> parametric_entity_container_type;
+    typedef std::vector<parametric_entity_type_ptr> parametric_entity_container_type;
     typedef typename parametric_entity_type::id_type id_type;
+    typedef typename parametric_entity_type::entity1_type entity1_type;
+    typedef typename parametric_entity_type::entity1_type_ptr entity1_type_ptr;
+    typedef typename parametric_entity_type::entity2_type entity2_type;
+    typedef typename parametric_entity_type::entity2_type_ptr entity2_type_ptr;
+    typedef typename parametric_entity_type::endpoints_type endpoints_type;
+    typedef uint32_t slot_type;
+    typedef open_addressing_map<endpoints_type, slot_type> endpoints_index_type;
+    typedef open_addressing_map<id_type, slot_type> ids_index_type;
+    typedef std::vector<parametric_entity_type_ptr> adjacency_list_type;
+    typedef std::unordered_map<const entity1_type*, adjacency_list_type> entity1_adjacency_type;
+    typedef std::unordered_map<const entity2_type*, adjacency_list_type> entity2_adjacency_type;
 
     template <typename id_fields_container_t,
               typename parameter_fields_container_t>
@@ -27,31 +50,71 @@ namespace sqldsml {
       db_(db),
       table_name_(table_name),
       id_fields_(id_fields.begin(), id_fields.end()),
-      parameter_fields_(parameter_fields.begin(), parameter_fields.end()) {
+      parameter_fields_(parameter_fields.begin(), parameter_fields.end()),
+      capacity_(0) {
     }
 
     parametric_link_cache(const type& other) :
       all_entities_(other.all_entities_),
+      free_slots_(other.free_slots_),
+      endpoints_index_(other.endpoints_index_),
+      ids_index_(other.ids_index_),
+      entity1_links_(other.entity1_links_),
+      entity2_links_(other.entity2_links_),
+      entity1_positions_(other.entity1_positions_),
+      entity2_positions_(other.entity2_positions_),
+      pending_(other.pending_),
       db_(other.db_),
       table_name_(other.table_name_),
       id_fields_(other.id_fields_),
-      parameter_fields_(other.parameter_fields_) {
+      parameter_fields_(other.parameter_fields_),
+      select_ids_(other.select_ids_),
+      insert_(other.insert_),
+      capacity_(other.capacity_),
+      written_(other.written_),
+      counters_(other.counters_) {
     }
 
     parametric_link_cache(type&& other) :
       all_entities_(std::move(other.all_entities_)),
+      free_slots_(std::move(other.free_slots_)),
+      endpoints_index_(std::move(other.endpoints_index_)),
+      ids_index_(std::move(other.ids_index_)),
+      entity1_links_(std::move(other.entity1_links_)),
+      entity2_links_(std::move(other.entity2_links_)),
+      entity1_positions_(std::move(other.entity1_positions_)),
+      entity2_positions_(std::move(other.entity2_positions_)),
+      pending_(std::move(other.pending_)),
       db_(std::move(other.db_)),
       table_name_(std::move(other.table_name_)),
-      id_fields_(std::move(other.id_fidelds_)),
-      parameter_fields_(std::move(other.parameter_fields_)) {
+      id_fields_(std::move(other.id_fields_)),
+      parameter_fields_(std::move(other.parameter_fields_)),
+      select_ids_(std::move(other.select_ids_)),
+      insert_(std::move(other.insert_)),
+      capacity_(other.capacity_),
+      written_(std::move(other.written_)),
+      counters_(other.counters_) {
     }
 
     void swap(type& other) {
       std::swap(all_entities_, other.all_entities_);
+      std::swap(free_slots_, other.free_slots_);
+      endpoints_index_.swap(other.endpoints_index_);
+      ids_index_.swap(other.ids_index_);
+      std::swap(entity1_links_, other.entity1_links_);
+      std::swap(entity2_links_, other.entity2_links_);
+      std::swap(entity1_positions_, other.entity1_positions_);
+      std::swap(entity2_positions_, other.entity2_positions_);
+      std::swap(pending_, other.pending_);
       std::swap(db_, other.db_);
       std::swap(table_name_, other.table_name_);
       std::swap(id_fields_, other.id_fields_);
       std::swap(parameter_fields_, other.parameter_fields_);
+      std::swap(select_ids_, other.select_ids_);
+      insert_.swap(other.insert_);
+      std::swap(capacity_, other.capacity_);
+      std::swap(written_, other.written_);
+      std::swap(counters_, other.counters_);
     }
 
     type& operator=(const type& other) {
@@ -64,29 +127,82 @@ namespace sqldsml {
       SQLDSML_HPP_LOG("parametric_link_cache::~parametric_link_cache");
     }
 
-    parametric_entity_type_ptr find_by_parameters(const parameters_type& parameters) const {
-      auto found = std::find_if(all_entities_.begin(),
-				all_entities_.end(), [&parameters](const parametric_entity_type_ptr& f) {
-                                  return parameters == f->parameters();
-                                });
-      if (found != all_entities_.end()) {
-        return *found;
+    parametric_entity_type_ptr find_by_endpoints(const endpoints_type& endpoints) const {
+      auto found = endpoints_index_.find(endpoints);
+      counters_.lookup(found != nullptr);
+      if (found != nullptr) {
+        return all_entities_[*found];
       } else {
         return nullptr;
       }
     }
-    
+
+    parametric_entity_type_ptr find_by_entities(const entity1_type_ptr& entity1,
+                                                const entity2_type_ptr& entity2) const {
+      return find_by_endpoints(endpoints_type(entity1.get(), entity2.get()));
+    }
+
+    // All cached links of entity1 (e.g. all values of a sample), in no particular order
+    const adjacency_list_type& links_of_entity1(const entity1_type_ptr& entity1) const {
+      return find_adjacency(entity1_links_, entity1.get());
+    }
+
+    // All cached links of entity2 (e.g. all values of a feature), in no particular order
+    const adjacency_list_type& links_of_entity2(const entity2_type_ptr& entity2) const {
+      return find_adjacency(entity2_links_, entity2.get());
+    }
+
+    // Links are keyed by their endpoint objects. An endpoint evicted from its cache and
+    // added again is a new object, so links of its row are also matched by endpoint ids
+    // once those are known: add() returns the written link, create_links() skips the copy.
     parametric_entity_type_ptr add(const parametric_entity_type& parametric_entity) {
-      auto found = find_by_parameters(parametric_entity.parameters());
-      if (found == nullptr) {
-        SQLDSML_HPP_LOG("add not found, cache size " + std::to_string(all_entities_.size()));
+      auto inserted = endpoints_index_.insert(parametric_entity.endpoints(), next_slot());
+      if (inserted.second) {
+        const slot_type* written = find_written(*parametric_entity.entity1(), *parametric_entity.entity2());
+        if (written != nullptr) {
+          endpoints_index_.erase(parametric_entity.endpoints());
+          counters_.add(true);
+          return all_entities_[*written];
+        }
+        SQLDSML_HPP_LOG("add not found, cache size " + std::to_string(size()));
+        counters_.add(false);
         parametric_entity_type_ptr f(new parametric_entity_type(parametric_entity));
-        all_entities_.insert(f);
+        index_new(*inserted.first, f);
         return f;
       } else {
-        SQLDSML_HPP_LOG("add found, cache size " + std::to_string(all_entities_.size()));
-        return found;
+        SQLDSML_HPP_LOG("add found, cache size " + std::to_string(size()));
+        counters_.add(true);
+        return all_entities_[*inserted.first];
+      }
+    }
+
+    // Adds links from entity1 to each of entities2, the i-th with parameters[i], and
+    // returns the number of links added; links already cached are left as they are. Links
+    // are constructed in place and the endpoints index is grown once for the batch.
+    size_t add_links(const entity1_type_ptr& entity1,
+                     const std::vector<entity2_type_ptr>& entities2,
+                     const std::vector<const parameters_type*>& parameters) {
+      assert(entities2.size() == parameters.size());
+      endpoints_index_.reserve(endpoints_index_.size() + entities2.size());
+      if (pending_.capacity() < pending_.size() + entities2.size()) {
+        pending_.reserve(std::max(pending_.size() + entities2.size(), pending_.capacity() * 2));
+      }
+      size_t n_added = 0;
+      for (size_t i = 0; i < entities2.size(); ++i) {
+        const endpoints_type endpoints(entity1.get(), entities2[i].get());
+        auto inserted = endpoints_index_.insert(endpoints, next_slot());
+        if (inserted.second && (find_written(*entity1, *entities2[i]) != nullptr)) {
+          endpoints_index_.erase(endpoints);
+          inserted.second = false;
+        }
+        counters_.add(!inserted.second);
+        if (inserted.second) {
+          index_new(*inserted.first, std::make_shared<parametric_entity_type>(entity1, entities2[i], *parameters[i]));
+          ++n_added;
+        }
       }
+      SQLDSML_HPP_LOG("add_links added " + std::to_string(n_added) + " out of " + std::to_string(entities2.size()));
+      return n_added;
     }
 
     typename parametric_entity_container_type::iterator begin() {
@@ -98,81 +214,274 @@ namespace sqldsml {
     }
 
     size_t size() {
-      return all_entities_.size();
+      return endpoints_index_.size();
+    }
+
+    // load_ids() resolves more pending keys than this through a temporary table join
+    // instead of batched selects
+    void set_load_join_threshold(const size_t join_threshold) {
+      select_ids_.set_join_threshold(join_threshold);
+    }
+
+    // Bounds the number of cached links (0, the default, is unbounded). create_links()
+    // evicts written links oldest first: a link is rarely looked up again once written, so
+    // plain FIFO order keeps memory flat without tracking references. Links not written yet
+    // are never evicted.
+    void set_capacity(const size_t capacity) {
+      capacity_ = capacity;
+    }
+
+    // Links added since the last create_links() that are not written yet
+    size_t pending_size() const {
+      return pending_.size();
+    }
+
+    // Writes the links added since the last sync, links whose endpoints have no ids yet
+    // stay pending. Links whose insert failed are looked up, those already in the table
+    // are taken off pending. Returns false if some links are left pending.
+    bool sync() {
+      if (create_links() != 0) load_ids();
+      return pending_.size() == 0;
     }
 
     void clear() {
+      written_.clear();
+      pending_.clear();
       all_entities_.clear();
+      free_slots_.clear();
+      endpoints_index_.clear();
+      ids_index_.clear();
+      entity1_links_.clear();
+      entity2_links_.clear();
+      entity1_positions_.clear();
+      entity2_positions_.clear();
     }
 
+    // Links by slot, null for evicted ones
     parametric_entity_container_type& all_entities() {
       return all_entities_;
     }
 
-    size_t load_ids() {
-      typedef decltype(std::tuple_cat(id_type(), parameters_type())) select_record_type;
-      typedef sqlite::buffered::input_query_by_keys_base<
-        select_record_type,
-        parameters_type,
-        sqlite::default_value_access_policy> select_query_type;
-
-
-      assert(id_fields_.size() == 2);
-      std::string query_prefix_str;
-      for (auto &f : id_fields_) {
-        if (query_prefix_str.size() != 0) query_prefix_str += ", ";
-        query_prefix_str += "`" + f + "`";
-      }
+    cache_stats stats() const {
+      cache_stats s;
+      s.statements_prepared = select_ids_.prepare_count() + insert_.prepare_count();
+      counters_.fill(s);
+      return s;
+    }
 
-      for (auto &f : parameter_fields_) {
-        query_prefix_str += ", `" + f + "`";
-      }
-      query_prefix_str = "SELECT " + query_prefix_str + " FROM `" + table_name_ + "` WHERE ";
-
-      size_t n_requested = 0;
-      select_query_type select(db_, query_prefix_str, parameter_fields_);
-      for (auto &f : all_entities_) {
-        if (f->id() == id_type()) {
-          select.add_key(f->parameters());
-          ++n_requested;
+    void reset_stats() {
+      counters_.reset();
+    }
+
+    // Looks up pending links by the ids of their endpoints and takes those already in the
+    // table off pending, so create_links() does not insert them again. Returns the number
+    // of links found.
+    size_t load_ids() {
+      assert(id_fields_.size() == std::tuple_size<id_type>::value);
+      cache_counters::timer t(counters_, &cache_stats::load_seconds, &cache_stats::load_ids_seconds);
+      trace_span span("load_ids", table_name_);
+      open_addressing_map<id_type, unsigned char> requested;
+      std::vector<id_type> ids;
+      for (auto &f : pending_) {
+        const id_type id(f->id());
+        if ((id != id_type()) && requested.insert(id, 0).second) {
+          ids.push_back(id);
         }
       }
+      std::vector<const id_type*> keys;
+      keys.reserve(ids.size());
+      for (auto &id : ids) {
+        keys.push_back(&id);
+      }
 
-      size_t n_selected = 0;
-      for (auto r : select) {
-        auto found = find_by_parameters(sqlite::tuple_tail(r));
-        if (found != nullptr) {
-          found->id() = id_type(std::get<0>(r), std::get<1>(r));
+      auto build_prefix = [this]() {
+        return "SELECT " + quoted_fields(id_fields_) + " FROM `" + table_name_ + "`";
+      };
+      const size_t n_selected = select_ids_.run(db_, build_prefix, id_fields_, keys, [&requested](const id_type& r) {
+          auto found = requested.find(r);
+          if (found != nullptr) {
+            *found = 1;
+          }
+        });
+      assert(n_selected <= keys.size());
+      adjacency_list_type still_pending;
+      for (auto &f : pending_) {
+        auto found = requested.find(f->id());
+        if ((found != nullptr) && (*found != 0)) {
+          index_written(f);
+        } else {
+          still_pending.push_back(f);
         }
-        ++n_selected;
       }
-      assert(n_selected <= n_requested);
-      SQLDSML_HPP_LOG(std::string("load_ids() loaded ") + std::to_string(n_selected) + " out of requested " + std::to_string(n_requested));
+      pending_.swap(still_pending);
+      counters_.loaded(keys.size(), n_selected);
+      span.rows(n_selected);
+      SQLDSML_HPP_LOG_INFO(std::string("load_ids() loaded ") + std::to_string(n_selected) + " out of requested " + std::to_string(keys.size()));
       return n_selected;
     }
 
-    void create_links() {
-      typedef decltype(std::tuple_cat(id_type(), parameters_type())) insert_record_type;
-      typedef ::sqlite::buffered::insert_query_base<insert_record_type,
-                                                    ::sqlite::default_value_access_policy> insert_type;
-      std::vector<std::string> insert_fields(id_fields_.begin(), id_fields_.end());
-      std::copy(parameter_fields_.begin(), parameter_fields_.end(), std::back_inserter(insert_fields));
-      insert_type insert(db_, table_name_, insert_fields);
-      for (auto &f : all_entities_) {
-        if (f->id() != id_type()) {
-          const insert_record_type rec(std::tuple_cat(f->id(), f->parameters()));
-          insert.push_back(insert_record_type(std::tuple_cat(f->id(), f->parameters())));
+    // Inserts pending links whose endpoints have ids. Links whose insert fails stay pending
+    // and are not counted as inserted; returns their number.
+    size_t create_links() {
+      cache_counters::timer t(counters_, &cache_stats::insert_seconds, &cache_stats::insert_ids_seconds);
+      trace_span span("create_links", table_name_);
+      sqlite::query& insert = insert_.get(db_, [this]() {
+          return "INSERT INTO `" + table_name_ + "` (" + quoted_fields(id_fields_) + ", " +
+            quoted_fields(parameter_fields_) + ") VALUES (" +
+            placeholders(id_fields_.size() + parameter_fields_.size()) + ")";
+        });
+      savepoint sp(db_, "sqldsml_create_links");
+      adjacency_list_type unresolved;
+      size_t n_inserted = 0;
+      size_t n_failed = 0;
+      for (auto &f : pending_) {
+        const id_type id(f->id());
+        if (id != id_type()) {
+          if (ids_index_.find(id) != nullptr) {
+            // Copy of a written link through an endpoint added again after its eviction
+            index_written(f);
+            continue;
+          }
+          const int rc = execute_tuple(insert, record_type(std::tuple_cat(id, f->parameters())));
+          if (rc == SQLITE_DONE) {
+            ++n_inserted;
+            index_written(f);
+            continue;
+          }
+          SQLDSML_HPP_LOG_WARN(std::string("create_links() insert failed with code ") + std::to_string(rc));
+          ++n_failed;
         }
+        unresolved.push_back(f);
       }
-      insert.flush();
+      sp.release();
+      counters_.inserted(n_inserted);
+      span.rows(n_inserted);
+      pending_.swap(unresolved);
+      if (capacity_ != 0) evict();
+      return n_failed;
     }
 
   private:
+    typedef decltype(std::tuple_cat(id_type(), parameters_type())) record_type;
+
+    // Slot the next added link goes to
+    slot_type next_slot() const {
+      if (free_slots_.size() != 0) {
+        return free_slots_.back();
+      } else {
+        assert(all_entities_.size() < std::numeric_limits<slot_type>::max());
+        return static_cast<slot_type>(all_entities_.size());
+      }
+    }
+
+    // Stores a link just put in the endpoints index at next_slot(), adds it to the
+    // adjacency lists and to pending
+    void index_new(const slot_type slot, const parametric_entity_type_ptr& f) {
+      adjacency_list_type& links1 = entity1_links_[f->entity1().get()];
+      adjacency_list_type& links2 = entity2_links_[f->entity2().get()];
+      if (slot == all_entities_.size()) {
+        all_entities_.push_back(f);
+        entity1_positions_.push_back(static_cast<slot_type>(links1.size()));
+        entity2_positions_.push_back(static_cast<slot_type>(links2.size()));
+      } else {
+        assert((free_slots_.size() != 0) && (free_slots_.back() == slot));
+        free_slots_.pop_back();
+        all_entities_[slot] = f;
+        entity1_positions_[slot] = static_cast<slot_type>(links1.size());
+        entity2_positions_[slot] = static_cast<slot_type>(links2.size());
+      }
+      links1.push_back(f);
+      links2.push_back(f);
+      pending_.push_back(f);
+    }
+
+    // Takes note of a link whose row is in the table, for find_written() and eviction
+    void index_written(const parametric_entity_type_ptr& f) {
+      auto found = endpoints_index_.find(f->endpoints());
+      assert(found != nullptr);
+      ids_index_.insert(f->id(), *found);
+      if (capacity_ != 0) written_.push_back(f);
+    }
+
+    const slot_type* find_written(entity1_type& entity1, entity2_type& entity2) const {
+      if ((entity1.id() == typename entity1_type::id_type()) ||
+          (entity2.id() == typename entity2_type::id_type()) ||
+          (ids_index_.size() == 0)) {
+        return nullptr;
+      }
+      return ids_index_.find(id_type(std::tuple_cat(entity1.id(), entity2.id())));
+    }
+
+    void evict() {
+      size_t n_evicted = 0;
+      while ((size() > capacity_) && (written_.size() != 0)) {
+        parametric_entity_type_ptr f = written_.front();
+        written_.pop_front();
+        auto found = endpoints_index_.find(f->endpoints());
+        if ((found == nullptr) || (all_entities_[*found] != f)) continue;
+        const slot_type slot = *found;
+        erase_adjacency(entity1_links_, entity1_positions_, std::get<0>(f->endpoints()), slot);
+        erase_adjacency(entity2_links_, entity2_positions_, std::get<1>(f->endpoints()), slot);
+        endpoints_index_.erase(f->endpoints());
+        const id_type id(f->id());
+        auto written = ids_index_.find(id);
+        if ((written != nullptr) && (*written == slot)) ids_index_.erase(id);
+        all_entities_[slot].reset();
+        free_slots_.push_back(slot);
+        ++n_evicted;
+      }
+      counters_.evicted(n_evicted);
+      SQLDSML_HPP_LOG_INFO(std::string("parametric_link_cache::evict evicted ") + std::to_string(n_evicted));
+    }
+
+    // Moves the last link of the list to the position of the evicted one, positions holds
+    // the position of each link in the list by slot
+    template <typename adjacency_t, typename key_t>
+    void erase_adjacency(adjacency_t& adjacency, std::vector<slot_type>& positions, const key_t key, const slot_type slot) {
+      auto found = adjacency.find(key);
+      assert(found != adjacency.end());
+      auto &links = found->second;
+      const slot_type position = positions[slot];
+      assert((position < links.size()) && (links[position] == all_entities_[slot]));
+      if (position + 1 != links.size()) {
+        links[position] = links.back();
+        positions[*endpoints_index_.find(links[position]->endpoints())] = position;
+      }
+      links.pop_back();
+      if (links.size() == 0) {
+        adjacency.erase(found);
+      }
+    }
+
+    template <typename adjacency_t, typename key_t>
+    static const adjacency_list_type& find_adjacency(const adjacency_t& adjacency, const key_t key) {
+      static const adjacency_list_type empty;
+      auto found = adjacency.find(key);
+      if (found != adjacency.end()) {
+        return found->second;
+      } else {
+        return empty;
+      }
+    }
 
     parametric_entity_container_type all_entities_;
+    std::vector<slot_type> free_slots_;
+    endpoints_index_type endpoints_index_;
+    // Slots of written links by their ids
+    ids_index_type ids_index_;
+    entity1_adjacency_type entity1_links_;
+    entity2_adjacency_type entity2_links_;
+    std::vector<slot_type> entity1_positions_;
+    std::vector<slot_type> entity2_positions_;
+    adjacency_list_type pending_;
     sqlite::database::type_ptr db_;
     std::string table_name_;
     std::vector<std::string> id_fields_;
     std::vector<std::string> parameter_fields_;
+    keyed_select<id_type, id_type> select_ids_;
+    prepared_query insert_;
+    size_t capacity_;
+    std::deque<parametric_entity_type_ptr> written_;
+    mutable cache_counters counters_;
   };
 }
@@ -1,27 +1,50 @@
 #pragma once
 
 #include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <limits>
 #include <memory>
+#include <functional>
+#include <vector>
 
-#include <sqlite_buffered>
+#include <sqlite>
 
+#include "clock_eviction.hpp"
+#include "direct_index.hpp"
+#include "entity_storage.hpp"
+#include "id_allocator.hpp"
 #include "logging.hpp"
+#include "parameters_store.hpp"
+#include "statement.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+#include "open_addressing_map.hpp"
 
 namespace sqldsml{
-  template <typename relational_parametric_entity_t>
+  template <typename relational_parametric_entity_t,
+            typename storage_t = heap_entity_storage<relational_parametric_entity_t>>
   class relational_parametric_entity_cache;
   
-  template <typename relational_parametric_entity_t>
+  template <typename relational_parametric_entity_t,
+            typename storage_t>
   class relational_parametric_entity_cache {
   public:
     typedef relational_parametric_entity_t relational_parametric_entity_type;
-    typedef relational_parametric_entity_cache<relational_parametric_entity_type> type;
+    typedef relational_parametric_entity_cache<relational_parametric_entity_type, storage_t> type;
+    typedef storage_t storage_type;
     typedef typename relational_parametric_entity_type::type_ptr relational_parametric_entity_type_ptr;
     typedef typename relational_parametric_entity_type::parameters_type parameters_type;
     typedef typename relational_parametric_entity_type::parameters_type_ptr parameters_type_ptr;
-    typedef std::set<relational_parametric_entity_type_ptr> relational_parametric_entity_container_type;
+    typedef std::vector<relational_parametric_entity_type_ptr> relational_parametric_entity_container_type;
     typedef typename relational_parametric_entity_type::id_type id_type;
     typedef typename relational_parametric_entity_type::parameters_id_type parameters_id_type;
+    typedef uint32_t slot_type;
+    typedef open_addressing_map<const parameters_type*,
+                                slot_type,
+                                std::hash<const parameters_type*>> parameters_ptr_index_type;
+    typedef typename parameters_index_traits<parameters_type, slot_type>::type parameters_index_type;
+    typedef typename parameters_index_traits<parameters_id_type, slot_type>::type parameters_id_index_type;
 
     template <typename parameter_key_fields_container_t>
     relational_parametric_entity_cache(sqlite::database::type_ptr db,
@@ -31,31 +54,114 @@ namespace sqldsml{
       db_(db),
       table_name_(table_name),
       parameters_table_name_(parameters_table_name),
-      parameter_key_fields_(parameter_key_fields.begin(), parameter_key_fields.end()) {
+      parameter_key_fields_(parameter_key_fields.begin(), parameter_key_fields.end()),
+      capacity_(0),
+      evict_at_(0),
+      joined_resolution_(false),
+      preloaded_(false),
+      evicted_(false) {
     }
 
     relational_parametric_entity_cache(const type& other) :
+      storage_(other.storage_),
       all_entities_(other.all_entities_),
+      parameters_ptr_index_(other.parameters_ptr_index_),
+      parameters_index_(other.parameters_index_),
+      parameters_id_index_(other.parameters_id_index_),
       db_(other.db_),
       table_name_(other.table_name_),
       parameters_table_name_(other.parameters_table_name_),
-      parameter_key_fields_(other.parameter_key_fields_) {
+      parameter_key_fields_(other.parameter_key_fields_),
+      parameters_id_allocator_(other.parameters_id_allocator_),
+      id_allocator_(other.id_allocator_),
+      pending_parameters_(other.pending_parameters_),
+      pending_(other.pending_),
+      unsaved_parameters_(other.unsaved_parameters_),
+      unsaved_(other.unsaved_),
+      select_parameter_ids_(other.select_parameter_ids_),
+      select_ids_(other.select_ids_),
+      select_all_ids_(other.select_all_ids_),
+      insert_parameters_(other.insert_parameters_),
+      insert_(other.insert_),
+      insert_allocated_parameters_(other.insert_allocated_parameters_),
+      insert_allocated_(other.insert_allocated_),
+      last_rowid_(other.last_rowid_),
+      capacity_(other.capacity_),
+      evict_at_(other.evict_at_),
+      joined_resolution_(other.joined_resolution_),
+      preloaded_(other.preloaded_),
+      evicted_(other.evicted_),
+      free_slots_(other.free_slots_),
+      clock_(other.clock_),
+      counters_(other.counters_) {
     }
 
     relational_parametric_entity_cache(type&& other) :
+      storage_(std::move(other.storage_)),
       all_entities_(std::move(other.all_entities_)),
+      parameters_ptr_index_(std::move(other.parameters_ptr_index_)),
+      parameters_index_(std::move(other.parameters_index_)),
+      parameters_id_index_(std::move(other.parameters_id_index_)),
       db_(std::move(other.db_)),
       table_name_(std::move(other.table_name_)),
       parameters_table_name_(std::move(other.parameters_table_name_)),
-      parameter_key_fields_(std::move(other.parameter_key_fields_)) {
+      parameter_key_fields_(std::move(other.parameter_key_fields_)),
+      parameters_id_allocator_(std::move(other.parameters_id_allocator_)),
+      id_allocator_(std::move(other.id_allocator_)),
+      pending_parameters_(std::move(other.pending_parameters_)),
+      pending_(std::move(other.pending_)),
+      unsaved_parameters_(std::move(other.unsaved_parameters_)),
+      unsaved_(std::move(other.unsaved_)),
+      select_parameter_ids_(std::move(other.select_parameter_ids_)),
+      select_ids_(std::move(other.select_ids_)),
+      select_all_ids_(std::move(other.select_all_ids_)),
+      insert_parameters_(std::move(other.insert_parameters_)),
+      insert_(std::move(other.insert_)),
+      insert_allocated_parameters_(std::move(other.insert_allocated_parameters_)),
+      insert_allocated_(std::move(other.insert_allocated_)),
+      last_rowid_(std::move(other.last_rowid_)),
+      capacity_(other.capacity_),
+      evict_at_(other.evict_at_),
+      joined_resolution_(other.joined_resolution_),
+      preloaded_(other.preloaded_),
+      evicted_(other.evicted_),
+      free_slots_(std::move(other.free_slots_)),
+      clock_(std::move(other.clock_)),
+      counters_(other.counters_) {
     }
 
     void swap(type& other) {
+      std::swap(storage_, other.storage_);
       std::swap(all_entities_, other.all_entities_);
+      parameters_ptr_index_.swap(other.parameters_ptr_index_);
+      parameters_index_.swap(other.parameters_index_);
+      parameters_id_index_.swap(other.parameters_id_index_);
       std::swap(db_, other.db_);
       std::swap(table_name_, other.table_name_);
       std::swap(parameters_table_name_, other.parameters_table_name_);
       std::swap(parameter_key_fields_, other.parameter_key_fields_);
+      std::swap(parameters_id_allocator_, other.parameters_id_allocator_);
+      std::swap(id_allocator_, other.id_allocator_);
+      std::swap(pending_parameters_, other.pending_parameters_);
+      std::swap(pending_, other.pending_);
+      std::swap(unsaved_parameters_, other.unsaved_parameters_);
+      std::swap(unsaved_, other.unsaved_);
+      std::swap(select_parameter_ids_, other.select_parameter_ids_);
+      std::swap(select_ids_, other.select_ids_);
+      std::swap(select_all_ids_, other.select_all_ids_);
+      insert_parameters_.swap(other.insert_parameters_);
+      insert_.swap(other.insert_);
+      insert_allocated_parameters_.swap(other.insert_allocated_parameters_);
+      insert_allocated_.swap(other.insert_allocated_);
+      last_rowid_.swap(other.last_rowid_);
+      std::swap(capacity_, other.capacity_);
+      std::swap(evict_at_, other.evict_at_);
+      std::swap(joined_resolution_, other.joined_resolution_);
+      std::swap(preloaded_, other.preloaded_);
+      std::swap(evicted_, other.evicted_);
+      std::swap(free_slots_, other.free_slots_);
+      clock_.swap(other.clock_);
+      std::swap(counters_, other.counters_);
     }
 
     type& operator=(const type& other) {
@@ -69,52 +175,60 @@ namespace sqldsml{
     }
 
     relational_parametric_entity_type_ptr find_by_parameters(const parameters_type_ptr parameters_ptr) const {
-      auto found = std::find_if(all_entities_.begin(),
-				all_entities_.end(), [&parameters_ptr](const relational_parametric_entity_type_ptr& f) {
-                                  return parameters_ptr == f->parameters();
-                                });
-      if (found != all_entities_.end()) {
-        return *found;
-      } else {
-        return nullptr;
-      }
+      return find_in_index(parameters_ptr_index_, parameters_ptr.get());
     }
 
     relational_parametric_entity_type_ptr find_by_parameters(const parameters_type& parameters) const {
-      auto found = std::find_if(all_entities_.begin(),
-				all_entities_.end(), [&parameters](const relational_parametric_entity_type_ptr& f) {
-                                  return parameters == *(f->parameters());
-                                });
-      if (found != all_entities_.end()) {
-        return *found;
-      } else {
-        return nullptr;
-      }
+      return find_in_index(parameters_index_, parameters);
     }
 
     relational_parametric_entity_type_ptr find_by_parameters_id(const parameters_id_type& parameters_id) const {
-      auto found = std::find_if(all_entities_.begin(),
-				all_entities_.end(), [parameters_id](const relational_parametric_entity_type_ptr& f) {
-                                  return parameters_id == f->parameters_id();
-                                });
-      if (found != all_entities_.end()) {
+      return find_in_index(parameters_id_index_, parameters_id);
+    }
+
+    // Slot of the entity in the cache; stays valid until the cache is cleared or, with a
+    // capacity set, the entity is evicted. Entities are matched by their parameters pointer
+    // first and by value if the pointer is not known; parameters interned in a
+    // parameters_store always take the pointer path.
+    slot_type add_slot(const relational_parametric_entity_type& relational_parametric_entity) {
+      auto found = parameters_ptr_index_.find(relational_parametric_entity.parameters().get());
+      if (found == nullptr) {
+        found = parameters_index_.find(*(relational_parametric_entity.parameters()));
+      }
+      if (found != nullptr) {
+        SQLDSML_HPP_LOG("add found");
+        counters_.add(true);
+        clock_.touch(*found);
         return *found;
+      }
+      SQLDSML_HPP_LOG("add not found");
+      counters_.add(false);
+      if ((capacity_ != 0) && (size() >= evict_at_)) {
+        evict();
+      }
+      const slot_type new_slot = make_slot(relational_parametric_entity);
+      const relational_parametric_entity_type_ptr& f = all_entities_[new_slot];
+      if (!evicted_) {
+        allocate_parameters_id(new_slot);
+        allocate_id(new_slot);
+      }
+      if (f->parameters_id() != parameters_id_type()) {
+        parameters_id_index_.insert(f->parameters_id(), new_slot);
       } else {
-        return nullptr;
+        pending_parameters_.push_back(new_slot);
+      }
+      if (f->id() == id_type()) {
+        pending_.push_back(new_slot);
       }
+      return new_slot;
     }
 
     relational_parametric_entity_type_ptr add(const relational_parametric_entity_type& relational_parametric_entity) {
-      auto found = find_by_parameters(relational_parametric_entity.parameters());
-      if (found == nullptr) {
-        SQLDSML_HPP_LOG("add not found");
-        relational_parametric_entity_type_ptr f(new relational_parametric_entity_type(relational_parametric_entity));
-        all_entities_.insert(f);
-        return f;
-      } else {
-        SQLDSML_HPP_LOG("add found");
-        return found;
-      }
+      return all_entities_[add_slot(relational_parametric_entity)];
+    }
+
+    const relational_parametric_entity_type_ptr& at(const slot_type slot) const {
+      return all_entities_[slot];
     }
 
     typename relational_parametric_entity_container_type::iterator begin() {
@@ -125,106 +239,700 @@ namespace sqldsml{
       return all_entities_.end();
     }
 
+    // Number of entities in the cache, not counting evicted ones
     size_t size() {
-      return all_entities_.size();
+      return all_entities_.size() - free_slots_.size();
+    }
+
+    void reserve(const size_t n) {
+      all_entities_.reserve(n);
+      parameters_ptr_index_.reserve(n);
+      parameters_index_.reserve(n);
+      parameters_id_index_.reserve(n);
+    }
+
+    // Bounds the number of cached entities (0, the default, is unbounded). Once the cache
+    // is full, adding an entity evicts entities whose parameters and ids are written, those
+    // not found again since they were added first (CLOCK). Entities not written yet are
+    // never evicted, so the cache may grow past its capacity until the next sync. Evicted
+    // entities leave null pointers in iteration and their slots are reused.
+    void set_capacity(const size_t capacity) {
+      capacity_ = capacity;
+      evict_at_ = capacity;
+    }
+
+    // With allocators set, entities missing from the cache get their parameters ids and/or
+    // ids in add() and are written with those explicit ids before any other insert. sync()
+    // then never inserts rows of that table without an allocated id: entities whose block
+    // reservation failed stay pending until a reservation succeeds. Either allocator may
+    // be null. Allocating in add() is only safe when no matching row can already exist,
+    // e.g. for a new dictionary or after preload(). Once the cache has evicted entities
+    // that no longer holds, so entities added afterwards are looked up at sync and only
+    // the missing ones get ids.
+    void set_id_allocators(const sequence_id_allocator::type_ptr& parameters_id_allocator,
+                           const sequence_id_allocator::type_ptr& id_allocator) {
+      parameters_id_allocator_ = parameters_id_allocator;
+      id_allocator_ = id_allocator;
+    }
+
+    // load_parameter_ids() and load_ids() resolve more pending keys than this through a
+    // temporary table join instead of batched selects
+    void set_load_join_threshold(const size_t join_threshold) {
+      select_parameter_ids_.set_join_threshold(join_threshold);
+      select_ids_.set_join_threshold(join_threshold);
+      select_all_ids_.set_join_threshold(join_threshold);
+    }
+
+    // With joined resolution on, sync() resolves parameters ids and ids together through
+    // load_all_ids() and insert_all_ids(), one query per batch of keys instead of two
+    void set_joined_resolution(const bool joined_resolution) {
+      joined_resolution_ = joined_resolution;
+    }
+
+    // Entities added since the last sync that have no parameters id or no id yet
+    size_t pending_size() const {
+      return std::max(pending_parameters_.size(), pending_.size());
+    }
+
+    // Loads every entity row with its parameters into the cache with one forward scan of
+    // the entity table joined to the parameters table, reserving room from a count of the
+    // rows first; cached entities without ids get theirs. While the cache stays preloaded,
+    // sync() inserts entities missing from it without looking them up, which is only right
+    // if no other connection writes the entity table. Parameters still get looked up, the
+    // parameters table may hold rows of other entity tables. Evicting entities or clearing
+    // the cache ends this. With a capacity set, the scan stops at the capacity and the
+    // cache is not marked preloaded.
+    size_t preload() {
+      cache_counters::timer t(counters_, &cache_stats::load_seconds, &cache_stats::load_ids_seconds);
+      trace_span span("preload", table_name_);
+      sqlite::query count(db_, "SELECT count(*) FROM `" + table_name_ + "`");
+      count.step();
+      int64_t n_rows = 0;
+      count.get(0, n_rows);
+      size_t n_reserved = size() + static_cast<size_t>(n_rows);
+      if (capacity_ != 0) n_reserved = std::min(n_reserved, capacity_);
+      reserve(n_reserved);
+
+      sqlite::query q(db_, "SELECT `e`.`id`, `p`.`id`, " + quoted_fields(parameter_key_fields_, "`p`.") + " FROM `" +
+                      table_name_ + "` AS `e` JOIN `" + parameters_table_name_ + "` AS `p` ON `p`.`id` = `e`.`parameters_id`");
+      size_t n_loaded = 0;
+      bool complete = true;
+      for (q.step(); q.result_code() == SQLITE_ROW; q.step()) {
+        if ((capacity_ != 0) && (size() >= capacity_)) {
+          complete = false;
+          break;
+        }
+        joined_record_type r;
+        get_tuple(q, r);
+        const parameters_type parameters(sqlite::tuple_tail(sqlite::tuple_tail(r)));
+        auto found = parameters_index_.find(parameters);
+        const slot_type slot = (found != nullptr) ? *found : make_slot(std::make_shared<parameters_type>(parameters));
+        auto &f = all_entities_[slot];
+        const parameters_id_type parameters_id(std::get<1>(r));
+        if (f->parameters_id() == parameters_id_type()) {
+          f->parameters_id() = parameters_id;
+          parameters_id_index_.insert(parameters_id, slot);
+        }
+        if ((f->id() == id_type()) && (f->parameters_id() == parameters_id)) {
+          f->id() = id_type(std::get<0>(r));
+        }
+        ++n_loaded;
+      }
+      if (complete && (q.result_code() != SQLITE_DONE)) {
+        SQLDSML_HPP_LOG_WARN(std::string("relational_parametric_entity_cache::preload scan failed with code ") +
+                             std::to_string(q.result_code()));
+        complete = false;
+      }
+      prune_pending_parameters();
+      prune_pending();
+      preloaded_ = complete;
+      counters_.loaded(n_loaded, n_loaded);
+      span.rows(n_loaded);
+      SQLDSML_HPP_LOG_INFO(std::string("relational_parametric_entity_cache::preload loaded ") + std::to_string(n_loaded) +
+                           " of " + std::to_string(n_rows));
+      return n_loaded;
+    }
+
+    // True while every row of the entity table is known to be in the cache
+    bool preloaded() const {
+      return preloaded_;
+    }
+
+    // Resolves parameters ids and ids of the entities added since the last sync: writes
+    // entities with allocated ids, loads ids of existing rows and inserts the missing ones.
+    // Cost depends on the number of new entities only. A preloaded cache resolves them
+    // separately, its entity ids need no query. Returns false if some entities are left
+    // without written rows, they stay pending and are retried at the next sync.
+    bool sync() {
+      trace_span span("sync", table_name_);
+      // Entities whose allocated id was not written may exist with another id
+      const bool failed = write_allocated_ids() != 0;
+      const bool joined = joined_resolution_ && (!preloaded_ || failed);
+      bool lookup_ids = !joined && (!preloaded_ || failed);
+      if (joined) {
+        load_all_ids();
+      } else if (pending_parameters_.size() != 0) {
+        load_parameter_ids();
+      }
+      write_missing_parameter_ids();
+      // Also writes entities whose allocated ids waited for their parameters ids
+      if (write_allocated_ids() != 0) lookup_ids = true;
+      if (pending_.size() != 0) {
+        if (lookup_ids) load_ids();
+        write_missing_ids();
+      }
+      if (capacity_ != 0) {
+        evict_at_ = capacity_;
+        if (size() > capacity_) evict();
+      }
+      return (pending_parameters_.size() == 0) && (pending_.size() == 0) && (unsaved_.size() == 0);
     }
 
     void clear() {
+      preloaded_ = false;
+      evicted_ = false;
+      evict_at_ = capacity_;
+      free_slots_.clear();
+      clock_.clear();
+      pending_parameters_.clear();
+      pending_.clear();
+      unsaved_parameters_.clear();
+      unsaved_.clear();
       all_entities_.clear();
+      storage_.clear();
+      parameters_ptr_index_.clear();
+      parameters_index_.clear();
+      parameters_id_index_.clear();
     }
 
     relational_parametric_entity_container_type& all_entities() {
       return all_entities_;
     }
 
-    void load_parameter_ids() {
-      typedef decltype(std::tuple_cat(parameters_id_type(), parameters_type())) select_record_type;
-      typedef sqlite::buffered::input_query_by_keys_base<
-        select_record_type,
-        parameters_type,
-        sqlite::default_value_access_policy> select_query_type;
+    cache_stats stats() const {
+      cache_stats s;
+      s.statements_prepared = select_parameter_ids_.prepare_count() + select_ids_.prepare_count() +
+        select_all_ids_.prepare_count() +
+        insert_parameters_.prepare_count() + insert_.prepare_count() +
+        insert_allocated_parameters_.prepare_count() + insert_allocated_.prepare_count() +
+        last_rowid_.prepare_count();
+      counters_.fill(s);
+      return s;
+    }
 
-      std::string query_prefix_str = "SELECT `id`";
-      for (auto &f : parameter_key_fields_) {
-        query_prefix_str += ", `" + f + "`";
-      }
-      query_prefix_str += " FROM `" + parameters_table_name_ + "` WHERE ";
+    void reset_stats() {
+      counters_.reset();
+    }
 
-      select_query_type select(db_, query_prefix_str, parameter_key_fields_);
-      for (auto &f : all_entities_) {
+    void load_parameter_ids() {
+      cache_counters::timer t(counters_, &cache_stats::load_seconds, &cache_stats::load_parameter_ids_seconds);
+      trace_span span("load_parameter_ids", parameters_table_name_);
+      std::vector<const parameters_type*> keys;
+      for (auto slot : pending_parameters_) {
+        auto &f = all_entities_[slot];
         if (f->parameters_id() == parameters_id_type()) {
-          select.add_key(*(f->parameters()));
-        }
-      }
-      for (auto r : select) {
-        auto found = find_by_parameters(sqlite::tuple_tail(r));
-        if (found != nullptr) {
-          found->parameters_id() = parameters_id_type(std::get<0>(r));
+          keys.push_back(f->parameters().get());
         }
       }
+      auto build_prefix = [this]() {
+        return "SELECT `id`, " + quoted_fields(parameter_key_fields_) + " FROM `" + parameters_table_name_ + "`";
+      };
+      const size_t n_selected = select_parameter_ids_.run(db_, build_prefix, parameter_key_fields_, keys, [this](const parameter_record_type& r) {
+          auto found = parameters_index_.find(sqlite::tuple_tail(r));
+          if (found != nullptr) {
+            const parameters_id_type parameters_id(std::get<0>(r));
+            all_entities_[*found]->parameters_id() = parameters_id;
+            parameters_id_index_.insert(parameters_id, *found);
+          }
+        });
+      counters_.loaded(keys.size(), n_selected);
+      span.rows(n_selected);
+      prune_pending_parameters();
     }
 
     void create_parameter_ids() {
-      typedef ::sqlite::buffered::insert_query_base<parameters_type,
-                                                    ::sqlite::default_value_access_policy> insert_type;
-      insert_type insert(db_, parameters_table_name_, parameter_key_fields_);
-      for (auto &f : all_entities_) {
-        if (f->parameters_id() == parameters_id_type()) {
-          insert.push_back(*(f->parameters()));
+      // Allocated ids go first, so rows inserted without one cannot take a reserved id
+      const size_t n_allocated = create_allocated_parameter_ids();
+      cache_counters::timer t(counters_, &cache_stats::insert_seconds, &cache_stats::insert_parameter_ids_seconds);
+      trace_span span("create_parameter_ids", parameters_table_name_);
+      sqlite::query& insert = insert_parameters_query();
+      savepoint sp(db_, "sqldsml_create_parameter_ids");
+      size_t n_inserted = 0;
+      for (auto slot : pending_parameters_) {
+        auto &f = all_entities_[slot];
+        if ((f->parameters_id() == parameters_id_type()) &&
+            (execute_tuple(insert, *(f->parameters())) == SQLITE_DONE)) {
+          ++n_inserted;
         }
       }
-      insert.flush();
+      sp.release();
+      counters_.inserted(n_inserted);
+      span.rows(n_inserted + n_allocated);
     }
 
     void load_ids() {
-      typedef decltype(std::tuple_cat(id_type(), parameters_id_type())) select_record_type;
-      typedef sqlite::buffered::input_query_by_keys_base<
-        select_record_type,
-        parameters_type,
-        sqlite::default_value_access_policy> select_query_type;
+      cache_counters::timer t(counters_, &cache_stats::load_seconds, &cache_stats::load_ids_seconds);
+      trace_span span("load_ids", table_name_);
+      std::vector<const parameters_id_type*> keys;
+      for (auto slot : pending_) {
+        auto &f = all_entities_[slot];
+        if ((f->id() == id_type()) &&
+            (f->parameters_id() != parameters_id_type())) {
+          keys.push_back(&f->parameters_id());
+        }
+      }
+      auto build_prefix = [this]() {
+        return "SELECT `id`, `parameters_id` FROM `" + table_name_ + "`";
+      };
+      const std::vector<std::string> search_fields{"parameters_id"};
+      const size_t n_selected = select_ids_.run(db_, build_prefix, search_fields, keys, [this](const id_record_type& r) {
+          auto found = parameters_id_index_.find(parameters_id_type(std::get<1>(r)));
+          if (found != nullptr) {
+            SQLDSML_HPP_LOG(std::string("relational_parametric_entity_cache::load_ids got requested record"));
+            all_entities_[*found]->id() = id_type(std::get<0>(r));
+          } else {
+            SQLDSML_HPP_LOG_WARN(std::string("relational_parametric_entity_cache::load_ids error - got not requested record"));
+          }
+        });
+      counters_.loaded(keys.size(), n_selected);
+      span.rows(n_selected);
+      prune_pending();
+    }
 
-      std::string query_prefix_str = "SELECT `id`, `parameters_id` ";
-      query_prefix_str += " FROM `" + table_name_ + "` WHERE ";
+    void create_ids() {
+      const size_t n_allocated = create_allocated_ids();
+      cache_counters::timer t(counters_, &cache_stats::insert_seconds, &cache_stats::insert_ids_seconds);
+      trace_span span("create_ids", table_name_);
+      sqlite::query& insert = insert_query();
+      savepoint sp(db_, "sqldsml_create_ids");
+      size_t n_inserted = 0;
+      for (auto slot : pending_) {
+        auto &f = all_entities_[slot];
+        if ((f->id() == id_type()) &&
+            (f->parameters_id() != parameters_id_type()) &&
+            (execute_tuple(insert, f->parameters_id()) == SQLITE_DONE)) {
+          ++n_inserted;
+        }
+      }
+      sp.release();
+      counters_.inserted(n_inserted);
+      span.rows(n_inserted + n_allocated);
+    }
 
-      const std::vector<std::string> search_fields{"parameters_id"};
-      select_query_type select(db_, query_prefix_str, search_fields);
-      for (auto &f : all_entities_) {
+    // Resolves parameters ids and ids of pending entities with one query joining the
+    // parameters table to the entity table, replacing load_parameter_ids() + load_ids().
+    // Parameters that exist without an entity row only give the parameters id. The
+    // parameter key fields must not clash with the entity table's columns.
+    size_t load_all_ids() {
+      cache_counters::timer t(counters_, &cache_stats::load_seconds, &cache_stats::load_ids_seconds);
+      trace_span span("load_all_ids", table_name_);
+      std::vector<const parameters_type*> keys;
+      for (auto slot : pending_parameters_) {
+        auto &f = all_entities_[slot];
+        if (f->parameters_id() == parameters_id_type()) {
+          keys.push_back(f->parameters().get());
+        }
+      }
+      // Entities with a parameters id are not in the list above
+      for (auto slot : pending_) {
+        auto &f = all_entities_[slot];
         if ((f->id() == id_type()) &&
             (f->parameters_id() != parameters_id_type())) {
-          select.add_key(f->parameters_id());
-          //  SQLDSML_HPP_LOG(std::string("relational_parametric_entity_cache::load_ids add key ") + std::to_string(f->parameters_id()));
+          keys.push_back(f->parameters().get());
         }
       }
-      for (auto r : select) {
-        auto found = find_by_parameters_id(parameters_id_type(std::get<1>(r)));
-        if (found != nullptr) {
-          SQLDSML_HPP_LOG(std::string("relational_parametric_entity_cache::load_ids got requested record"));
-          found->id() = id_type(std::get<0>(r));
-        } else {
-          SQLDSML_HPP_LOG(std::string("relational_parametric_entity_cache::load_ids error - got not requested record"));
+      auto build_prefix = [this]() {
+        return "SELECT `e`.`id`, `p`.`id`, " + quoted_fields(parameter_key_fields_, "`p`.") + " FROM `" +
+          parameters_table_name_ + "` AS `p` LEFT JOIN `" + table_name_ + "` AS `e` ON `e`.`parameters_id` = `p`.`id`";
+      };
+      const size_t n_selected = select_all_ids_.run(db_, build_prefix, parameter_key_fields_, keys, [this](const joined_record_type& r) {
+          auto found = parameters_index_.find(sqlite::tuple_tail(sqlite::tuple_tail(r)));
+          if (found != nullptr) {
+            auto &f = all_entities_[*found];
+            const parameters_id_type parameters_id(std::get<1>(r));
+            if (f->parameters_id() == parameters_id_type()) {
+              f->parameters_id() = parameters_id;
+              parameters_id_index_.insert(parameters_id, *found);
+            }
+            // A null entity id reads as 0, the null id
+            if ((f->id() == id_type()) && (f->parameters_id() == parameters_id)) {
+              f->id() = id_type(std::get<0>(r));
+            }
+          }
+        });
+      counters_.loaded(keys.size(), n_selected);
+      span.rows(n_selected);
+      prune_pending_parameters();
+      prune_pending();
+      SQLDSML_HPP_LOG_INFO(std::string("load_all_ids() loaded ") + std::to_string(n_selected) + " out of requested " + std::to_string(keys.size()));
+      return n_selected;
+    }
+
+    // Inserts parameters of entities without parameters id one row at a time and assigns
+    // each the rowid of its insert, replacing create_parameter_ids() + load_parameter_ids()
+    size_t insert_parameter_ids() {
+      const size_t n_allocated = create_allocated_parameter_ids();
+      cache_counters::timer t(counters_, &cache_stats::insert_seconds, &cache_stats::insert_parameter_ids_seconds);
+      trace_span span("insert_parameter_ids", parameters_table_name_);
+      sqlite::query& insert = insert_parameters_query();
+      sqlite::query& last_rowid = last_rowid_query();
+      savepoint sp(db_, "sqldsml_insert_parameter_ids");
+      size_t n_inserted = 0;
+      for (auto slot : pending_parameters_) {
+        auto &f = all_entities_[slot];
+        if (f->parameters_id() == parameters_id_type()) {
+          const int rc = execute_tuple(insert, *(f->parameters()));
+          if (rc == SQLITE_DONE) {
+            typename std::tuple_element<0, parameters_id_type>::type id;
+            last_rowid.step();
+            last_rowid.get(0, id);
+            last_rowid.reset();
+            f->parameters_id() = parameters_id_type(id);
+            parameters_id_index_.insert(f->parameters_id(), slot);
+            ++n_inserted;
+          } else {
+            SQLDSML_HPP_LOG_WARN(std::string("insert_parameter_ids() insert failed with code ") + std::to_string(rc));
+          }
         }
       }
+      sp.release();
+      prune_pending_parameters();
+      counters_.inserted(n_inserted);
+      const size_t n_written = n_inserted + n_allocated;
+      span.rows(n_written);
+      return n_written;
     }
 
-    void create_ids() {
-      typedef ::sqlite::buffered::insert_query_base<parameters_id_type,
-                                                    ::sqlite::default_value_access_policy> insert_type;
-      insert_type insert(db_, table_name_, std::vector<std::string>{"parameters_id"});
-      for (auto &f : all_entities_) {
+    // Inserts entities that have parameters id but no id one row at a time and assigns
+    // each the rowid of its insert, replacing create_ids() + load_ids()
+    size_t insert_ids() {
+      const size_t n_allocated = create_allocated_ids();
+      cache_counters::timer t(counters_, &cache_stats::insert_seconds, &cache_stats::insert_ids_seconds);
+      trace_span span("insert_ids", table_name_);
+      sqlite::query& insert = insert_query();
+      sqlite::query& last_rowid = last_rowid_query();
+      savepoint sp(db_, "sqldsml_insert_ids");
+      size_t n_inserted = 0;
+      for (auto slot : pending_) {
+        auto &f = all_entities_[slot];
         if ((f->id() == id_type()) &&
             (f->parameters_id() != parameters_id_type())) {
-          insert.push_back(parameters_id_type(f->parameters_id()));
+          const int rc = execute_tuple(insert, f->parameters_id());
+          if (rc == SQLITE_DONE) {
+            typename std::tuple_element<0, id_type>::type id;
+            last_rowid.step();
+            last_rowid.get(0, id);
+            last_rowid.reset();
+            f->id() = id_type(id);
+            ++n_inserted;
+          } else {
+            SQLDSML_HPP_LOG_WARN(std::string("insert_ids() insert failed with code ") + std::to_string(rc));
+          }
         }
       }
-      insert.flush();
+      sp.release();
+      prune_pending();
+      counters_.inserted(n_inserted);
+      const size_t n_written = n_inserted + n_allocated;
+      span.rows(n_written);
+      return n_written;
+    }
+
+    // Inserts the missing parameters rows and then the missing entity rows in one
+    // transaction, replacing insert_parameter_ids() + insert_ids()
+    size_t insert_all_ids() {
+      savepoint sp(db_, "sqldsml_insert_all_ids");
+      const size_t n_parameters_written = insert_parameter_ids();
+      const size_t n_written = insert_ids();
+      sp.release();
+      return n_parameters_written + n_written;
     }
 
   private:
+    typedef decltype(std::tuple_cat(parameters_id_type(), parameters_type())) parameter_record_type;
+    typedef decltype(std::tuple_cat(id_type(), parameters_id_type())) id_record_type;
+    typedef decltype(std::tuple_cat(id_type(), parameters_id_type(), parameters_type())) joined_record_type;
+
+    // Inserts parameters left pending after their lookup, or with an allocator set gives
+    // them ids for write_allocated_ids(); parameters whose block reservation fails stay
+    // pending
+    void write_missing_parameter_ids() {
+      if (pending_parameters_.size() == 0) return;
+      if (parameters_id_allocator_ != nullptr) {
+        for (auto slot : pending_parameters_) {
+          allocate_parameters_id(slot);
+          auto &f = all_entities_[slot];
+          if (f->parameters_id() != parameters_id_type()) {
+            parameters_id_index_.insert(f->parameters_id(), slot);
+          }
+        }
+        prune_pending_parameters();
+      } else {
+        insert_parameter_ids();
+      }
+    }
+
+    // Inserts entities left pending after their lookup, or with an allocator set writes
+    // them with allocated ids
+    void write_missing_ids() {
+      if (pending_.size() == 0) return;
+      if (id_allocator_ != nullptr) {
+        for (auto slot : pending_) {
+          allocate_id(slot);
+        }
+        prune_pending();
+        write_allocated_ids();
+      } else {
+        insert_ids();
+      }
+    }
+
+    // create_allocated_parameter_ids() and create_allocated_ids() as a phase of sync();
+    // returns the number of failed inserts
+    size_t write_allocated_ids() {
+      size_t n_failed = 0;
+      if (unsaved_parameters_.size() != 0) {
+        trace_span span("create_allocated_parameter_ids", parameters_table_name_);
+        const size_t n_unsaved = unsaved_parameters_.size();
+        const size_t n_allocated = create_allocated_parameter_ids();
+        span.rows(n_allocated);
+        n_failed += n_unsaved - n_allocated;
+      }
+      if (unsaved_.size() != 0) {
+        trace_span span("create_allocated_ids", table_name_);
+        const size_t n_unsaved = unsaved_.size();
+        const size_t n_allocated = create_allocated_ids();
+        span.rows(n_allocated);
+        // Entities still waiting for their parameters ids stay unsaved
+        n_failed += n_unsaved - n_allocated - unsaved_.size();
+      }
+      return n_failed;
+    }
+
+    sqlite::query& insert_parameters_query() {
+      return insert_parameters_.get(db_, [this]() {
+          return "INSERT INTO `" + parameters_table_name_ + "` (" + quoted_fields(parameter_key_fields_) +
+            ") VALUES (" + placeholders(parameter_key_fields_.size()) + ")";
+        });
+    }
+
+    sqlite::query& insert_query() {
+      return insert_.get(db_, [this]() {
+          return "INSERT INTO `" + table_name_ + "` (`parameters_id`) VALUES (?)";
+        });
+    }
+
+    sqlite::query& last_rowid_query() {
+      return last_rowid_.get(db_, []() {
+          return std::string("SELECT last_insert_rowid()");
+        });
+    }
+
+    // Puts a new entity in a free slot or at the end and indexes it by its parameters
+    template <typename source_t>
+    slot_type make_slot(const source_t& source) {
+      slot_type new_slot;
+      if (free_slots_.size() != 0) {
+        new_slot = free_slots_.back();
+        free_slots_.pop_back();
+        all_entities_[new_slot] = storage_.make(source);
+      } else {
+        assert(all_entities_.size() < std::numeric_limits<slot_type>::max());
+        new_slot = static_cast<slot_type>(all_entities_.size());
+        all_entities_.push_back(storage_.make(source));
+      }
+      const relational_parametric_entity_type_ptr& f = all_entities_[new_slot];
+      parameters_ptr_index_.insert(f->parameters().get(), new_slot);
+      parameters_index_.insert(*(f->parameters()), new_slot);
+      clock_.add(new_slot);
+      return new_slot;
+    }
+
+    static const unsigned char unsaved_parameters_pin = 2;
+    static const unsigned char unsaved_pin = 4;
+
+    // Evicts written entities until the cache is an eighth below its capacity. If too few
+    // are written, eviction is retried once the cache has grown by another eighth or at
+    // the next sync.
+    void evict() {
+      const size_t target = capacity_ - capacity_ / 8;
+      if (size() > target) {
+        auto can_evict = [this](const size_t slot) {
+          auto &f = all_entities_[slot];
+          return (f != nullptr) && (f->id() != id_type()) && (f->parameters_id() != parameters_id_type());
+        };
+        auto evict_slot = [this](const size_t slot) {
+          auto &f = all_entities_[slot];
+          erase_from_index(parameters_ptr_index_, f->parameters().get(), slot);
+          erase_from_index(parameters_index_, *(f->parameters()), slot);
+          erase_from_index(parameters_id_index_, f->parameters_id(), slot);
+          f.reset();
+          free_slots_.push_back(static_cast<slot_type>(slot));
+        };
+        const size_t n_evicted = clock_.evict(size() - target, can_evict, evict_slot);
+        if (n_evicted != 0) {
+          preloaded_ = false;
+          evicted_ = true;
+        }
+        counters_.evicted(n_evicted);
+        SQLDSML_HPP_LOG_INFO(std::string("relational_parametric_entity_cache::evict evicted ") + std::to_string(n_evicted));
+      }
+      evict_at_ = std::max(capacity_, size() + capacity_ / 8 + 1);
+    }
+
+    // Indexes by value keep the first entity added, so another entity may own the key
+    template <typename index_t, typename key_t>
+    static void erase_from_index(index_t& index, const key_t& key, const size_t slot) {
+      auto found = index.find(key);
+      if ((found != nullptr) && (*found == slot)) {
+        index.erase(key);
+      }
+    }
+
+    void prune_pending_parameters() {
+      auto resolved = [this](const slot_type slot) {
+        return all_entities_[slot]->parameters_id() != parameters_id_type();
+      };
+      pending_parameters_.erase(std::remove_if(pending_parameters_.begin(), pending_parameters_.end(), resolved),
+                                pending_parameters_.end());
+    }
+
+    void prune_pending() {
+      auto resolved = [this](const slot_type slot) {
+        return all_entities_[slot]->id() != id_type();
+      };
+      pending_.erase(std::remove_if(pending_.begin(), pending_.end(), resolved), pending_.end());
+    }
+
+    void allocate_parameters_id(const slot_type slot) {
+      auto &f = all_entities_[slot];
+      if ((parameters_id_allocator_ != nullptr) && (f->parameters_id() == parameters_id_type())) {
+        f->parameters_id() = parameters_id_type(parameters_id_allocator_->next());
+        if (f->parameters_id() != parameters_id_type()) {
+          unsaved_parameters_.push_back(slot);
+          clock_.pin(slot, unsaved_parameters_pin);
+        }
+      }
+    }
+
+    void allocate_id(const slot_type slot) {
+      auto &f = all_entities_[slot];
+      if ((id_allocator_ != nullptr) && (f->id() == id_type())) {
+        f->id() = id_type(id_allocator_->next());
+        if (f->id() != id_type()) {
+          unsaved_.push_back(slot);
+          clock_.pin(slot, unsaved_pin);
+        }
+      }
+    }
+
+    // Writes parameters whose ids came from the allocator. Parameters whose insert fails
+    // lose their id, which has no row behind it, and go back to pending to be looked up.
+    size_t create_allocated_parameter_ids() {
+      if (unsaved_parameters_.size() == 0) return 0;
+      cache_counters::timer t(counters_, &cache_stats::insert_seconds, &cache_stats::create_allocated_seconds);
+      sqlite::query& insert = insert_allocated_parameters_.get(db_, [this]() {
+          return "INSERT INTO `" + parameters_table_name_ + "` (`id`, " + quoted_fields(parameter_key_fields_) +
+            ") VALUES (" + placeholders(1 + parameter_key_fields_.size()) + ")";
+        });
+      savepoint sp(db_, "sqldsml_create_allocated_parameter_ids");
+      size_t n_inserted = 0;
+      for (auto slot : unsaved_parameters_) {
+        auto &f = all_entities_[slot];
+        const int rc = execute_tuple(insert, parameter_record_type(std::tuple_cat(f->parameters_id(), *(f->parameters()))));
+        clock_.unpin(slot, unsaved_parameters_pin);
+        if (rc == SQLITE_DONE) {
+          ++n_inserted;
+        } else {
+          SQLDSML_HPP_LOG_WARN(std::string("create_allocated_parameter_ids() insert failed with code ") + std::to_string(rc));
+          erase_from_index(parameters_id_index_, f->parameters_id(), slot);
+          f->parameters_id() = parameters_id_type();
+          pending_parameters_.push_back(slot);
+        }
+      }
+      sp.release();
+      counters_.inserted(n_inserted);
+      unsaved_parameters_.clear();
+      return n_inserted;
+    }
+
+    // Writes entities whose ids came from the allocator and whose parameters id is known,
+    // the rest stay unsaved until their parameters ids are resolved. Entities whose insert
+    // fails lose their id and go back to pending.
+    size_t create_allocated_ids() {
+      if (unsaved_.size() == 0) return 0;
+      cache_counters::timer t(counters_, &cache_stats::insert_seconds, &cache_stats::create_allocated_seconds);
+      sqlite::query& insert = insert_allocated_.get(db_, [this]() {
+          return "INSERT INTO `" + table_name_ + "` (`id`, `parameters_id`) VALUES (?, ?)";
+        });
+      savepoint sp(db_, "sqldsml_create_allocated_ids");
+      std::vector<slot_type> still_unsaved;
+      size_t n_inserted = 0;
+      for (auto slot : unsaved_) {
+        auto &f = all_entities_[slot];
+        if (f->parameters_id() != parameters_id_type()) {
+          const int rc = execute_tuple(insert, id_record_type(std::tuple_cat(f->id(), f->parameters_id())));
+          clock_.unpin(slot, unsaved_pin);
+          if (rc == SQLITE_DONE) {
+            ++n_inserted;
+          } else {
+            SQLDSML_HPP_LOG_WARN(std::string("create_allocated_ids() insert failed with code ") + std::to_string(rc));
+            f->id() = id_type();
+            pending_.push_back(slot);
+          }
+        } else {
+          still_unsaved.push_back(slot);
+        }
+      }
+      sp.release();
+      counters_.inserted(n_inserted);
+      unsaved_.swap(still_unsaved);
+      return n_inserted;
+    }
+
+    template <typename index_t, typename key_t>
+    relational_parametric_entity_type_ptr find_in_index(const index_t& index, const key_t& key) const {
+      auto found = index.find(key);
+      counters_.lookup(found != nullptr);
+      if (found != nullptr) {
+        clock_.touch(*found);
+        return all_entities_[*found];
+      } else {
+        return nullptr;
+      }
+    }
+
+    storage_type storage_;
     relational_parametric_entity_container_type all_entities_;
+    parameters_ptr_index_type parameters_ptr_index_;
+    parameters_index_type parameters_index_;
+    parameters_id_index_type parameters_id_index_;
     sqlite::database::type_ptr db_;
     std::string table_name_;
     std::string parameters_table_name_;
     std::vector<std::string> parameter_key_fields_;
+    sequence_id_allocator::type_ptr parameters_id_allocator_;
+    sequence_id_allocator::type_ptr id_allocator_;
+    std::vector<slot_type> pending_parameters_;
+    std::vector<slot_type> pending_;
+    std::vector<slot_type> unsaved_parameters_;
+    std::vector<slot_type> unsaved_;
+    keyed_select<parameter_record_type, parameters_type> select_parameter_ids_;
+    keyed_select<id_record_type, parameters_id_type> select_ids_;
+    keyed_select<joined_record_type, parameters_type> select_all_ids_;
+    prepared_query insert_parameters_;
+    prepared_query insert_;
+    prepared_query insert_allocated_parameters_;
+    prepared_query insert_allocated_;
+    prepared_query last_rowid_;
+    size_t capacity_;
+    size_t evict_at_;
+    bool joined_resolution_;
+    bool preloaded_;
+    bool evicted_;
+    std::vector<slot_type> free_slots_;
+    mutable clock_eviction clock_;
+    mutable cache_counters counters_;
   };
 
 }
@@ -17,9 +17,10 @@ namespace sqldsml {
     using parametric_entity<id_t, parameters_t>::parametric_entity;
   };
 
-  template <typename sample_t>
-  class sample_cache : public parametric_entity_cache<sample_t> {
-    using parametric_entity_cache<sample_t>::parametric_entity_cache;
+  template <typename sample_t,
+            typename storage_t = heap_entity_storage<sample_t>>
+  class sample_cache : public parametric_entity_cache<sample_t, storage_t> {
+    using parametric_entity_cache<sample_t, storage_t>::parametric_entity_cache;
   };
 
   template <typename parameters_t>
@@ -27,9 +28,10 @@ namespace sqldsml {
     using relational_parametric_entity<parameters_t>::relational_parametric_entity;
   };
 
-  template <typename sample_t>
-  class relational_sample_cache : public relational_parametric_entity_cache<sample_t> {
-    using relational_parametric_entity_cache<sample_t>::relational_parametric_entity_cache;
+  template <typename sample_t,
+            typename storage_t = heap_entity_storage<sample_t>>
+  class relational_sample_cache : public relational_parametric_entity_cache<sample_t, storage_t> {
+    using relational_parametric_entity_cache<sample_t, storage_t>::relational_parametric_entity_cache;
   };
 
 }
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <iterator>
+#include <tuple>
+#include <vector>
+
+#include "logging.hpp"
+
+namespace sqldsml {
+  // Number of elements in [first, last) when it can be counted without consuming it
+  template <typename iterator_t>
+  size_t batch_size_hint(iterator_t first, iterator_t last, std::forward_iterator_tag) {
+    return static_cast<size_t>(std::distance(first, last));
+  }
+
+  template <typename iterator_t>
+  size_t batch_size_hint(iterator_t, iterator_t, std::input_iterator_tag) {
+    return 0;
+  }
+
+  // Adds the values of one sample. Each element of [first, last) is a pair or tuple of the
+  // feature parameters and the value parameters of a non-zero element. All features are
+  // resolved or added in one call to the feature cache, then all values are linked to
+  // sample in one call to the value cache. Returns the number of values added.
+  template <typename feature_cache_t, typename value_cache_t, typename iterator_t>
+  size_t add_sample_values(feature_cache_t& feature_cache,
+                           value_cache_t& value_cache,
+                           const typename value_cache_t::entity1_type_ptr& sample,
+                           iterator_t first,
+                           iterator_t last) {
+    std::vector<const typename feature_cache_t::parameters_type*> feature_keys;
+    std::vector<const typename value_cache_t::parameters_type*> value_parameters;
+    const size_t n = batch_size_hint(first, last, typename std::iterator_traits<iterator_t>::iterator_category());
+    feature_keys.reserve(n);
+    value_parameters.reserve(n);
+    for (iterator_t it = first; it != last; ++it) {
+      feature_keys.push_back(&std::get<0>(*it));
+      value_parameters.push_back(&std::get<1>(*it));
+    }
+    typename feature_cache_t::parametric_entity_container_type features;
+    feature_cache.add_by_parameters(feature_keys, features);
+    const size_t n_added = value_cache.add_links(sample, features, value_parameters);
+    SQLDSML_HPP_LOG("add_sample_values added " + std::to_string(n_added) + " values");
+    return n_added;
+  }
+}
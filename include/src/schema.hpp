@@ -0,0 +1,205 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include <sqlite>
+
+#include "logging.hpp"
+#include "statement.hpp"
+
+namespace sqldsml {
+  // SQLite column type of a parameter or id tuple element
+  template <typename value_t, typename enable_t = void>
+  struct column_type;
+
+  template <typename value_t>
+  struct column_type<value_t, typename std::enable_if<std::is_integral<value_t>::value>::type> {
+    static std::string name() {
+      return "INTEGER";
+    }
+  };
+
+  template <typename value_t>
+  struct column_type<value_t, typename std::enable_if<std::is_floating_point<value_t>::value>::type> {
+    static std::string name() {
+      return "REAL";
+    }
+  };
+
+  template <>
+  struct column_type<std::string> {
+    static std::string name() {
+      return "TEXT";
+    }
+  };
+
+  template <typename tuple_t, size_t n = std::tuple_size<tuple_t>::value>
+  struct tuple_column_types {
+    static void append(std::vector<std::string>& types) {
+      tuple_column_types<tuple_t, n - 1>::append(types);
+      types.push_back(column_type<typename std::tuple_element<n - 1, tuple_t>::type>::name());
+    }
+  };
+
+  template <typename tuple_t>
+  struct tuple_column_types<tuple_t, 0> {
+    static void append(std::vector<std::string>&) {
+    }
+  };
+
+  // "`a` INTEGER NOT NULL, `b` REAL NOT NULL" for the elements of tuple_t
+  template <typename tuple_t>
+  std::string column_definitions(const std::vector<std::string>& fields) {
+    std::vector<std::string> types;
+    tuple_column_types<tuple_t>::append(types);
+    assert(types.size() == fields.size());
+    std::string s;
+    for (size_t i = 0; i < fields.size(); ++i) {
+      if (i != 0) s += ", ";
+      s += "`" + fields[i] + "` " + types[i] + " NOT NULL";
+    }
+    return s;
+  }
+
+  // Table and index for a parametric_entity_cache. The unique index on the parameter fields
+  // covers the load_ids() select (the id is the rowid) and keeps parameters unique.
+  template <typename entity_t>
+  std::vector<std::string> entity_schema(const std::string& table_name,
+                                         const std::vector<std::string>& id_fields,
+                                         const std::vector<std::string>& parameter_fields) {
+    assert(id_fields.size() == 1);
+    return std::vector<std::string>{
+      "CREATE TABLE IF NOT EXISTS `" + table_name + "` (`" + id_fields[0] + "` INTEGER PRIMARY KEY AUTOINCREMENT, " +
+        column_definitions<typename entity_t::parameters_type>(parameter_fields) + ")",
+      "CREATE UNIQUE INDEX IF NOT EXISTS `" + table_name + "_parameters` ON `" + table_name + "` (" +
+        quoted_fields(parameter_fields) + ")"};
+  }
+
+  // Table for a parametric_link_cache or compact_parametric_link_cache; the primary key on
+  // the endpoint ids dedups links. Lookups of links by their parameters are not indexed.
+  template <typename link_t>
+  std::vector<std::string> link_schema(const std::string& table_name,
+                                       const std::vector<std::string>& id_fields,
+                                       const std::vector<std::string>& parameter_fields) {
+    return std::vector<std::string>{
+      "CREATE TABLE IF NOT EXISTS `" + table_name + "` (" +
+        column_definitions<typename link_t::id_type>(id_fields) + ", " +
+        column_definitions<typename link_t::parameters_type>(parameter_fields) +
+        ", PRIMARY KEY(" + quoted_fields(id_fields) + "))"};
+  }
+
+  // Parameters table, entity table and their indexes for a relational_parametric_entity_cache.
+  // The unique indexes cover the load_parameter_ids() and load_ids() selects.
+  template <typename entity_t>
+  std::vector<std::string> relational_entity_schema(const std::string& table_name,
+                                                    const std::string& parameters_table_name,
+                                                    const std::vector<std::string>& parameter_key_fields) {
+    return std::vector<std::string>{
+      "CREATE TABLE IF NOT EXISTS `" + parameters_table_name + "` (`id` INTEGER PRIMARY KEY AUTOINCREMENT, " +
+        column_definitions<typename entity_t::parameters_type>(parameter_key_fields) + ")",
+      "CREATE UNIQUE INDEX IF NOT EXISTS `" + parameters_table_name + "_keys` ON `" + parameters_table_name + "` (" +
+        quoted_fields(parameter_key_fields) + ")",
+      "CREATE TABLE IF NOT EXISTS `" + table_name + "` (`id` INTEGER PRIMARY KEY AUTOINCREMENT, " +
+        "`parameters_id` INTEGER NOT NULL)",
+      "CREATE UNIQUE INDEX IF NOT EXISTS `" + table_name + "_parameters_id` ON `" + table_name + "` (`parameters_id`)"};
+  }
+
+  // Runs schema statements in one transaction, nothing is created if any of them fails
+  inline bool create_schema(const sqlite::database::type_ptr& db, const std::vector<std::string>& statements) {
+    savepoint sp(db, "sqldsml_create_schema");
+    for (auto &s : statements) {
+      const int rc = execute(db, s);
+      if (rc != SQLITE_DONE) {
+        SQLDSML_HPP_LOG_WARN("create_schema() failed with code " + std::to_string(rc) + ": " + s);
+        return false;
+      }
+    }
+    return sp.release() == SQLITE_DONE;
+  }
+
+  // True if a detail row of EXPLAIN QUERY PLAN scans table_name ("SCAN t", or
+  // "SCAN TABLE t" before SQLite 3.36) or searches it through an automatic index, which is
+  // built by a scan each time the statement runs. Scans of other tables are not reported.
+  inline bool plan_scans_table(const std::string& detail, const std::string& table_name) {
+    const bool scan = detail.compare(0, 5, "SCAN ") == 0;
+    if (!scan && (detail.compare(0, 7, "SEARCH ") != 0)) return false;
+    size_t begin = scan ? 5 : 7;
+    if (detail.compare(begin, 6, "TABLE ") == 0) begin += 6;
+    const size_t end = detail.find(' ', begin);
+    if (detail.substr(begin, end == std::string::npos ? std::string::npos : end - begin) != table_name) {
+      return false;
+    }
+    return scan || (detail.find(" USING AUTOMATIC ", end) != std::string::npos);
+  }
+
+  // Asks the query planner how the lookups keyed_select runs on fields of a table are
+  // executed: the batched select whose keys are OR-ed, and the join with the temporary
+  // keys table used for large key sets. Returns false and logs a warning if the table is
+  // missing or a lookup would scan the table instead of searching an index; scanning the
+  // keys table in the join is expected. No cache runs this check itself, call it (or the
+  // check_*_schema() functions below) once the schema exists, e.g. in a debug build.
+  inline bool check_lookup_index(const sqlite::database::type_ptr& db,
+                                 const std::string& table_name,
+                                 const std::vector<std::string>& fields) {
+    sqlite::query exists(db, "SELECT count(*) FROM `sqlite_master` WHERE `type` = 'table' AND `name` = ?");
+    exists.bind(1, table_name);
+    exists.step();
+    int64_t n_tables = 0;
+    exists.get(0, n_tables);
+    if (n_tables == 0) {
+      SQLDSML_HPP_LOG_WARN("check_lookup_index() found no table `" + table_name + "`");
+      return false;
+    }
+    const std::string select = "SELECT * FROM `" + table_name + "`";
+    execute(db, keyed_select_create_keys_sql(fields.size()));
+    const std::vector<std::string> lookups{
+      keyed_select_batch_sql(select, fields, keyed_select_batch_size(fields.size())),
+      keyed_select_join_sql(select, fields)};
+    bool indexed = true;
+    for (auto &lookup : lookups) {
+      sqlite::query q(db, "EXPLAIN QUERY PLAN " + lookup);
+      for (q.step(); q.result_code() == SQLITE_ROW; q.step()) {
+        std::string detail;
+        q.get(3, detail);
+        if (plan_scans_table(detail, table_name)) {
+          indexed = false;
+        }
+      }
+    }
+    if (!indexed) {
+      SQLDSML_HPP_LOG_WARN("Lookups on (" + quoted_fields(fields) + ") of `" + table_name +
+                           "` scan the table, add an index on these fields");
+    }
+    return indexed;
+  }
+
+  // Checks the lookups load_ids() of a parametric_entity_cache runs
+  inline bool check_entity_schema(const sqlite::database::type_ptr& db,
+                                  const std::string& table_name,
+                                  const std::vector<std::string>& parameter_fields) {
+    return check_lookup_index(db, table_name, parameter_fields);
+  }
+
+  // Checks the lookup by endpoint ids that dedups links
+  inline bool check_link_schema(const sqlite::database::type_ptr& db,
+                                const std::string& table_name,
+                                const std::vector<std::string>& id_fields) {
+    return check_lookup_index(db, table_name, id_fields);
+  }
+
+  // Checks the lookups load_parameter_ids() and load_ids() of a
+  // relational_parametric_entity_cache run
+  inline bool check_relational_entity_schema(const sqlite::database::type_ptr& db,
+                                             const std::string& table_name,
+                                             const std::string& parameters_table_name,
+                                             const std::vector<std::string>& parameter_key_fields) {
+    const bool parameters_indexed = check_lookup_index(db, parameters_table_name, parameter_key_fields);
+    const bool entities_indexed = check_lookup_index(db, table_name, std::vector<std::string>{"parameters_id"});
+    return parameters_indexed && entities_indexed;
+  }
+}
@@ -0,0 +1,362 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <sqlite>
+
+namespace sqldsml {
+  template <size_t n, typename tuple_t>
+  struct tuple_statement_impl {
+    static void bind(sqlite::query& q, const int first, const tuple_t& t) {
+      tuple_statement_impl<n - 1, tuple_t>::bind(q, first, t);
+      q.bind(first + static_cast<int>(n) - 1, std::get<n - 1>(t));
+    }
+
+    static void get(sqlite::query& q, const int first, tuple_t& t) {
+      tuple_statement_impl<n - 1, tuple_t>::get(q, first, t);
+      q.get(first + static_cast<int>(n) - 1, std::get<n - 1>(t));
+    }
+  };
+
+  template <typename tuple_t>
+  struct tuple_statement_impl<0, tuple_t> {
+    static void bind(sqlite::query&, const int, const tuple_t&) {
+    }
+
+    static void get(sqlite::query&, const int, tuple_t&) {
+    }
+  };
+
+  // Binds tuple elements to consecutive parameters starting at (1-based) index first
+  template <typename tuple_t>
+  void bind_tuple(sqlite::query& q, const tuple_t& t, const int first = 1) {
+    tuple_statement_impl<std::tuple_size<tuple_t>::value, tuple_t>::bind(q, first, t);
+  }
+
+  // Reads consecutive result columns starting at (0-based) index first into tuple elements
+  template <typename tuple_t>
+  void get_tuple(sqlite::query& q, tuple_t& t, const int first = 0) {
+    tuple_statement_impl<std::tuple_size<tuple_t>::value, tuple_t>::get(q, first, t);
+  }
+
+  // "`a`, `b`, `c`"
+  inline std::string quoted_fields(const std::vector<std::string>& fields, const std::string& prefix = "") {
+    std::string s;
+    for (auto &f : fields) {
+      if (s.size() != 0) s += ", ";
+      s += prefix + "`" + f + "`";
+    }
+    return s;
+  }
+
+  // "?, ?, ?"
+  inline std::string placeholders(const size_t n) {
+    std::string s;
+    for (size_t i = 0; i < n; ++i) {
+      if (i != 0) s += ", ";
+      s += "?";
+    }
+    return s;
+  }
+
+  // Runs a statement that returns no rows
+  inline int execute(const sqlite::database::type_ptr& db, const std::string& query_str) {
+    sqlite::query q(db, query_str);
+    q.step();
+    return q.result_code();
+  }
+
+  // Savepoint that is rolled back unless released. Works both outside of a transaction
+  // (it then starts one) and nested within one. If releasing fails, e.g. with SQLITE_BUSY
+  // when the commit of an outermost savepoint cannot get its lock, the savepoint is rolled
+  // back and released, so no transaction is left open.
+  class savepoint {
+  public:
+    savepoint(const sqlite::database::type_ptr& db, const std::string& name) :
+      db_(db),
+      name_(name),
+      released_(false) {
+      execute(db_, "SAVEPOINT `" + name_ + "`");
+    }
+
+    ~savepoint() {
+      if (!released_) {
+        rollback();
+      }
+    }
+
+    // Returns the result code of the RELEASE; anything but SQLITE_DONE means the savepoint
+    // was rolled back
+    int release() {
+      const int rc = execute(db_, "RELEASE `" + name_ + "`");
+      if (rc != SQLITE_DONE) {
+        rollback();
+      }
+      released_ = true;
+      return rc;
+    }
+
+  private:
+    savepoint(savepoint const&) = delete;
+    void operator=(savepoint const&) = delete;
+
+    void rollback() {
+      execute(db_, "ROLLBACK TO `" + name_ + "`");
+      // Only releasing an outermost savepoint commits, and the commit may still not get its
+      // lock after the rollback; the transaction then ends with a plain ROLLBACK
+      if (execute(db_, "RELEASE `" + name_ + "`") != SQLITE_DONE) {
+        execute(db_, "ROLLBACK");
+      }
+    }
+
+    sqlite::database::type_ptr db_;
+    std::string name_;
+    bool released_;
+  };
+
+  // Statement prepared on first use and kept for the lifetime of its owner, so repeated
+  // calls only rebind it. The SQL is built only when the statement is prepared. Copies
+  // prepare their own statement when first used.
+  class prepared_query {
+  public:
+    prepared_query() :
+      prepare_count_(0) {
+    }
+
+    prepared_query(const prepared_query&) :
+      prepare_count_(0) {
+    }
+
+    prepared_query(prepared_query&& other) :
+      query_(std::move(other.query_)),
+      prepare_count_(other.prepare_count_) {
+    }
+
+    void swap(prepared_query& other) {
+      std::swap(query_, other.query_);
+      std::swap(prepare_count_, other.prepare_count_);
+    }
+
+    prepared_query& operator=(const prepared_query& other) {
+      prepared_query tmp(other);
+      swap(tmp);
+      return *this;
+    }
+
+    template <typename sql_builder_t>
+    sqlite::query& get(const sqlite::database::type_ptr& db, const sql_builder_t& build_sql) {
+      if (query_ == nullptr) {
+        query_.reset(new sqlite::query(db, build_sql()));
+        ++prepare_count_;
+      }
+      return *query_;
+    }
+
+    size_t prepare_count() const {
+      return prepare_count_;
+    }
+
+  private:
+    std::unique_ptr<sqlite::query> query_;
+    size_t prepare_count_;
+  };
+
+  // Binds the record, runs the statement and resets it for the next record
+  template <typename tuple_t>
+  int execute_tuple(sqlite::query& q, const tuple_t& t) {
+    bind_tuple(q, t);
+    q.step();
+    const int rc = q.result_code();
+    q.reset();
+    return rc;
+  }
+
+  // SQL that keyed_select runs for a select and its key fields; also used by
+  // check_lookup_index() to ask the query planner about exactly these statements
+
+  // Keys matched per statement by the batched select
+  inline size_t keyed_select_batch_size(const size_t n_key_fields) {
+    // Stay within the default SQLITE_MAX_VARIABLE_NUMBER of old SQLite versions
+    return std::max<size_t>(1, std::min<size_t>(100, 999 / n_key_fields));
+  }
+
+  // "(`a` = ? AND `b` = ?) OR (`a` = ? AND `b` = ?)" appended to select for n keys
+  inline std::string keyed_select_batch_sql(const std::string& select,
+                                            const std::vector<std::string>& key_fields,
+                                            const size_t n) {
+    std::string key;
+    for (auto &f : key_fields) {
+      if (key.size() != 0) key += " AND ";
+      key += "`" + f + "` = ?";
+    }
+    std::string s;
+    for (size_t i = 0; i < n; ++i) {
+      if (i != 0) s += " OR ";
+      s += "(" + key + ")";
+    }
+    return select + " WHERE " + s;
+  }
+
+  // Temporary table the keys of large key sets are written to, shared by all selects with
+  // the same number of key fields on the connection
+  inline std::string keyed_select_keys_table(const size_t n_key_fields) {
+    return "sqldsml_keys_" + std::to_string(n_key_fields);
+  }
+
+  inline std::vector<std::string> keyed_select_keys_fields(const size_t n_key_fields) {
+    std::vector<std::string> keys_fields;
+    for (size_t i = 0; i < n_key_fields; ++i) {
+      keys_fields.push_back("sqldsml_k" + std::to_string(i));
+    }
+    return keys_fields;
+  }
+
+  inline std::string keyed_select_create_keys_sql(const size_t n_key_fields) {
+    return "CREATE TEMP TABLE IF NOT EXISTS `" + keyed_select_keys_table(n_key_fields) + "` (" +
+      quoted_fields(keyed_select_keys_fields(n_key_fields)) + ")";
+  }
+
+  // select joined with the temporary table on the key fields
+  inline std::string keyed_select_join_sql(const std::string& select,
+                                           const std::vector<std::string>& key_fields) {
+    const std::string keys_table = keyed_select_keys_table(key_fields.size());
+    const std::vector<std::string> keys_fields = keyed_select_keys_fields(key_fields.size());
+    std::string on;
+    for (size_t i = 0; i < key_fields.size(); ++i) {
+      if (i != 0) on += " AND ";
+      on += "`" + key_fields[i] + "` = `" + keys_table + "`.`" + keys_fields[i] + "`";
+    }
+    return select + " JOIN `temp`.`" + keys_table + "` ON " + on;
+  }
+
+  // Selects rows by keys. Up to join_threshold keys go through one prepared statement that
+  // matches batch_size keys, the last batch being padded by repeating its last key. Larger
+  // key sets are written to a temporary table and resolved with a single join, so a cold
+  // start is one pass through SQLite instead of one statement per batch. Calls f for each
+  // selected record.
+  template <typename record_t, typename key_t>
+  class keyed_select {
+  public:
+    static const size_t default_join_threshold = 10000;
+
+    keyed_select() :
+      batch_size_(0),
+      join_threshold_(default_join_threshold) {
+    }
+
+    // Key sets larger than this are resolved through a temporary table
+    void set_join_threshold(const size_t join_threshold) {
+      join_threshold_ = join_threshold;
+    }
+
+    // build_select returns "SELECT ... FROM `table`", key fields are columns of that table
+    template <typename select_builder_t, typename callback_t>
+    size_t run(const sqlite::database::type_ptr& db,
+               const select_builder_t& build_select,
+               const std::vector<std::string>& key_fields,
+               const std::vector<const key_t*>& keys,
+               const callback_t& f) {
+      if (keys.size() == 0) {
+        return 0;
+      } else if (keys.size() > join_threshold_) {
+        return run_join(db, build_select, key_fields, keys, f);
+      } else {
+        return run_batches(db, build_select, key_fields, keys, f);
+      }
+    }
+
+    size_t prepare_count() const {
+      return query_.prepare_count() + create_keys_.prepare_count() + clear_keys_.prepare_count() +
+        insert_key_.prepare_count() + join_.prepare_count();
+    }
+
+  private:
+    template <typename select_builder_t, typename callback_t>
+    size_t run_batches(const sqlite::database::type_ptr& db,
+                       const select_builder_t& build_select,
+                       const std::vector<std::string>& key_fields,
+                       const std::vector<const key_t*>& keys,
+                       const callback_t& f) {
+      if (batch_size_ == 0) {
+        batch_size_ = keyed_select_batch_size(key_fields.size());
+      }
+      sqlite::query& q = query_.get(db, [&]() {
+          return keyed_select_batch_sql(build_select(), key_fields, batch_size_);
+        });
+      size_t n_selected = 0;
+      for (size_t first = 0; first < keys.size(); first += batch_size_) {
+        for (size_t k = 0; k < batch_size_; ++k) {
+          const size_t i = std::min(first + k, keys.size() - 1);
+          bind_tuple(q, *keys[i], static_cast<int>(1 + k * key_fields.size()));
+        }
+        n_selected += read(q, f);
+      }
+      return n_selected;
+    }
+
+    // Keys are bulk inserted into a temporary table shared by all selects with the same
+    // number of key fields on the connection, then joined back to the table
+    template <typename select_builder_t, typename callback_t>
+    size_t run_join(const sqlite::database::type_ptr& db,
+                    const select_builder_t& build_select,
+                    const std::vector<std::string>& key_fields,
+                    const std::vector<const key_t*>& keys,
+                    const callback_t& f) {
+      const std::string keys_table = keyed_select_keys_table(key_fields.size());
+      const std::vector<std::string> keys_fields = keyed_select_keys_fields(key_fields.size());
+      sqlite::query& create_keys = create_keys_.get(db, [&]() {
+          return keyed_select_create_keys_sql(key_fields.size());
+        });
+      create_keys.step();
+      create_keys.reset();
+      sqlite::query& clear_keys = clear_keys_.get(db, [&]() {
+          return "DELETE FROM `temp`.`" + keys_table + "`";
+        });
+      sqlite::query& insert_key = insert_key_.get(db, [&]() {
+          return "INSERT INTO `temp`.`" + keys_table + "` (" + quoted_fields(keys_fields) + ") VALUES (" +
+            placeholders(keys_fields.size()) + ")";
+        });
+      sqlite::query& join = join_.get(db, [&]() {
+          return keyed_select_join_sql(build_select(), key_fields);
+        });
+
+      savepoint sp(db, "sqldsml_keyed_select");
+      clear_keys.step();
+      clear_keys.reset();
+      for (auto key : keys) {
+        execute_tuple(insert_key, *key);
+      }
+      const size_t n_selected = read(join, f);
+      clear_keys.step();
+      clear_keys.reset();
+      sp.release();
+      return n_selected;
+    }
+
+    template <typename callback_t>
+    static size_t read(sqlite::query& q, const callback_t& f) {
+      size_t n_selected = 0;
+      for (q.step(); q.result_code() == SQLITE_ROW; q.step()) {
+        record_t r;
+        get_tuple(q, r);
+        f(r);
+        ++n_selected;
+      }
+      q.reset();
+      return n_selected;
+    }
+
+    prepared_query query_;
+    prepared_query create_keys_;
+    prepared_query clear_keys_;
+    prepared_query insert_key_;
+    prepared_query join_;
+    size_t batch_size_;
+    size_t join_threshold_;
+  };
+}
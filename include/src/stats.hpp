@@ -0,0 +1,176 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+
+namespace sqldsml {
+  // Counters reported by the caches' stats(). Everything but statements_prepared is only
+  // counted when SQLDSML_HPP_STATS is defined, and stays 0 otherwise.
+  struct cache_stats {
+    cache_stats() :
+      add_hits(0),
+      add_misses(0),
+      lookups(0),
+      lookup_hits(0),
+      rows_requested(0),
+      rows_loaded(0),
+      rows_inserted(0),
+      evicted(0),
+      statements_prepared(0),
+      load_seconds(0),
+      insert_seconds(0),
+      load_parameter_ids_seconds(0),
+      load_ids_seconds(0),
+      insert_parameter_ids_seconds(0),
+      insert_ids_seconds(0),
+      create_allocated_seconds(0) {
+    }
+
+    cache_stats& operator+=(const cache_stats& other) {
+      add_hits += other.add_hits;
+      add_misses += other.add_misses;
+      lookups += other.lookups;
+      lookup_hits += other.lookup_hits;
+      rows_requested += other.rows_requested;
+      rows_loaded += other.rows_loaded;
+      rows_inserted += other.rows_inserted;
+      evicted += other.evicted;
+      statements_prepared += other.statements_prepared;
+      load_seconds += other.load_seconds;
+      insert_seconds += other.insert_seconds;
+      load_parameter_ids_seconds += other.load_parameter_ids_seconds;
+      load_ids_seconds += other.load_ids_seconds;
+      insert_parameter_ids_seconds += other.insert_parameter_ids_seconds;
+      insert_ids_seconds += other.insert_ids_seconds;
+      create_allocated_seconds += other.create_allocated_seconds;
+      return *this;
+    }
+
+    // add() calls that found the entity already cached / that added it
+    size_t add_hits;
+    size_t add_misses;
+    // find_*() calls and the ones that found an entity
+    size_t lookups;
+    size_t lookup_hits;
+    // Keys looked up in the database by the load_*() calls and rows they got back
+    size_t rows_requested;
+    size_t rows_loaded;
+    // Rows written by the create_*() and insert_*() calls
+    size_t rows_inserted;
+    size_t evicted;
+    // Statements the cache has prepared since it was constructed; stays flat across
+    // syncs once every statement the cache uses has been prepared. Not reset.
+    size_t statements_prepared;
+    // Wall time spent in the load_*() and in the create_*()/insert_*() calls
+    double load_seconds;
+    double insert_seconds;
+    // The same split by phase: load_seconds into parameters and entity lookups (joined
+    // lookups and preload() count as entity lookups), insert_seconds into parameters rows,
+    // entity or link rows inserted without an id, and rows with allocated ids
+    double load_parameter_ids_seconds;
+    double load_ids_seconds;
+    double insert_parameter_ids_seconds;
+    double insert_ids_seconds;
+    double create_allocated_seconds;
+  };
+
+#if defined(SQLDSML_HPP_STATS)
+  // Counters owned by a cache; with SQLDSML_HPP_STATS undefined it is empty and all of its
+  // calls are no-ops
+  class cache_counters {
+  public:
+    // Adds the time from construction to destruction to a cache_stats total and to the
+    // field of its phase
+    class timer {
+    public:
+      timer(cache_counters& counters, double cache_stats::* field, double cache_stats::* phase_field) :
+        counters_(counters),
+        field_(field),
+        phase_field_(phase_field),
+        start_(std::chrono::steady_clock::now()) {
+      }
+
+      ~timer() {
+        const std::chrono::duration<double> d = std::chrono::steady_clock::now() - start_;
+        counters_.values_.*field_ += d.count();
+        counters_.values_.*phase_field_ += d.count();
+      }
+
+    private:
+      timer(timer const&) = delete;
+      void operator=(timer const&) = delete;
+
+      cache_counters& counters_;
+      double cache_stats::* field_;
+      double cache_stats::* phase_field_;
+      std::chrono::steady_clock::time_point start_;
+    };
+
+    void add(const bool hit) {
+      ++(hit ? values_.add_hits : values_.add_misses);
+    }
+
+    void lookup(const bool hit) {
+      ++values_.lookups;
+      if (hit) ++values_.lookup_hits;
+    }
+
+    void loaded(const size_t requested, const size_t rows) {
+      values_.rows_requested += requested;
+      values_.rows_loaded += rows;
+    }
+
+    void inserted(const size_t rows) {
+      values_.rows_inserted += rows;
+    }
+
+    void evicted(const size_t n) {
+      values_.evicted += n;
+    }
+
+    // Adds the counted values to s
+    void fill(cache_stats& s) const {
+      const size_t statements_prepared = s.statements_prepared;
+      s += values_;
+      s.statements_prepared = statements_prepared;
+    }
+
+    void reset() {
+      values_ = cache_stats();
+    }
+
+  private:
+    cache_stats values_;
+  };
+#else
+  class cache_counters {
+  public:
+    class timer {
+    public:
+      timer(cache_counters&, double cache_stats::*, double cache_stats::*) {
+      }
+    };
+
+    void add(const bool) {
+    }
+
+    void lookup(const bool) {
+    }
+
+    void loaded(const size_t, const size_t) {
+    }
+
+    void inserted(const size_t) {
+    }
+
+    void evicted(const size_t) {
+    }
+
+    void fill(cache_stats&) const {
+    }
+
+    void reset() {
+    }
+  };
+#endif
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <functional>
+#include <vector>
+
+#include <sqlite>
+
+#include "connection_profile.hpp"
+#include "logging.hpp"
+#include "statement.hpp"
+#include "trace.hpp"
+
+namespace sqldsml {
+  // Syncs a set of caches in one transaction: entity caches first, in the order they were
+  // added, then link caches, so links see the ids of their endpoints. Holds references to
+  // the caches, which must outlive the coordinator. If the transaction cannot be committed,
+  // e.g. because another connection holds a lock, it is rolled back and sync() returns
+  // false, but ids already assigned in memory are not, so the caches should be cleared.
+  // sync() also returns false when a cache left rows pending, they are retried next time.
+  class sync_coordinator {
+  public:
+    sync_coordinator(sqlite::database::type_ptr db) :
+      db_(db),
+      syncs_since_checkpoint_(0) {
+    }
+
+    // Applies profile to the connection and schedules its checkpoints; may be switched
+    // between syncs, e.g. from bulk_load() to steady_state() once the initial load is done
+    bool set_profile(const connection_profile& profile) {
+      profile_ = profile;
+      syncs_since_checkpoint_ = 0;
+      return profile_.apply(db_);
+    }
+
+    const connection_profile& profile() const {
+      return profile_;
+    }
+
+    bool checkpoint() {
+      syncs_since_checkpoint_ = 0;
+      return profile_.checkpoint(db_);
+    }
+
+    template <typename entity_cache_t>
+    void add_entity_cache(entity_cache_t& cache) {
+      entity_syncs_.push_back([&cache]() { return cache.sync(); });
+    }
+
+    template <typename link_cache_t>
+    void add_link_cache(link_cache_t& cache) {
+      link_syncs_.push_back([&cache]() { return cache.sync(); });
+    }
+
+    bool sync() {
+      trace_span span("sync_coordinator::sync", "");
+      savepoint sp(db_, "sqldsml_sync");
+      bool ok = true;
+      for (auto &s : entity_syncs_) {
+        ok = s() && ok;
+      }
+      for (auto &s : link_syncs_) {
+        ok = s() && ok;
+      }
+      const int rc = sp.release();
+      if (rc != SQLITE_DONE) {
+        SQLDSML_HPP_LOG_WARN(std::string("sync_coordinator::sync failed with code ") + std::to_string(rc));
+        return false;
+      }
+      if ((profile_.checkpoint_every != 0) && (++syncs_since_checkpoint_ >= profile_.checkpoint_every)) {
+        trace_span checkpoint_span("checkpoint", "");
+        checkpoint();
+      }
+      return ok;
+    }
+
+  private:
+    sync_coordinator(sync_coordinator const&) = delete;
+    void operator=(sync_coordinator const&) = delete;
+
+    sqlite::database::type_ptr db_;
+    std::vector<std::function<bool()>> entity_syncs_;
+    std::vector<std::function<bool()>> link_syncs_;
+    connection_profile profile_;
+    size_t syncs_since_checkpoint_;
+  };
+}
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#if defined(SQLDSML_HPP_TRACE)
+
+// Events the tracer holds before it drops new ones; clear() makes room again
+#if !defined(SQLDSML_HPP_TRACE_MAX_EVENTS)
+#define SQLDSML_HPP_TRACE_MAX_EVENTS 1000000
+#endif
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace sqldsml {
+  struct trace_event {
+    std::string name;
+    std::string category;
+    int64_t start_us;
+    int64_t duration_us;
+    size_t tid;
+    // Rows the span worked on, negative when not reported
+    int64_t rows;
+  };
+
+  // Collects the spans recorded while SQLDSML_HPP_TRACE is defined and writes them as
+  // Chrome trace events ("X" complete events), which chrome://tracing and Perfetto load.
+  // Spans name a phase and carry the table of the cache as category. At most
+  // SQLDSML_HPP_TRACE_MAX_EVENTS events are held, later ones are dropped and counted until
+  // the tracer is cleared, so a long run does not grow without bound; callers that want
+  // every event write and clear periodically.
+  class tracer {
+  public:
+    static tracer& get_instance() {
+      static tracer instance;
+      return instance;
+    }
+
+    int64_t now_us() const {
+      return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - epoch_).count();
+    }
+
+    void record(trace_event&& e) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto inserted = tids_.emplace(std::this_thread::get_id(), tids_.size() + 1);
+      e.tid = inserted.first->second;
+      if (events_.size() < SQLDSML_HPP_TRACE_MAX_EVENTS) {
+        events_.push_back(std::move(e));
+      } else {
+        ++dropped_;
+      }
+    }
+
+    // Events dropped since the last clear()
+    size_t dropped() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return dropped_;
+    }
+
+    // Writes the held events, and the number of dropped ones as metadata
+    void write(std::ostream& out) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      out << "{\"traceEvents\":[";
+      for (size_t i = 0; i < events_.size(); ++i) {
+        const trace_event& e = events_[i];
+        if (i != 0) out << ",";
+        out << "\n{\"name\":\"" << escaped(e.name) << "\",\"cat\":\"" << escaped(e.category) <<
+          "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.tid << ",\"ts\":" << e.start_us <<
+          ",\"dur\":" << e.duration_us;
+        if (e.rows >= 0) {
+          out << ",\"args\":{\"rows\":" << e.rows << "}";
+        }
+        out << "}";
+      }
+      out << "\n],\"otherData\":{\"dropped_events\":" << dropped_ << "}}\n";
+    }
+
+    bool write(const std::string& filename) {
+      std::ofstream out(filename);
+      write(out);
+      return out.good();
+    }
+
+    void clear() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      events_.clear();
+      dropped_ = 0;
+    }
+
+  private:
+    tracer() :
+      epoch_(std::chrono::steady_clock::now()),
+      dropped_(0) {
+    }
+    tracer(tracer const&) = delete;
+    void operator=(tracer const&) = delete;
+
+    // JSON string contents: quotes, backslashes and control characters are escaped
+    static std::string escaped(const std::string& s) {
+      static const char hex[] = "0123456789abcdef";
+      std::string r;
+      for (auto c : s) {
+        const unsigned char u = static_cast<unsigned char>(c);
+        if ((c == '"') || (c == '\\')) {
+          r += '\\';
+          r += c;
+        } else if (c == '\n') {
+          r += "\\n";
+        } else if (c == '\t') {
+          r += "\\t";
+        } else if (u < 0x20) {
+          r += "\\u00";
+          r += hex[u >> 4];
+          r += hex[u & 0xf];
+        } else {
+          r += c;
+        }
+      }
+      return r;
+    }
+
+    std::chrono::steady_clock::time_point epoch_;
+    std::mutex mutex_;
+    std::unordered_map<std::thread::id, size_t> tids_;
+    std::vector<trace_event> events_;
+    size_t dropped_;
+  };
+
+  // Records a span from construction to destruction; without SQLDSML_HPP_TRACE it is empty
+  class trace_span {
+  public:
+    trace_span(const char* name, const std::string& category) :
+      name_(name),
+      category_(category),
+      start_us_(tracer::get_instance().now_us()),
+      rows_(-1) {
+    }
+
+    ~trace_span() {
+      tracer& t = tracer::get_instance();
+      trace_event e;
+      e.name = name_;
+      e.category = category_;
+      e.start_us = start_us_;
+      e.duration_us = t.now_us() - start_us_;
+      e.rows = rows_;
+      t.record(std::move(e));
+    }
+
+    void rows(const size_t n) {
+      rows_ = static_cast<int64_t>(n);
+    }
+
+  private:
+    trace_span(trace_span const&) = delete;
+    void operator=(trace_span const&) = delete;
+
+    const char* name_;
+    std::string category_;
+    int64_t start_us_;
+    int64_t rows_;
+  };
+}
+
+#else
+
+namespace sqldsml {
+  class trace_span {
+  public:
+    trace_span(const char*, const std::string&) {
+    }
+
+    void rows(const size_t) {
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <tuple>
+
+namespace sqldsml {
+  inline void hash_combine(size_t& seed, const size_t h) {
+    seed ^= h + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+  }
+
+  template <size_t n, typename tuple_t>
+  struct tuple_hash_impl {
+    static void apply(size_t& seed, const tuple_t& t) {
+      tuple_hash_impl<n - 1, tuple_t>::apply(seed, t);
+      typedef typename std::tuple_element<n - 1, tuple_t>::type element_type;
+      hash_combine(seed, std::hash<element_type>()(std::get<n - 1>(t)));
+    }
+  };
+
+  template <typename tuple_t>
+  struct tuple_hash_impl<0, tuple_t> {
+    static void apply(size_t&, const tuple_t&) {
+    }
+  };
+
+  // Hashes a std::tuple by combining std::hash of each of its elements
+  template <typename tuple_t>
+  struct tuple_hash {
+    size_t operator()(const tuple_t& t) const {
+      size_t seed = 0;
+      tuple_hash_impl<std::tuple_size<tuple_t>::value, tuple_t>::apply(seed, t);
+      return seed;
+    }
+  };
+}
@@ -13,6 +13,7 @@
 #include <sstream>
 #include <random>
 #include <limits>
+#include <map>
 
 class RelationalSqldsmlTest : public ::testing::Test {
 protected:
@@ -67,12 +68,16 @@ protected:
     ASSERT_EQ(SQLITE_DONE, create_table.result_code());
   }
 
-  int count_parameter_records() {
-    sqlite::query count_query(db, "SELECT count(*) FROM `" + parameters_table_name + "`");
+  static int count_rows(const sqlite::database::type_ptr& db, const std::string& table_name) {
+    sqlite::query count_query(db, "SELECT count(*) FROM `" + table_name + "`");
     count_query.step();
-    int count_half;
-    count_query.get(0, count_half);
-    return count_half;
+    int count;
+    count_query.get(0, count);
+    return count;
+  }
+
+  int count_parameter_records() {
+    return count_rows(db, parameters_table_name);
   }
 
   void create_feature_table() {
@@ -108,6 +113,7 @@ TEST_F(RelationalSqldsmlTest, ConstructAndCache) {
   ASSERT_EQ(my_int_feature_cache.find_by_parameters(f->parameters()), f);
   auto f_param_copy = my_int_feature_cache.add(my_int_feature(param));
   ASSERT_EQ(f_param_copy, f);
+  ASSERT_EQ(my_int_feature_cache.add(my_int_feature(param_copy)), f);
 
   ASSERT_EQ(my_int_feature_cache.all_entities().size(), 1);
   for (auto &f : my_int_feature_cache) {
@@ -115,6 +121,24 @@ TEST_F(RelationalSqldsmlTest, ConstructAndCache) {
   }
 }
 
+TEST_F(RelationalSqldsmlTest, ParametersStore) {
+  ::sqldsml::parameters_store<my_int_feature::parameters_type> store;
+  auto p = store.intern(my_int_feature::parameters_type(123));
+  ASSERT_EQ(store.intern(my_int_feature::parameters_type(123)), p);
+  ASSERT_EQ(store.intern_handle(my_int_feature::parameters_type(123)), 0);
+  typename my_int_feature::parameters_type_ptr other(new my_int_feature::parameters_type(456));
+  ASSERT_EQ(store.intern(other), other);
+  ASSERT_EQ(store.intern(my_int_feature::parameters_type(456)), other);
+  ASSERT_EQ(store.at(store.intern_handle(my_int_feature::parameters_type(456))), other);
+  ASSERT_EQ(store.find(my_int_feature::parameters_type(789)), nullptr);
+  ASSERT_EQ(store.size(), 2);
+
+  ::sqldsml::relational_feature_cache<my_int_feature> my_int_feature_cache(nullptr, "", "", std::vector<std::string>{""});
+  auto f = my_int_feature_cache.add(my_int_feature(store.intern(my_int_feature::parameters_type(123))));
+  ASSERT_EQ(my_int_feature_cache.find_by_parameters(store.intern(my_int_feature::parameters_type(123))), f);
+  ASSERT_EQ(p.use_count(), 3);
+}
+
 TEST_F(RelationalSqldsmlTest, SaveLoadParameterIds) {
   // Instances of parameters to be converted to distinct features
   const size_t max_distinct_params = 10000;
@@ -189,6 +213,188 @@ TEST_F(RelationalSqldsmlTest, SaveAndLoadFeatureIds) {
   }
 }
 
+TEST_F(RelationalSqldsmlTest, InsertParameterAndFeatureIds) {
+  create_parameters_table();
+  create_feature_table();
+  std::vector<std::string> param_fields{"param"};
+  sqldsml::relational_feature_cache<my_int_feature> my_int_feature_cache(db, feature_table_name, parameters_table_name, param_fields);
+  for (int i = 0; i < 1000; ++i) {
+    my_int_feature_cache.add(my_int_feature(my_int_feature::parameters_type_ptr(new my_int_feature::parameters_type(i))));
+  }
+  ASSERT_EQ(my_int_feature_cache.insert_parameter_ids(), 1000);
+  ASSERT_EQ(count_parameter_records(), 1000);
+  ASSERT_EQ(my_int_feature_cache.insert_ids(), 1000);
+
+  my_int_feature::id_type null_id;
+  my_int_feature::parameters_id_type null_parameters_id;
+  for (auto &f : my_int_feature_cache.all_entities()) {
+    ASSERT_NE(f->parameters_id(), null_parameters_id);
+    ASSERT_NE(f->id(), null_id);
+    ASSERT_EQ(my_int_feature_cache.find_by_parameters_id(f->parameters_id()), f);
+  }
+}
+
+TEST_F(RelationalSqldsmlTest, JoinedResolution) {
+  create_parameters_table();
+  create_feature_table();
+  std::vector<std::string> param_fields{"param"};
+  sqldsml::parameters_store<my_int_feature::parameters_type> store;
+  std::map<int64_t, my_int_feature::id_type> ids;
+  {
+    sqldsml::relational_feature_cache<my_int_feature> cache(db, feature_table_name, parameters_table_name, param_fields);
+    for (int i = 0; i < 100; ++i) {
+      cache.add(my_int_feature(store.intern(my_int_feature::parameters_type(i))));
+    }
+    cache.sync();
+    for (auto &f : cache.all_entities()) {
+      ids[std::get<0>(*(f->parameters()))] = f->id();
+    }
+  }
+  // Parameters row without a feature row
+  sqldsml::execute(db, "INSERT INTO `" + parameters_table_name + "` (`param`) VALUES (1000)");
+
+  sqldsml::relational_feature_cache<my_int_feature> cache(db, feature_table_name, parameters_table_name, param_fields);
+  cache.set_joined_resolution(true);
+  // The first load goes through the temporary table, the second in batches
+  cache.set_load_join_threshold(10);
+  for (int i = 50; i < 150; ++i) {
+    cache.add(my_int_feature(store.intern(my_int_feature::parameters_type(i))));
+  }
+  cache.add(my_int_feature(store.intern(my_int_feature::parameters_type(1000))));
+  ASSERT_EQ(cache.load_all_ids(), 51);
+  ASSERT_EQ(cache.pending_size(), 51);
+  // 50 parameters rows and 51 feature rows
+  ASSERT_EQ(cache.insert_all_ids(), 101);
+  ASSERT_EQ(cache.pending_size(), 0);
+  ASSERT_EQ(count_parameter_records(), 151);
+
+  my_int_feature::id_type null_id;
+  for (auto &f : cache.all_entities()) {
+    ASSERT_NE(f->id(), null_id);
+    ASSERT_EQ(cache.find_by_parameters_id(f->parameters_id()), f);
+    const int64_t param = std::get<0>(*(f->parameters()));
+    if (param < 100) {
+      ASSERT_EQ(f->id(), ids[param]);
+    }
+  }
+
+  for (int i = 150; i < 160; ++i) {
+    cache.add(my_int_feature(store.intern(my_int_feature::parameters_type(i))));
+  }
+  cache.sync();
+  ASSERT_EQ(cache.pending_size(), 0);
+  ASSERT_EQ(count_rows(db, feature_table_name), 161);
+}
+
+TEST_F(RelationalSqldsmlTest, Preload) {
+  create_parameters_table();
+  create_feature_table();
+  std::vector<std::string> param_fields{"param"};
+  std::map<int64_t, my_int_feature::id_type> ids;
+  {
+    sqldsml::relational_feature_cache<my_int_feature> cache(db, feature_table_name, parameters_table_name, param_fields);
+    for (int i = 0; i < 100; ++i) {
+      cache.add(my_int_feature(my_int_feature::parameters_type_ptr(new my_int_feature::parameters_type(i))));
+    }
+    cache.sync();
+    for (auto &f : cache.all_entities()) {
+      ids[std::get<0>(*(f->parameters()))] = f->id();
+    }
+  }
+  // Parameters row without a feature row, not preloaded
+  sqldsml::execute(db, "INSERT INTO `" + parameters_table_name + "` (`param`) VALUES (1000)");
+  // The scan names the key columns by table, the feature table may have the same columns
+  sqldsml::execute(db, "ALTER TABLE `" + feature_table_name + "` ADD COLUMN `param` INTEGER");
+
+  sqldsml::relational_feature_cache<my_int_feature> cache(db, feature_table_name, parameters_table_name, param_fields);
+  cache.set_joined_resolution(true);
+  ASSERT_EQ(cache.preload(), 100);
+  ASSERT_TRUE(cache.preloaded());
+  ASSERT_EQ(cache.size(), 100);
+  for (auto &f : cache.all_entities()) {
+    ASSERT_EQ(f->id(), ids[std::get<0>(*(f->parameters()))]);
+    ASSERT_EQ(cache.find_by_parameters_id(f->parameters_id()), f);
+  }
+
+  for (int i = 95; i < 105; ++i) {
+    cache.add(my_int_feature(my_int_feature::parameters_type_ptr(new my_int_feature::parameters_type(i))));
+  }
+  cache.add(my_int_feature(my_int_feature::parameters_type_ptr(new my_int_feature::parameters_type(1000))));
+  ASSERT_EQ(cache.pending_size(), 6);
+  cache.sync();
+  ASSERT_EQ(cache.pending_size(), 0);
+  ASSERT_EQ(count_parameter_records(), 106);
+  ASSERT_EQ(count_rows(db, feature_table_name), 106);
+}
+
+TEST_F(RelationalSqldsmlTest, Schema) {
+  create_parameters_table();
+  create_feature_table();
+  std::vector<std::string> param_fields{"param"};
+  ASSERT_FALSE(sqldsml::check_relational_entity_schema(db, feature_table_name, parameters_table_name, param_fields));
+
+  sqldsml::execute(db, "DROP TABLE `" + parameters_table_name + "`");
+  sqldsml::execute(db, "DROP TABLE `" + feature_table_name + "`");
+  ASSERT_TRUE(sqldsml::create_schema(db, sqldsml::relational_entity_schema<my_int_feature>(feature_table_name,
+                                                                                          parameters_table_name,
+                                                                                          param_fields)));
+  ASSERT_TRUE(sqldsml::check_relational_entity_schema(db, feature_table_name, parameters_table_name, param_fields));
+
+  sqldsml::relational_feature_cache<my_int_feature> cache(db, feature_table_name, parameters_table_name, param_fields);
+  for (int i = 0; i < 100; ++i) {
+    cache.add(my_int_feature(my_int_feature::parameters_type_ptr(new my_int_feature::parameters_type(i))));
+  }
+  cache.sync();
+  ASSERT_EQ(cache.pending_size(), 0);
+  ASSERT_EQ(count_parameter_records(), 100);
+}
+
+TEST_F(RelationalSqldsmlTest, AllocatedIdsConflicts) {
+  std::vector<std::string> param_fields{"param"};
+  sqldsml::execute(db, "DROP TABLE IF EXISTS `" + parameters_table_name + "`");
+  sqldsml::execute(db, "DROP TABLE IF EXISTS `" + feature_table_name + "`");
+  sqldsml::execute(db, "DROP TABLE IF EXISTS `sqldsml_sequence`");
+  ASSERT_TRUE(sqldsml::create_schema(db, sqldsml::relational_entity_schema<my_int_feature>(feature_table_name,
+                                                                                          parameters_table_name,
+                                                                                          param_fields)));
+
+  // Feature 7 is written by a cache without allocators before the allocated rows
+  sqldsml::relational_feature_cache<my_int_feature> allocated_cache(db, feature_table_name, parameters_table_name, param_fields);
+  allocated_cache.set_id_allocators(std::make_shared<sqldsml::sequence_id_allocator>(db, parameters_table_name, "id", 100),
+                                    std::make_shared<sqldsml::sequence_id_allocator>(db, feature_table_name, "id", 100));
+  auto allocated = allocated_cache.add(my_int_feature(my_int_feature::parameters_type_ptr(new my_int_feature::parameters_type(7))));
+  allocated_cache.add(my_int_feature(my_int_feature::parameters_type_ptr(new my_int_feature::parameters_type(8))));
+  sqldsml::relational_feature_cache<my_int_feature> plain_cache(db, feature_table_name, parameters_table_name, param_fields);
+  auto plain = plain_cache.add(my_int_feature(my_int_feature::parameters_type_ptr(new my_int_feature::parameters_type(7))));
+  ASSERT_TRUE(plain_cache.sync());
+  ASSERT_TRUE(allocated_cache.sync());
+  ASSERT_EQ(allocated->parameters_id(), plain->parameters_id());
+  ASSERT_EQ(allocated->id(), plain->id());
+
+  // Features evicted from a bounded cache resolve to their rows when added again
+  allocated_cache.set_capacity(10);
+  std::map<int64_t, my_int_feature::id_type> ids;
+  for (int i = 100; i < 150; ++i) {
+    allocated_cache.add(my_int_feature(my_int_feature::parameters_type_ptr(new my_int_feature::parameters_type(i))));
+    if ((i + 1) % 10 == 0) {
+      ASSERT_TRUE(allocated_cache.sync());
+      for (auto &f : allocated_cache.all_entities()) {
+        if (f != nullptr) ids[std::get<0>(*(f->parameters()))] = f->id();
+      }
+    }
+  }
+  for (int i = 100; i < 150; ++i) {
+    allocated_cache.add(my_int_feature(my_int_feature::parameters_type_ptr(new my_int_feature::parameters_type(i))));
+  }
+  ASSERT_TRUE(allocated_cache.sync());
+  for (auto &f : allocated_cache.all_entities()) {
+    if ((f != nullptr) && (std::get<0>(*(f->parameters())) >= 100)) {
+      ASSERT_EQ(f->id(), ids[std::get<0>(*(f->parameters()))]);
+    }
+  }
+  ASSERT_EQ(count_parameter_records(), 52);
+}
+
 TEST_F(RelationalSqldsmlTest, CreateSamplesAndLinks) {
   const size_t max_samples = 3000;
   const size_t max_features = 3000;
@@ -222,6 +428,7 @@ TEST_F(RelationalSqldsmlTest, CreateSamplesAndLinks) {
   create_sample_table();
   
   std::vector<std::string> param_fields{"param"};
+  sqldsml::parameters_store<std::tuple<int64_t>> feature_parameters;
   sqldsml::relational_feature_cache<my_int_feature> feature_cache(db, feature_table_name, parameters_table_name, param_fields);
   sqldsml::relational_sample_cache<my_int_sample> sample_cache(db, sample_table_name, sample_int_to_id_table_name, param_fields);
 
@@ -251,8 +458,7 @@ TEST_F(RelationalSqldsmlTest, CreateSamplesAndLinks) {
     auto s = sample_cache.add(my_int_sample(k_param));
     for (int i = 0; i < max_features; ++i) {
       if (raw_dataset[k][i] != 0) {
-        std::shared_ptr<std::tuple<int64_t>> i_param(new std::tuple<int64_t>(i));
-        auto f = feature_cache.add(my_int_feature(i_param));
+        auto f = feature_cache.add(my_int_feature(feature_parameters.intern(std::tuple<int64_t>(i))));
       }
     }
 
@@ -0,0 +1,441 @@
+#include <benchmark/benchmark.h>
+
+#include <sqldsml>
+
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// Counts heap allocations made while a benchmark is timing, reported per item. Every
+// replaceable operator new and delete is replaced, so no allocation escapes the count and
+// no block is freed by another allocator than the one it came from.
+static std::atomic<bool> count_allocations(false);
+static std::atomic<size_t> allocations(0);
+
+#if defined(__GNUC__) && !defined(__clang__) && (__GNUC__ >= 11)
+// GCC sees free() on blocks from operator new once the replacements are inlined
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+static void* counted_malloc(const size_t size) noexcept {
+  if (count_allocations.load(std::memory_order_relaxed)) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+  return std::malloc(size == 0 ? 1 : size);
+}
+
+void* operator new(size_t size) {
+  void* p = counted_malloc(size);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+void* operator new[](size_t size) {
+  void* p = counted_malloc(size);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return counted_malloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return counted_malloc(size);
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+  std::free(p);
+}
+
+#if defined(__cpp_sized_deallocation)
+void operator delete(void* p, size_t) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+  std::free(p);
+}
+#endif
+
+#if defined(__cpp_aligned_new)
+static void* counted_aligned_alloc(const size_t size, const std::align_val_t alignment) noexcept {
+  if (count_allocations.load(std::memory_order_relaxed)) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+  // aligned_alloc() wants a size that is a multiple of the alignment
+  const size_t a = static_cast<size_t>(alignment);
+  return std::aligned_alloc(a, size == 0 ? a : (size + a - 1) / a * a);
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+  void* p = counted_aligned_alloc(size, alignment);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+  void* p = counted_aligned_alloc(size, alignment);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+  return counted_aligned_alloc(size, alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+  return counted_aligned_alloc(size, alignment);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+  std::free(p);
+}
+#endif
+
+namespace {
+  class int_feature : public sqldsml::feature<std::tuple<int64_t>> {
+  public:
+    using sqldsml::feature<std::tuple<int64_t>>::feature;
+    typedef int_feature type;
+    typedef std::shared_ptr<type> type_ptr;
+  };
+
+  class pair_feature : public sqldsml::feature<std::tuple<int64_t, int64_t>> {
+  public:
+    using sqldsml::feature<std::tuple<int64_t, int64_t>>::feature;
+    typedef pair_feature type;
+    typedef std::shared_ptr<type> type_ptr;
+  };
+
+  class string_feature : public sqldsml::feature<std::tuple<std::string>> {
+  public:
+    using sqldsml::feature<std::tuple<std::string>>::feature;
+    typedef string_feature type;
+    typedef std::shared_ptr<type> type_ptr;
+  };
+
+  class int_sample : public sqldsml::sample<std::tuple<int64_t>, std::tuple<int64_t>> {
+  public:
+    using sqldsml::sample<std::tuple<int64_t>, std::tuple<int64_t>>::sample;
+    typedef int_sample type;
+    typedef std::shared_ptr<type> type_ptr;
+  };
+
+  class real_value : public sqldsml::value<int_sample, int_feature, std::tuple<double>> {
+  public:
+    using sqldsml::value<int_sample, int_feature, std::tuple<double>>::value;
+    typedef real_value type;
+    typedef std::shared_ptr<type> type_ptr;
+  };
+
+  // Table layout and generated parameters of each benchmarked tuple shape
+  template <typename feature_t>
+  struct shape;
+
+  template <>
+  struct shape<int_feature> {
+    static std::vector<std::string> fields() { return {"i"}; }
+    static std::string columns() { return "`i` INTEGER NOT NULL"; }
+    static int_feature make(const int64_t k) { return int_feature(std::tuple<int64_t>(k)); }
+  };
+
+  template <>
+  struct shape<pair_feature> {
+    static std::vector<std::string> fields() { return {"i", "j"}; }
+    static std::string columns() { return "`i` INTEGER NOT NULL, `j` INTEGER NOT NULL"; }
+    static pair_feature make(const int64_t k) { return pair_feature(std::tuple<int64_t, int64_t>(k >> 10, k & 1023)); }
+  };
+
+  template <>
+  struct shape<string_feature> {
+    static std::vector<std::string> fields() { return {"s"}; }
+    static std::string columns() { return "`s` TEXT NOT NULL"; }
+    static string_feature make(const int64_t k) { return string_feature(std::tuple<std::string>("feature_" + std::to_string(k))); }
+  };
+
+  const std::vector<std::string> id_fields{"id"};
+
+  sqlite::database::type_ptr memory_db() {
+    return sqlite::database::type_ptr(new sqlite::database(":memory:"));
+  }
+
+  void create_table(const sqlite::database::type_ptr& db, const std::string& name, const std::string& columns) {
+    sqldsml::execute(db, "DROP TABLE IF EXISTS `" + name + "`");
+    sqldsml::execute(db, "CREATE TABLE `" + name + "` (`id` INTEGER PRIMARY KEY AUTOINCREMENT, " + columns + ")");
+  }
+
+  template <typename feature_t>
+  std::vector<feature_t> make_features(const int64_t n) {
+    std::vector<feature_t> features;
+    features.reserve(n);
+    for (int64_t k = 0; k < n; ++k) {
+      features.push_back(shape<feature_t>::make(k));
+    }
+    return features;
+  }
+
+  // Counts allocations between resume() and pause(), which should bracket the timed code
+  class allocation_counter {
+  public:
+    allocation_counter() {
+      allocations.store(0);
+    }
+
+    void resume() {
+      count_allocations.store(true);
+    }
+
+    void pause() {
+      count_allocations.store(false);
+    }
+
+    void report(benchmark::State& state, const int64_t items_per_iteration) {
+      pause();
+      const int64_t items = state.iterations() * items_per_iteration;
+      state.SetItemsProcessed(items);
+      state.counters["allocs_per_item"] = double(allocations.load()) / double(items);
+    }
+  };
+}
+
+// Adds n new entities to an empty cache
+template <typename feature_t>
+static void BM_add_miss(benchmark::State& state) {
+  typedef sqldsml::feature_cache<feature_t> cache_type;
+  const int64_t n = state.range(0);
+  const std::vector<feature_t> features = make_features<feature_t>(n);
+  allocation_counter counter;
+  std::unique_ptr<cache_type> cache;
+  for (auto _ : state) {
+    state.PauseTiming();
+    cache.reset(new cache_type(nullptr, "", id_fields, shape<feature_t>::fields()));
+    counter.resume();
+    state.ResumeTiming();
+    for (auto &f : features) {
+      benchmark::DoNotOptimize(cache->add_slot(f));
+    }
+    state.PauseTiming();
+    counter.pause();
+    cache.reset();
+    state.ResumeTiming();
+  }
+  counter.report(state, n);
+}
+
+// Adds entities already in a cache of n entities
+template <typename feature_t>
+static void BM_add_hit(benchmark::State& state) {
+  const int64_t n = state.range(0);
+  const std::vector<feature_t> features = make_features<feature_t>(n);
+  sqldsml::feature_cache<feature_t> cache(nullptr, "", id_fields, shape<feature_t>::fields());
+  for (auto &f : features) {
+    cache.add_slot(f);
+  }
+  allocation_counter counter;
+  counter.resume();
+  for (auto _ : state) {
+    for (auto &f : features) {
+      benchmark::DoNotOptimize(cache.add_slot(f));
+    }
+  }
+  counter.report(state, n);
+}
+
+template <typename feature_t>
+static void BM_find_by_parameters(benchmark::State& state) {
+  const int64_t n = state.range(0);
+  const std::vector<feature_t> features = make_features<feature_t>(n);
+  sqldsml::feature_cache<feature_t> cache(nullptr, "", id_fields, shape<feature_t>::fields());
+  for (auto &f : features) {
+    cache.add_slot(f);
+  }
+  allocation_counter counter;
+  counter.resume();
+  for (auto _ : state) {
+    for (auto &f : features) {
+      benchmark::DoNotOptimize(cache.find_by_parameters(f.parameters()));
+    }
+  }
+  counter.report(state, n);
+}
+
+// Resolves ids of n entities that all exist in the table
+template <typename feature_t>
+static void BM_load_ids(benchmark::State& state) {
+  const int64_t n = state.range(0);
+  const std::vector<feature_t> features = make_features<feature_t>(n);
+  auto db = memory_db();
+  create_table(db, "features", shape<feature_t>::columns());
+  sqldsml::feature_cache<feature_t> cache(db, "features", id_fields, shape<feature_t>::fields());
+  for (auto &f : features) {
+    cache.add_slot(f);
+  }
+  cache.create_ids();
+  allocation_counter counter;
+  for (auto _ : state) {
+    state.PauseTiming();
+    cache.clear();
+    for (auto &f : features) {
+      cache.add_slot(f);
+    }
+    counter.resume();
+    state.ResumeTiming();
+    benchmark::DoNotOptimize(cache.load_ids());
+    state.PauseTiming();
+    counter.pause();
+    state.ResumeTiming();
+  }
+  counter.report(state, n);
+}
+
+// Writes n new entities to an empty table
+template <typename feature_t>
+static void BM_create_ids(benchmark::State& state) {
+  const int64_t n = state.range(0);
+  const std::vector<feature_t> features = make_features<feature_t>(n);
+  auto db = memory_db();
+  sqldsml::feature_cache<feature_t> cache(db, "features", id_fields, shape<feature_t>::fields());
+  allocation_counter counter;
+  for (auto _ : state) {
+    state.PauseTiming();
+    create_table(db, "features", shape<feature_t>::columns());
+    cache.clear();
+    for (auto &f : features) {
+      cache.add_slot(f);
+    }
+    counter.resume();
+    state.ResumeTiming();
+    cache.create_ids();
+    state.PauseTiming();
+    counter.pause();
+    state.ResumeTiming();
+  }
+  counter.report(state, n);
+}
+
+// Writes n links between n / 100 samples and 100 features with resolved ids
+static void BM_create_links(benchmark::State& state) {
+  const int64_t n = state.range(0);
+  const std::vector<std::string> value_id_fields{"sample_id", "feature_id"};
+  const std::vector<std::string> value_fields{"value"};
+  auto db = memory_db();
+  create_table(db, "features", shape<int_feature>::columns());
+  create_table(db, "samples", "`natural_id` INTEGER NOT NULL");
+  sqldsml::feature_cache<int_feature> feature_cache(db, "features", id_fields, shape<int_feature>::fields());
+  sqldsml::sample_cache<int_sample> sample_cache(db, "samples", id_fields, std::vector<std::string>{"natural_id"});
+  std::vector<int_feature::type_ptr> features;
+  for (int64_t i = 0; i < 100; ++i) {
+    features.push_back(feature_cache.add(int_feature(std::tuple<int64_t>(i))));
+  }
+  std::vector<int_sample::type_ptr> samples;
+  for (int64_t k = 0; k < n / 100; ++k) {
+    samples.push_back(sample_cache.add(int_sample(std::tuple<int64_t>(k))));
+  }
+  feature_cache.sync();
+  sample_cache.sync();
+  sqldsml::value_cache<real_value> value_cache(db, "values", value_id_fields, value_fields);
+  allocation_counter counter;
+  for (auto _ : state) {
+    state.PauseTiming();
+    sqldsml::execute(db, "DROP TABLE IF EXISTS `values`");
+    sqldsml::create_schema(db, sqldsml::link_schema<real_value>("values", value_id_fields, value_fields));
+    value_cache.clear();
+    for (auto &s : samples) {
+      for (auto &f : features) {
+        value_cache.add(real_value(s, f, std::tuple<double>(0.5)));
+      }
+    }
+    counter.resume();
+    state.ResumeTiming();
+    value_cache.create_links();
+    state.PauseTiming();
+    counter.pause();
+    state.ResumeTiming();
+  }
+  counter.report(state, n);
+}
+
+template <typename feature_t>
+static void BM_clear(benchmark::State& state) {
+  const int64_t n = state.range(0);
+  const std::vector<feature_t> features = make_features<feature_t>(n);
+  sqldsml::feature_cache<feature_t> cache(nullptr, "", id_fields, shape<feature_t>::fields());
+  allocation_counter counter;
+  for (auto _ : state) {
+    state.PauseTiming();
+    for (auto &f : features) {
+      cache.add_slot(f);
+    }
+    counter.resume();
+    state.ResumeTiming();
+    cache.clear();
+    state.PauseTiming();
+    counter.pause();
+    state.ResumeTiming();
+  }
+  counter.report(state, n);
+}
+
+// In-memory operations run up to 1e7 entities, the ones that go through SQLite up to 1e6
+#define SQLDSML_BENCH_MEMORY(F, T) \
+  BENCHMARK_TEMPLATE(F, T)->RangeMultiplier(10)->Range(1000, 10000000)->Unit(benchmark::kMillisecond)
+#define SQLDSML_BENCH_DB(F, T) \
+  BENCHMARK_TEMPLATE(F, T)->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMillisecond)
+
+SQLDSML_BENCH_MEMORY(BM_add_miss, int_feature);
+SQLDSML_BENCH_MEMORY(BM_add_miss, pair_feature);
+SQLDSML_BENCH_MEMORY(BM_add_miss, string_feature);
+SQLDSML_BENCH_MEMORY(BM_add_hit, int_feature);
+SQLDSML_BENCH_MEMORY(BM_add_hit, pair_feature);
+SQLDSML_BENCH_MEMORY(BM_add_hit, string_feature);
+SQLDSML_BENCH_MEMORY(BM_find_by_parameters, int_feature);
+SQLDSML_BENCH_MEMORY(BM_find_by_parameters, pair_feature);
+SQLDSML_BENCH_MEMORY(BM_find_by_parameters, string_feature);
+SQLDSML_BENCH_MEMORY(BM_clear, int_feature);
+SQLDSML_BENCH_MEMORY(BM_clear, string_feature);
+SQLDSML_BENCH_DB(BM_load_ids, int_feature);
+SQLDSML_BENCH_DB(BM_load_ids, pair_feature);
+SQLDSML_BENCH_DB(BM_load_ids, string_feature);
+SQLDSML_BENCH_DB(BM_create_ids, int_feature);
+SQLDSML_BENCH_DB(BM_create_ids, pair_feature);
+SQLDSML_BENCH_DB(BM_create_ids, string_feature);
+BENCHMARK(BM_create_links)->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,281 @@
+// End-to-end ingestion benchmark: generates a sparse random dataset, writes it through
+// feature, sample and value caches and prints throughput, peak RSS and database size as
+// JSON. Run with --help for the parameters.
+
+#include <sqldsml>
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+
+namespace {
+  class int_feature : public sqldsml::feature<std::tuple<int64_t>> {
+  public:
+    using sqldsml::feature<std::tuple<int64_t>>::feature;
+    typedef int_feature type;
+    typedef std::shared_ptr<type> type_ptr;
+  };
+
+  class int_sample : public sqldsml::sample<std::tuple<int64_t>, std::tuple<int64_t>> {
+  public:
+    using sqldsml::sample<std::tuple<int64_t>, std::tuple<int64_t>>::sample;
+    typedef int_sample type;
+    typedef std::shared_ptr<type> type_ptr;
+  };
+
+  class real_value : public sqldsml::value<int_sample, int_feature, std::tuple<double>> {
+  public:
+    using sqldsml::value<int_sample, int_feature, std::tuple<double>>::value;
+    typedef real_value type;
+    typedef std::shared_ptr<type> type_ptr;
+  };
+
+  struct config {
+    config() :
+      db("sqldsml_ingest.db"),
+      samples(100000),
+      features(100000),
+      min_on(20),
+      max_on(50),
+      distribution("uniform"),
+      zipf_s(1.0),
+      flush_every(600),
+      feature_capacity(0),
+      allocate_ids(false),
+      per_element(false),
+      profile("none"),
+      seed(1) {
+    }
+
+    std::string db;
+    int64_t samples;
+    int64_t features;
+    int min_on;
+    int max_on;
+    std::string distribution;
+    double zipf_s;
+    int64_t flush_every;
+    size_t feature_capacity;
+    bool allocate_ids;
+    bool per_element;
+    std::string profile;
+    unsigned seed;
+  };
+
+  void usage() {
+    std::cerr << "Usage: sqldsml_ingest [options]\n"
+      "  --db PATH               database file, removed first (:memory: for in-memory)\n"
+      "  --samples N             number of samples\n"
+      "  --features N            size of the feature space\n"
+      "  --min-on N --max-on N   non-zero features per sample, uniform in the range\n"
+      "  --distribution D        uniform or zipf, how features are picked\n"
+      "  --zipf-s S              exponent of the Zipf distribution\n"
+      "  --flush-every N         samples between syncs\n"
+      "  --feature-capacity N    bound the feature cache (0 is unbounded)\n"
+      "  --allocate-ids          take feature and sample ids from sequence allocators\n"
+      "  --per-element           add features and values one at a time instead of per sample\n"
+      "  --profile P             none, bulk or steady connection profile\n"
+      "  --seed N                random seed\n";
+  }
+
+  bool parse(int argc, char** argv, config& c) {
+    for (int i = 1; i < argc; ++i) {
+      const std::string a(argv[i]);
+      const bool has_value = i + 1 < argc;
+      if (a == "--allocate-ids") {
+        c.allocate_ids = true;
+      } else if (a == "--per-element") {
+        c.per_element = true;
+      } else if (!has_value) {
+        return false;
+      } else if (a == "--db") {
+        c.db = argv[++i];
+      } else if (a == "--samples") {
+        c.samples = std::atoll(argv[++i]);
+      } else if (a == "--features") {
+        c.features = std::atoll(argv[++i]);
+      } else if (a == "--min-on") {
+        c.min_on = std::atoi(argv[++i]);
+      } else if (a == "--max-on") {
+        c.max_on = std::atoi(argv[++i]);
+      } else if (a == "--distribution") {
+        c.distribution = argv[++i];
+      } else if (a == "--zipf-s") {
+        c.zipf_s = std::atof(argv[++i]);
+      } else if (a == "--flush-every") {
+        c.flush_every = std::atoll(argv[++i]);
+      } else if (a == "--feature-capacity") {
+        c.feature_capacity = std::strtoull(argv[++i], nullptr, 10);
+      } else if (a == "--profile") {
+        c.profile = argv[++i];
+      } else if (a == "--seed") {
+        c.seed = static_cast<unsigned>(std::atoi(argv[++i]));
+      } else {
+        return false;
+      }
+    }
+    return (c.samples > 0) && (c.features > 0) && (c.min_on > 0) && (c.max_on >= c.min_on) &&
+      (c.flush_every > 0) && ((c.distribution == "uniform") || (c.distribution == "zipf")) &&
+      ((c.profile == "none") || (c.profile == "bulk") || (c.profile == "steady"));
+  }
+
+  // Picks feature indexes uniformly or with Zipf weights 1 / (rank + 1)^s
+  class feature_picker {
+  public:
+    feature_picker(const config& c) :
+      zipf_(c.distribution == "zipf"),
+      uniform_(0, c.features - 1) {
+      if (zipf_) {
+        std::vector<double> weights(c.features);
+        for (int64_t k = 0; k < c.features; ++k) {
+          weights[k] = 1.0 / std::pow(double(k + 1), c.zipf_s);
+        }
+        zipf_distribution_ = std::discrete_distribution<int64_t>(weights.begin(), weights.end());
+      }
+    }
+
+    template <typename engine_t>
+    int64_t operator()(engine_t& re) {
+      return zipf_ ? zipf_distribution_(re) : uniform_(re);
+    }
+
+  private:
+    bool zipf_;
+    std::uniform_int_distribution<int64_t> uniform_;
+    std::discrete_distribution<int64_t> zipf_distribution_;
+  };
+
+  int64_t query_int(const sqlite::database::type_ptr& db, const std::string& sql) {
+    sqlite::query q(db, sql);
+    q.step();
+    int64_t v = 0;
+    q.get(0, v);
+    return v;
+  }
+
+  long peak_rss_kb() {
+#if !defined(_WIN32)
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+#else
+    return -1;
+#endif
+  }
+}
+
+int main(int argc, char** argv) {
+  config c;
+  if (!parse(argc, argv, c)) {
+    usage();
+    return 1;
+  }
+  if (c.db != ":memory:") {
+    std::remove(c.db.c_str());
+    std::remove((c.db + "-wal").c_str());
+    std::remove((c.db + "-shm").c_str());
+  }
+
+  auto db = sqlite::database::type_ptr(new sqlite::database(c.db));
+  const std::vector<std::string> id_fields{"id"};
+  const std::vector<std::string> feature_fields{"feature_index"};
+  const std::vector<std::string> sample_fields{"sample_natural_id"};
+  const std::vector<std::string> value_id_fields{"sample_id", "feature_id"};
+  const std::vector<std::string> value_fields{"value"};
+  if (!sqldsml::create_schema(db, sqldsml::entity_schema<int_feature>("features", id_fields, feature_fields)) ||
+      !sqldsml::create_schema(db, sqldsml::entity_schema<int_sample>("samples", id_fields, sample_fields)) ||
+      !sqldsml::create_schema(db, sqldsml::link_schema<real_value>("values", value_id_fields, value_fields))) {
+    std::cerr << "Could not create the schema\n";
+    return 1;
+  }
+
+  sqldsml::feature_cache<int_feature> feature_cache(db, "features", id_fields, feature_fields);
+  sqldsml::sample_cache<int_sample> sample_cache(db, "samples", id_fields, sample_fields);
+  sqldsml::value_cache<real_value> value_cache(db, "values", value_id_fields, value_fields);
+  feature_cache.set_capacity(c.feature_capacity);
+  if (c.allocate_ids) {
+    feature_cache.set_id_allocator(std::make_shared<sqldsml::sequence_id_allocator>(db, "features"));
+    sample_cache.set_id_allocator(std::make_shared<sqldsml::sequence_id_allocator>(db, "samples"));
+  }
+  sqldsml::sync_coordinator coordinator(db);
+  if (c.profile == "bulk") {
+    coordinator.set_profile(sqldsml::connection_profile::bulk_load());
+  } else if (c.profile == "steady") {
+    coordinator.set_profile(sqldsml::connection_profile::steady_state());
+  }
+  coordinator.add_entity_cache(feature_cache);
+  coordinator.add_entity_cache(sample_cache);
+  coordinator.add_link_cache(value_cache);
+
+  std::default_random_engine re(c.seed);
+  std::uniform_int_distribution<int> features_on(c.min_on, c.max_on);
+  std::uniform_real_distribution<double> uniform_real(0, 1);
+  feature_picker pick_feature(c);
+
+  // Dataset generation is part of the measured loop, as parsing is in a real ingest
+  typedef std::pair<std::tuple<int64_t>, std::tuple<double>> element_type;
+  std::vector<element_type> elements;
+  int64_t n_values = 0;
+  bool ok = true;
+  const auto start = std::chrono::steady_clock::now();
+  for (int64_t k = 0; k < c.samples; ++k) {
+    auto s = sample_cache.add(int_sample(std::tuple<int64_t>(k)));
+    const int n_on = features_on(re);
+    elements.clear();
+    for (int i = 0; i < n_on; ++i) {
+      elements.push_back(element_type(std::tuple<int64_t>(pick_feature(re)), std::tuple<double>(uniform_real(re))));
+    }
+    if (c.per_element) {
+      for (auto &e : elements) {
+        auto f = feature_cache.add(int_feature(e.first));
+        if (value_cache.find_by_entities(s, f) == nullptr) {
+          value_cache.add(real_value(s, f, e.second));
+          ++n_values;
+        }
+      }
+    } else {
+      n_values += sqldsml::add_sample_values(feature_cache, value_cache, s, elements.begin(), elements.end());
+    }
+    if ((k + 1) % c.flush_every == 0) {
+      ok = coordinator.sync() && ok;
+      sample_cache.clear();
+      value_cache.clear();
+    }
+  }
+  ok = coordinator.sync() && ok;
+  const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  const int64_t db_size = query_int(db, "PRAGMA page_count") * query_int(db, "PRAGMA page_size");
+  std::cout << "{\n"
+            << "  \"samples\": " << c.samples << ",\n"
+            << "  \"features\": " << c.features << ",\n"
+            << "  \"min_on\": " << c.min_on << ",\n"
+            << "  \"max_on\": " << c.max_on << ",\n"
+            << "  \"distribution\": \"" << c.distribution << "\",\n"
+            << "  \"zipf_s\": " << c.zipf_s << ",\n"
+            << "  \"flush_every\": " << c.flush_every << ",\n"
+            << "  \"feature_capacity\": " << c.feature_capacity << ",\n"
+            << "  \"allocate_ids\": " << (c.allocate_ids ? "true" : "false") << ",\n"
+            << "  \"per_element\": " << (c.per_element ? "true" : "false") << ",\n"
+            << "  \"profile\": \"" << c.profile << "\",\n"
+            << "  \"values\": " << n_values << ",\n"
+            << "  \"synced\": " << (ok ? "true" : "false") << ",\n"
+            << "  \"seconds\": " << elapsed.count() << ",\n"
+            << "  \"samples_per_second\": " << c.samples / elapsed.count() << ",\n"
+            << "  \"values_per_second\": " << n_values / elapsed.count() << ",\n"
+            << "  \"peak_rss_kb\": " << peak_rss_kb() << ",\n"
+            << "  \"db_size_bytes\": " << db_size << "\n"
+            << "}\n";
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,92 @@
+#include <gtest/gtest.h>
+
+#define SQLITE_HPP_LOG_FILENAME "sqlite_debug.log"
+#define SQLDSML_HPP_LOG_FILENAME "sqldsml_debug.log"
+#define SQLDSML_HPP_STATS
+#define SQLDSML_HPP_TRACE
+#define SQLDSML_HPP_TRACE_MAX_EVENTS 64
+
+#include "sqldsml_test.hpp"
+
+TEST_F(SqldsmlTest, Stats) {
+  create_feature_table();
+  create_sample_table();
+  create_value_table();
+  sqldsml::feature_cache<my_int_feature> feature_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  sqldsml::sample_cache<my_int_sample> sample_cache(db, sample_table_name, sample_id_fields, sample_parameter_fields);
+  sqldsml::value_cache<my_real_value> value_cache(db, value_table_name, value_id_fields, value_parameter_fields);
+  for (int i = 0; i < 100; ++i) {
+    feature_cache.add(my_int_feature(std::tuple<int64_t>(i % 40)));
+  }
+  feature_cache.find_by_parameters(std::tuple<int64_t>(0));
+  feature_cache.find_by_parameters(std::tuple<int64_t>(40));
+  feature_cache.sync();
+  auto s = sample_cache.add(my_int_sample(std::tuple<int64_t>(1)));
+  sample_cache.sync();
+  for (int i = 0; i < 10; ++i) {
+    value_cache.add(my_real_value(s, feature_cache.find_by_parameters(std::tuple<int64_t>(i)), std::tuple<double>(0.5)));
+  }
+  value_cache.sync();
+
+  auto fs = feature_cache.stats();
+  ASSERT_EQ(fs.add_hits, 60);
+  ASSERT_EQ(fs.add_misses, 40);
+  ASSERT_EQ(fs.lookups, 12);
+  ASSERT_EQ(fs.lookup_hits, 11);
+  ASSERT_EQ(fs.rows_requested, 40);
+  ASSERT_EQ(fs.rows_loaded, 0);
+  ASSERT_EQ(fs.rows_inserted, 40);
+  ASSERT_GT(fs.load_seconds + fs.insert_seconds, 0);
+  // Phases add up to the totals, a feature cache has no parameters table
+  ASSERT_NEAR(fs.load_ids_seconds, fs.load_seconds, 1e-9);
+  ASSERT_NEAR(fs.insert_ids_seconds + fs.create_allocated_seconds, fs.insert_seconds, 1e-9);
+  ASSERT_EQ(fs.load_parameter_ids_seconds + fs.insert_parameter_ids_seconds, 0);
+  ASSERT_EQ(value_cache.stats().add_misses, 10);
+  ASSERT_EQ(value_cache.stats().rows_inserted, 10);
+
+  feature_cache.reset_stats();
+  fs = feature_cache.stats();
+  ASSERT_EQ(fs.add_hits + fs.add_misses + fs.lookups + fs.rows_inserted, 0);
+  ASSERT_NE(fs.statements_prepared, 0);
+}
+
+TEST_F(SqldsmlTest, Trace) {
+  create_feature_table();
+  sqldsml::feature_cache<my_int_feature> feature_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  sqldsml::tracer::get_instance().clear();
+  for (int i = 0; i < 100; ++i) {
+    feature_cache.add(my_int_feature(std::tuple<int64_t>(i)));
+  }
+  feature_cache.sync();
+
+  std::stringstream trace;
+  sqldsml::tracer::get_instance().write(trace);
+  const std::string s = trace.str();
+  ASSERT_EQ(s.find("{\"traceEvents\":["), 0);
+  ASSERT_NE(s.find("{\"name\":\"load_ids\",\"cat\":\"" + feature_table_name + "\",\"ph\":\"X\""), std::string::npos);
+  ASSERT_NE(s.find("{\"name\":\"insert_ids\""), std::string::npos);
+  ASSERT_NE(s.find("\"args\":{\"rows\":100}"), std::string::npos);
+  ASSERT_NE(s.find("{\"name\":\"sync\""), std::string::npos);
+}
+
+TEST_F(SqldsmlTest, TraceEscapesAndDrops) {
+  sqldsml::tracer::get_instance().clear();
+  {
+    sqldsml::trace_span span("escaped", "a\"b\\c\nd\te\x01");
+  }
+  std::stringstream trace;
+  sqldsml::tracer::get_instance().write(trace);
+  ASSERT_NE(trace.str().find("\"cat\":\"a\\\"b\\\\c\\nd\\te\\u0001\""), std::string::npos);
+  ASSERT_NE(trace.str().find("\"otherData\":{\"dropped_events\":0}"), std::string::npos);
+
+  // Events beyond SQLDSML_HPP_TRACE_MAX_EVENTS are dropped and counted
+  for (int i = 0; i < 100; ++i) {
+    sqldsml::trace_span span("span", "");
+  }
+  ASSERT_EQ(sqldsml::tracer::get_instance().dropped(), 37);
+  std::stringstream full_trace;
+  sqldsml::tracer::get_instance().write(full_trace);
+  ASSERT_NE(full_trace.str().find("\"otherData\":{\"dropped_events\":37}"), std::string::npos);
+  sqldsml::tracer::get_instance().clear();
+  ASSERT_EQ(sqldsml::tracer::get_instance().dropped(), 0);
+}
@@ -3,96 +3,748 @@
 #define SQLITE_HPP_LOG_FILENAME "sqlite_debug.log"
 #define SQLDSML_HPP_LOG_FILENAME "sqldsml_debug.log"
 
-#include <iostream>
+#include "sqldsml_test.hpp"
 
-#include <sqldsml>
+TEST_F(SqldsmlTest, FindByParameters) {
+  sqldsml::feature_cache<my_int_feature> feature_cache(nullptr, "", feature_id_fields, feature_parameter_fields);
+  for (int i = 0; i < 1000; ++i) {
+    feature_cache.add(my_int_feature(std::tuple<int64_t>(i)));
+  }
+  auto f = feature_cache.add(my_int_feature(std::tuple<int64_t>(500)));
+  ASSERT_EQ(feature_cache.size(), 1000);
+  ASSERT_EQ(feature_cache.find_by_parameters(std::tuple<int64_t>(500)), f);
+  ASSERT_EQ(feature_cache.find_by_parameters(std::tuple<int64_t>(1000)), nullptr);
+  feature_cache.clear();
+  ASSERT_EQ(feature_cache.find_by_parameters(std::tuple<int64_t>(500)), nullptr);
+}
 
-#include <algorithm>
-#include <cmath>
+TEST_F(SqldsmlTest, DirectIndex) {
+  typedef sqldsml::feature_cache<my_int_feature>::parameters_index_type index_type;
+  static_assert(std::is_same<index_type, sqldsml::direct_index<std::tuple<int64_t>, uint32_t>>::value,
+                "single integer parameters use direct_index");
+  index_type index;
+  const std::vector<int64_t> keys{0, 1, 4095, 4096, 100000, -1, int64_t(1) << 40};
+  for (size_t i = 0; i < keys.size(); ++i) {
+    ASSERT_TRUE(index.insert(std::tuple<int64_t>(keys[i]), i).second);
+    ASSERT_FALSE(index.insert(std::tuple<int64_t>(keys[i]), 100).second);
+  }
+  ASSERT_EQ(index.size(), keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    ASSERT_EQ(*index.find(std::tuple<int64_t>(keys[i])), i);
+  }
+  ASSERT_EQ(index.find(std::tuple<int64_t>(2)), nullptr);
+  ASSERT_EQ(index.find(std::tuple<int64_t>(-2)), nullptr);
+  ASSERT_EQ(index.find(std::tuple<int64_t>(int64_t(1) << 20)), nullptr);
+  ASSERT_TRUE(index.erase(std::tuple<int64_t>(4096)));
+  ASSERT_TRUE(index.erase(std::tuple<int64_t>(-1)));
+  ASSERT_EQ(index.find(std::tuple<int64_t>(4096)), nullptr);
+  ASSERT_EQ(index.find(std::tuple<int64_t>(-1)), nullptr);
+  ASSERT_EQ(index.size(), keys.size() - 2);
+}
 
-#include <sstream>
-#include <random>
-#include <limits>
+TEST_F(SqldsmlTest, ArenaStorage) {
+  typedef sqldsml::arena_entity_storage<my_int_feature, 64> storage_type;
+  sqldsml::feature_cache<my_int_feature, storage_type> feature_cache(nullptr, "", feature_id_fields, feature_parameter_fields);
+  for (int i = 0; i < 1000; ++i) {
+    feature_cache.add(my_int_feature(std::tuple<int64_t>(i)));
+  }
+  ASSERT_EQ(feature_cache.size(), 1000);
+  auto f = feature_cache.find_by_parameters(std::tuple<int64_t>(10));
+  ASSERT_EQ(feature_cache.all_entities()[11].get(), f.get() + 1);
+  feature_cache.clear();
+  ASSERT_EQ(feature_cache.size(), 0);
+  ASSERT_EQ(std::get<0>(f->parameters()), 10);
+}
+
+TEST_F(SqldsmlTest, FindLinksByEndpoints) {
+  sqldsml::sample_cache<my_int_sample> sample_cache(nullptr, "", sample_id_fields, sample_parameter_fields);
+  sqldsml::feature_cache<my_int_feature> feature_cache(nullptr, "", feature_id_fields, feature_parameter_fields);
+  sqldsml::value_cache<my_real_value> value_cache(nullptr, "", value_id_fields, value_parameter_fields);
+  auto s1 = sample_cache.add(my_int_sample(std::tuple<int64_t>(1)));
+  auto s2 = sample_cache.add(my_int_sample(std::tuple<int64_t>(2)));
+  auto f1 = feature_cache.add(my_int_feature(std::tuple<int64_t>(1)));
+  auto f2 = feature_cache.add(my_int_feature(std::tuple<int64_t>(2)));
+  auto v11 = value_cache.add(my_real_value(s1, f1, std::tuple<double>(0.5)));
+  auto v12 = value_cache.add(my_real_value(s1, f2, std::tuple<double>(0.5)));
+  auto v21 = value_cache.add(my_real_value(s2, f1, std::tuple<double>(0.25)));
+  ASSERT_NE(v11, v12);
+  ASSERT_EQ(value_cache.add(my_real_value(s1, f1, std::tuple<double>(0.75))), v11);
+  ASSERT_EQ(value_cache.size(), 3);
+  ASSERT_EQ(value_cache.find_by_entities(s2, f1), v21);
+  ASSERT_EQ(value_cache.find_by_entities(s2, f2), nullptr);
+  ASSERT_EQ(value_cache.links_of_entity1(s1).size(), 2);
+  ASSERT_EQ(value_cache.links_of_entity2(f1).size(), 2);
+  ASSERT_EQ(value_cache.links_of_entity2(f2).size(), 1);
+}
+
+TEST_F(SqldsmlTest, LoadLinkIds) {
+  create_feature_table();
+  create_sample_table();
+  create_value_table();
+  sqldsml::sample_cache<my_int_sample> sample_cache(db, sample_table_name, sample_id_fields, sample_parameter_fields);
+  sqldsml::feature_cache<my_int_feature> feature_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  sqldsml::value_cache<my_real_value> value_cache(db, value_table_name, value_id_fields, value_parameter_fields);
+  auto s = sample_cache.add(my_int_sample(std::tuple<int64_t>(1)));
+  for (int i = 0; i < 10; ++i) {
+    // Same value for every link, links are told apart by their endpoints only
+    value_cache.add(my_real_value(s, feature_cache.add(my_int_feature(std::tuple<int64_t>(i))), std::tuple<double>(0.5)));
+  }
+  sample_cache.sync();
+  feature_cache.sync();
+  value_cache.sync();
+  ASSERT_EQ(value_cache.pending_size(), 0);
 
-class SqldsmlTest : public ::testing::Test {
+  sqldsml::value_cache<my_real_value> reloaded_cache(db, value_table_name, value_id_fields, value_parameter_fields);
+  for (int i = 5; i < 15; ++i) {
+    reloaded_cache.add(my_real_value(s, feature_cache.add(my_int_feature(std::tuple<int64_t>(i))), std::tuple<double>(0.5)));
+  }
+  feature_cache.sync();
+  ASSERT_EQ(reloaded_cache.load_ids(), 5);
+  ASSERT_EQ(reloaded_cache.pending_size(), 5);
+  reloaded_cache.sync();
+  ASSERT_EQ(reloaded_cache.pending_size(), 0);
+  ASSERT_EQ(count_rows(db, value_table_name), 15);
 
-protected:
+  // Links already in the table fail to insert at sync and are looked up then
+  sqldsml::value_cache<my_real_value> duplicate_cache(db, value_table_name, value_id_fields, value_parameter_fields);
+  for (int i = 10; i < 20; ++i) {
+    duplicate_cache.add(my_real_value(s, feature_cache.add(my_int_feature(std::tuple<int64_t>(i))), std::tuple<double>(0.5)));
+  }
+  feature_cache.sync();
+  ASSERT_TRUE(duplicate_cache.sync());
+  ASSERT_EQ(duplicate_cache.pending_size(), 0);
+  ASSERT_EQ(count_rows(db, value_table_name), 20);
+}
 
-  class my_int_feature : public
-  ::sqldsml::feature<std::tuple<int64_t>> {
-  public:
-    using ::sqldsml::feature<std::tuple<int64_t>>::feature;
-    typedef my_int_feature type;
-    typedef std::shared_ptr<type> type_ptr;
-  };
+TEST_F(SqldsmlTest, LinksOfEvictedEndpoints) {
+  create_feature_table();
+  create_sample_table();
+  create_value_table();
+  sqldsml::sample_cache<my_int_sample> sample_cache(db, sample_table_name, sample_id_fields, sample_parameter_fields);
+  sqldsml::feature_cache<my_int_feature> feature_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  sqldsml::value_cache<my_real_value> value_cache(db, value_table_name, value_id_fields, value_parameter_fields);
+  feature_cache.set_capacity(10);
+  value_cache.set_capacity(30);
+  auto s = sample_cache.add(my_int_sample(std::tuple<int64_t>(1)));
+  for (int i = 0; i < 20; ++i) {
+    value_cache.add(my_real_value(s, feature_cache.add(my_int_feature(std::tuple<int64_t>(i))), std::tuple<double>(0.5)));
+  }
+  sample_cache.sync();
+  feature_cache.sync();
+  ASSERT_TRUE(value_cache.sync());
+  ASSERT_LE(feature_cache.size(), 10);
+
+  // Evicted features come back as new objects, their links are not written twice
+  for (int i = 0; i < 20; ++i) {
+    value_cache.add(my_real_value(s, feature_cache.add(my_int_feature(std::tuple<int64_t>(i))), std::tuple<double>(0.5)));
+  }
+  feature_cache.sync();
+  ASSERT_TRUE(value_cache.sync());
+  ASSERT_EQ(count_rows(db, value_table_name), 20);
+  ASSERT_LE(value_cache.size(), 30);
+  ASSERT_EQ(value_cache.links_of_entity1(s).size(), value_cache.size());
+
+  // Features with ids resolve to the written links
+  sqldsml::feature_cache<my_int_feature> other_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  auto f = other_cache.add(my_int_feature(std::tuple<int64_t>(19)));
+  other_cache.sync();
+  const size_t n_links = value_cache.size();
+  auto link = value_cache.add(my_real_value(s, f, std::tuple<double>(0.5)));
+  ASSERT_NE(link->entity2(), f);
+  ASSERT_EQ(link->id(), std::make_tuple(std::get<0>(s->id()), std::get<0>(f->id())));
+  ASSERT_EQ(value_cache.size(), n_links);
+  ASSERT_EQ(value_cache.pending_size(), 0);
+}
+
+TEST_F(SqldsmlTest, AddSampleValues) {
+  sqldsml::sample_cache<my_int_sample> sample_cache(nullptr, "", sample_id_fields, sample_parameter_fields);
+  sqldsml::feature_cache<my_int_feature> feature_cache(nullptr, "", feature_id_fields, feature_parameter_fields);
+  sqldsml::value_cache<my_real_value> value_cache(nullptr, "", value_id_fields, value_parameter_fields);
+  auto f2 = feature_cache.add(my_int_feature(std::tuple<int64_t>(2)));
+  auto s = sample_cache.add(my_int_sample(std::tuple<int64_t>(1)));
+  typedef std::pair<std::tuple<int64_t>, std::tuple<double>> element_type;
+  const std::vector<element_type> elements{{std::tuple<int64_t>(1), std::tuple<double>(0.5)},
+                                           {std::tuple<int64_t>(2), std::tuple<double>(0.25)},
+                                           {std::tuple<int64_t>(3), std::tuple<double>(0.75)},
+                                           {std::tuple<int64_t>(1), std::tuple<double>(1)}};
+  ASSERT_EQ(sqldsml::add_sample_values(feature_cache, value_cache, s, elements.begin(), elements.end()), 3);
+  ASSERT_EQ(feature_cache.size(), 3);
+  ASSERT_EQ(feature_cache.pending_size(), 3);
+  ASSERT_EQ(value_cache.size(), 3);
+  ASSERT_EQ(value_cache.pending_size(), 3);
+  ASSERT_EQ(value_cache.links_of_entity1(s).size(), 3);
+  auto f1 = feature_cache.find_by_parameters(std::tuple<int64_t>(1));
+  ASSERT_NE(f1, nullptr);
+  ASSERT_EQ(std::get<0>(value_cache.find_by_entities(s, f1)->parameters()), 0.5);
+  ASSERT_EQ(std::get<0>(value_cache.find_by_entities(s, f2)->parameters()), 0.25);
+  ASSERT_EQ(sqldsml::add_sample_values(feature_cache, value_cache, s, elements.begin(), elements.end()), 0);
+  ASSERT_EQ(feature_cache.size(), 3);
+  ASSERT_EQ(value_cache.size(), 3);
+}
+
+TEST_F(SqldsmlTest, AddByParametersKeepsBatch) {
+  create_feature_table();
+  sqldsml::feature_cache<my_int_feature> feature_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  feature_cache.set_capacity(16);
+  for (int i = 0; i < 16; ++i) {
+    feature_cache.add(my_int_feature(std::tuple<int64_t>(i)));
+  }
+  ASSERT_TRUE(feature_cache.sync());
+
+  // Written features found at the start of the batch are not evicted by its misses
+  std::vector<std::tuple<int64_t>> parameters;
+  for (int i = 0; i < 48; ++i) {
+    parameters.push_back(std::tuple<int64_t>(i));
+  }
+  std::vector<const std::tuple<int64_t>*> keys;
+  for (auto &p : parameters) {
+    keys.push_back(&p);
+  }
+  sqldsml::feature_cache<my_int_feature>::parametric_entity_container_type features;
+  feature_cache.add_by_parameters(keys, features);
+  ASSERT_EQ(features.size(), 48);
+  for (int i = 0; i < 48; ++i) {
+    ASSERT_EQ(feature_cache.find_by_parameters(parameters[i]), features[i]);
+  }
+  ASSERT_TRUE(feature_cache.sync());
+  ASSERT_LE(feature_cache.size(), 16);
+}
+
+TEST_F(SqldsmlTest, CompactLinks) {
+  typedef sqldsml::sample_cache<my_int_sample> my_sample_cache;
+  typedef sqldsml::feature_cache<my_int_feature> my_feature_cache;
+  typedef sqldsml::compact_parametric_link<my_sample_cache, my_feature_cache, std::tuple<double>> my_compact_value;
+
+  create_feature_table();
+  create_sample_table();
+  create_value_table();
+
+  my_sample_cache sample_cache(db, sample_table_name, sample_id_fields, sample_parameter_fields);
+  my_feature_cache feature_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  sqldsml::compact_parametric_link_cache<my_compact_value> value_cache(db, sample_cache, feature_cache,
+                                                                       value_table_name,
+                                                                       value_id_fields,
+                                                                       value_parameter_fields);
+  for (int k = 0; k < 10; ++k) {
+    auto s = sample_cache.add_slot(my_int_sample(std::tuple<int64_t>(k)));
+    for (int i = 0; i < 10; ++i) {
+      auto f = feature_cache.add_slot(my_int_feature(std::tuple<int64_t>(i)));
+      value_cache.add(s, f, std::tuple<double>(0.5));
+    }
+  }
+  value_cache.add(0, 0, std::tuple<double>(1.0));
+  ASSERT_EQ(value_cache.size(), 100);
+  ASSERT_FALSE(value_cache.find_by_slots(0, 0)->resolved());
+
+  feature_cache.create_ids();
+  feature_cache.load_ids();
+  sample_cache.create_ids();
+  sample_cache.load_ids();
+  ASSERT_EQ(value_cache.create_links(), 0);
+  ASSERT_TRUE(value_cache.find_by_slots(0, 0)->resolved());
+
+  // A link already in the table fails to insert, sync() finds it and takes it off pending
+  sqldsml::compact_parametric_link_cache<my_compact_value> duplicate_cache(db, sample_cache, feature_cache,
+                                                                           value_table_name,
+                                                                           value_id_fields,
+                                                                           value_parameter_fields);
+  duplicate_cache.add(0, 0, std::tuple<double>(1.0));
+  duplicate_cache.add(0, 1, std::tuple<double>(1.0));
+  ASSERT_EQ(duplicate_cache.create_links(), 2);
+  ASSERT_EQ(duplicate_cache.pending_size(), 2);
+  ASSERT_TRUE(duplicate_cache.sync());
+  ASSERT_EQ(duplicate_cache.pending_size(), 0);
+
+  ASSERT_EQ(count_rows(db, value_table_name), 100);
+}
+
+TEST_F(SqldsmlTest, InsertIds) {
+  create_feature_table();
+  sqldsml::feature_cache<my_int_feature> feature_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  for (int i = 0; i < 1000; ++i) {
+    feature_cache.add(my_int_feature(std::tuple<int64_t>(i)));
+  }
+  ASSERT_EQ(feature_cache.insert_ids(), 1000);
+  ASSERT_EQ(feature_cache.insert_ids(), 0);
+
+  sqldsml::feature_cache<my_int_feature> reloaded_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  for (auto &f : feature_cache) {
+    reloaded_cache.add(my_int_feature(f->parameters()));
+  }
+  ASSERT_EQ(reloaded_cache.load_ids(), 1000);
+  for (auto &f : feature_cache) {
+    ASSERT_NE(std::get<0>(f->id()), 0);
+    ASSERT_EQ(reloaded_cache.find_by_parameters(f->parameters())->id(), f->id());
+  }
+}
+
+TEST_F(SqldsmlTest, AllocatedIds) {
+  create_feature_table();
+  sqlite::query drop_sequence(db, "DROP TABLE IF EXISTS `sqldsml_sequence`");
+  drop_sequence.step();
+
+  // Two caches with their own allocators emulate two processes sharing the database
+  sqldsml::feature_cache<my_int_feature> cache1(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  sqldsml::feature_cache<my_int_feature> cache2(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  cache1.set_id_allocator(std::make_shared<sqldsml::sequence_id_allocator>(db, feature_table_name, "id", 100));
+  cache2.set_id_allocator(std::make_shared<sqldsml::sequence_id_allocator>(db, feature_table_name, "id", 100));
+  std::set<int64_t> ids;
+  for (int i = 0; i < 250; ++i) {
+    auto f1 = cache1.add(my_int_feature(std::tuple<int64_t>(i)));
+    auto f2 = cache2.add(my_int_feature(std::tuple<int64_t>(1000 + i)));
+    ASSERT_TRUE(ids.insert(std::get<0>(f1->id())).second);
+    ASSERT_TRUE(ids.insert(std::get<0>(f2->id())).second);
+  }
+  cache1.create_ids();
+  cache2.create_ids();
+
+  sqldsml::feature_cache<my_int_feature> reloaded_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  for (auto &f : cache1) {
+    reloaded_cache.add(my_int_feature(f->parameters()));
+  }
+  ASSERT_EQ(reloaded_cache.load_ids(), 250);
+  for (auto &f : cache1) {
+    ASSERT_EQ(reloaded_cache.find_by_parameters(f->parameters())->id(), f->id());
+  }
+}
+
+TEST_F(SqldsmlTest, AllocatedIdsConflicts) {
+  create_feature_table();
+  sqlite::query drop_sequence(db, "DROP TABLE IF EXISTS `sqldsml_sequence`");
+  drop_sequence.step();
+
+  // Feature 7 is written by a cache without allocator before the allocated row
+  sqldsml::feature_cache<my_int_feature> allocated_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  allocated_cache.set_id_allocator(std::make_shared<sqldsml::sequence_id_allocator>(db, feature_table_name, "id", 100));
+  auto allocated = allocated_cache.add(my_int_feature(std::tuple<int64_t>(7)));
+  allocated_cache.add(my_int_feature(std::tuple<int64_t>(8)));
+  sqldsml::feature_cache<my_int_feature> plain_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  auto plain = plain_cache.add(my_int_feature(std::tuple<int64_t>(7)));
+  ASSERT_TRUE(plain_cache.sync());
+  ASSERT_TRUE(allocated_cache.sync());
+  ASSERT_EQ(allocated->id(), plain->id());
+  ASSERT_EQ(allocated_cache.pending_size(), 0);
+
+  // Features evicted from a bounded cache resolve to their rows when added again
+  allocated_cache.set_capacity(10);
+  std::map<int64_t, std::tuple<int64_t>> ids;
+  for (int i = 100; i < 150; ++i) {
+    allocated_cache.add(my_int_feature(std::tuple<int64_t>(i)));
+    if ((i + 1) % 10 == 0) {
+      ASSERT_TRUE(allocated_cache.sync());
+      for (auto &f : allocated_cache) {
+        if (f != nullptr) ids[std::get<0>(f->parameters())] = f->id();
+      }
+    }
+  }
+  for (int i = 100; i < 150; ++i) {
+    allocated_cache.add(my_int_feature(std::tuple<int64_t>(i)));
+  }
+  ASSERT_TRUE(allocated_cache.sync());
+  for (auto &f : allocated_cache) {
+    if ((f != nullptr) && (std::get<0>(f->parameters()) >= 100)) {
+      ASSERT_EQ(f->id(), ids[std::get<0>(f->parameters())]);
+    }
+  }
+  ASSERT_EQ(count_rows(db, feature_table_name), 52);
+}
+
+TEST_F(SqldsmlTest, Preload) {
+  create_feature_table();
+  sqldsml::feature_cache<my_int_feature> feature_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  for (int i = 0; i < 1000; ++i) {
+    feature_cache.add(my_int_feature(std::tuple<int64_t>(i)));
+  }
+  feature_cache.sync();
+
+  sqldsml::feature_cache<my_int_feature> preloaded_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  auto pending = preloaded_cache.add(my_int_feature(std::tuple<int64_t>(5)));
+  ASSERT_EQ(preloaded_cache.preload(), 1000);
+  ASSERT_TRUE(preloaded_cache.preloaded());
+  ASSERT_EQ(preloaded_cache.size(), 1000);
+  ASSERT_EQ(pending->id(), feature_cache.find_by_parameters(std::tuple<int64_t>(5))->id());
+  for (auto &f : feature_cache) {
+    ASSERT_EQ(preloaded_cache.find_by_parameters(f->parameters())->id(), f->id());
+  }
+
+  // New features are inserted without looking them up first
+  for (int i = 990; i < 1010; ++i) {
+    preloaded_cache.add(my_int_feature(std::tuple<int64_t>(i)));
+  }
+  preloaded_cache.sync();
+  ASSERT_EQ(preloaded_cache.stats().statements_prepared, 2);
+  ASSERT_EQ(preloaded_cache.find_by_parameters(std::tuple<int64_t>(995))->id(),
+            feature_cache.find_by_parameters(std::tuple<int64_t>(995))->id());
+  ASSERT_NE(std::get<0>(preloaded_cache.find_by_parameters(std::tuple<int64_t>(1005))->id()), 0);
+  ASSERT_EQ(count_rows(db, feature_table_name), 1010);
+
+  // A bounded cache stops at its capacity and keeps looking entities up
+  sqldsml::feature_cache<my_int_feature> bounded_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  bounded_cache.set_capacity(100);
+  ASSERT_EQ(bounded_cache.preload(), 100);
+  ASSERT_FALSE(bounded_cache.preloaded());
+  preloaded_cache.clear();
+  ASSERT_FALSE(preloaded_cache.preloaded());
+}
+
+TEST_F(SqldsmlTest, BoundedCapacity) {
+  create_feature_table();
+  create_sample_table();
+  create_value_table();
+
+  sqldsml::feature_cache<my_int_feature> feature_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  sqldsml::sample_cache<my_int_sample> sample_cache(db, sample_table_name, sample_id_fields, sample_parameter_fields);
+  sqldsml::value_cache<my_real_value> value_cache(db, value_table_name, value_id_fields, value_parameter_fields);
+  feature_cache.set_capacity(100);
+  sample_cache.set_capacity(10);
+  value_cache.set_capacity(50);
+
+  std::map<int64_t, std::tuple<int64_t>> ids;
+  for (int k = 0; k < 100; ++k) {
+    auto s = sample_cache.add(my_int_sample(std::tuple<int64_t>(k)));
+    // Feature 0 is hot, the others are seen once per 1000 features
+    auto hot = feature_cache.add(my_int_feature(std::tuple<int64_t>(0)));
+    value_cache.add(my_real_value(s, hot, std::tuple<double>(0.5)));
+    for (int i = 0; i < 10; ++i) {
+      feature_cache.add(my_int_feature(std::tuple<int64_t>(1 + (k * 10 + i) % 1000)));
+    }
+    if ((k + 1) % 5 == 0) {
+      feature_cache.sync();
+      sample_cache.sync();
+      value_cache.sync();
+      ASSERT_LE(feature_cache.size(), 100);
+      ASSERT_LE(sample_cache.size(), 10);
+      ASSERT_LE(value_cache.size(), 50);
+      ASSERT_NE(feature_cache.find_by_parameters(std::tuple<int64_t>(0)), nullptr);
+      for (auto &f : feature_cache) {
+        if (f != nullptr) ids[std::get<0>(f->parameters())] = f->id();
+      }
+    }
+  }
+  ASSERT_EQ(ids.size(), 1001);
+
+  // Evicted features resolve to the same ids again
+  for (int i = 0; i <= 1000; ++i) {
+    feature_cache.add(my_int_feature(std::tuple<int64_t>(i)));
+  }
+  feature_cache.sync();
+  ASSERT_LE(feature_cache.size(), 100);
+  for (auto &f : feature_cache) {
+    if (f != nullptr) {
+      ASSERT_EQ(f->id(), ids[std::get<0>(f->parameters())]);
+    }
+  }
+
+  ASSERT_EQ(count_rows(db, feature_table_name), 1001);
+}
+
+TEST_F(SqldsmlTest, ConcurrentAdd) {
+  create_feature_table();
+  sqldsml::concurrent_feature_cache<my_int_feature> feature_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+
+  // Producers add overlapping feature ranges
+  std::vector<std::thread> producers;
+  for (int t = 0; t < 4; ++t) {
+    producers.emplace_back([&feature_cache, t]() {
+        for (int i = 0; i < 2000; ++i) {
+          feature_cache.add(my_int_feature(std::tuple<int64_t>(t * 500 + i)));
+        }
+      });
+  }
+  for (auto &p : producers) {
+    p.join();
+  }
+  ASSERT_EQ(feature_cache.size(), 3500);
+  ASSERT_EQ(feature_cache.pending_size(), 3500);
+  ASSERT_TRUE(feature_cache.sync());
+  ASSERT_EQ(feature_cache.pending_size(), 0);
+  // One select and one insert statement for all shards, plus last_insert_rowid()
+  ASSERT_EQ(feature_cache.stats().statements_prepared, 3);
+
+  std::set<int64_t> ids;
+  feature_cache.for_each([&ids](const my_int_feature::type_ptr& f) {
+      ids.insert(std::get<0>(f->id()));
+    });
+  ASSERT_EQ(ids.size(), 3500);
+  ASSERT_EQ(ids.count(0), 0);
+  auto f = feature_cache.find_by_parameters(std::tuple<int64_t>(1234));
+  ASSERT_NE(f, nullptr);
+  ASSERT_EQ(feature_cache.add(my_int_feature(std::tuple<int64_t>(1234))), f);
+
+  ASSERT_EQ(count_rows(db, feature_table_name), 3500);
+}
+
+TEST_F(SqldsmlTest, ConcurrentShardSpread) {
+  create_feature_table();
+  sqldsml::concurrent_feature_cache<my_int_feature> feature_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+
+  // Keys with a stride of the shard count still spread over all shards
+  for (int i = 0; i < 1600; ++i) {
+    feature_cache.add(my_int_feature(std::tuple<int64_t>(i * 16)));
+  }
+  const std::vector<size_t> sizes = feature_cache.shard_sizes();
+  ASSERT_EQ(sizes.size(), 16);
+  for (const size_t n : sizes) {
+    ASSERT_GT(n, 50);
+    ASSERT_LT(n, 150);
+  }
+}
+
+TEST_F(SqldsmlTest, SyncCoordinator) {
+  create_feature_table();
+  create_sample_table();
+  create_value_table();
+
+  sqldsml::feature_cache<my_int_feature> feature_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  sqldsml::sample_cache<my_int_sample> sample_cache(db, sample_table_name, sample_id_fields, sample_parameter_fields);
+  sqldsml::value_cache<my_real_value> value_cache(db, value_table_name, value_id_fields, value_parameter_fields);
+  sqldsml::sync_coordinator coordinator(db);
+  coordinator.add_entity_cache(feature_cache);
+  coordinator.add_entity_cache(sample_cache);
+  coordinator.add_link_cache(value_cache);
+
+  for (int k = 0; k < 20; ++k) {
+    auto s = sample_cache.add(my_int_sample(std::tuple<int64_t>(k)));
+    for (int i = 0; i < 10; ++i) {
+      auto f = feature_cache.add(my_int_feature(std::tuple<int64_t>(i)));
+      value_cache.add(my_real_value(s, f, std::tuple<double>(0.5)));
+    }
+    if ((k + 1) % 7 == 0) {
+      ASSERT_TRUE(coordinator.sync());
+      ASSERT_EQ(feature_cache.pending_size(), 0);
+      ASSERT_EQ(sample_cache.pending_size(), 0);
+      ASSERT_EQ(value_cache.pending_size(), 0);
+      sample_cache.clear();
+      value_cache.clear();
+    }
+  }
+  ASSERT_EQ(value_cache.pending_size(), 60);
+  ASSERT_TRUE(coordinator.sync());
+  ASSERT_TRUE(coordinator.sync());
+
+  for (auto &table : std::vector<std::pair<std::string, int>>{{feature_table_name, 10},
+                                                              {sample_table_name, 20},
+                                                              {value_table_name, 200}}) {
+    ASSERT_EQ(count_rows(db, table.first), table.second);
+  }
+}
 
-  class my_int_sample : public
-  ::sqldsml::sample<std::tuple<int64_t>,
-                    std::tuple<int64_t>> {
-  public:
-    using ::sqldsml::sample<std::tuple<int64_t>,
-                            std::tuple<int64_t>>::sample;
-    typedef my_int_sample type;
-    typedef std::shared_ptr<type> type_ptr;
+TEST_F(SqldsmlTest, SyncCoordinatorCommitFails) {
+  create_feature_table();
+  // Readers block commits in rollback journal mode
+  sqldsml::execute(db, "PRAGMA journal_mode = DELETE");
+  sqldsml::execute(db, "INSERT INTO `" + feature_table_name + "` (`feature_index`) VALUES (-1)");
+
+  sqldsml::feature_cache<my_int_feature> feature_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  sqldsml::sync_coordinator coordinator(db);
+  coordinator.add_entity_cache(feature_cache);
+  for (int i = 0; i < 10; ++i) {
+    feature_cache.add(my_int_feature(std::tuple<int64_t>(i)));
+  }
+  {
+    // A second connection in the middle of a read holds its shared lock
+    sqlite::database::type_ptr reader(new sqlite::database("test.db"));
+    sqlite::query read(reader, "SELECT * FROM `" + feature_table_name + "`");
+    read.step();
+    ASSERT_EQ(read.result_code(), SQLITE_ROW);
+    ASSERT_FALSE(coordinator.sync());
+  }
+  // The transaction was rolled back, not left open
+  ASSERT_EQ(count_rows(db, feature_table_name), 1);
+  ASSERT_EQ(sqldsml::execute(db, "BEGIN"), SQLITE_DONE);
+  ASSERT_EQ(sqldsml::execute(db, "ROLLBACK"), SQLITE_DONE);
+
+  feature_cache.clear();
+  for (int i = 0; i < 10; ++i) {
+    feature_cache.add(my_int_feature(std::tuple<int64_t>(i)));
+  }
+  ASSERT_TRUE(coordinator.sync());
+  ASSERT_EQ(count_rows(db, feature_table_name), 11);
+}
+
+TEST_F(SqldsmlTest, ConnectionProfile) {
+  create_feature_table();
+  auto pragma = [this](const std::string& name) {
+    sqlite::query q(db, "PRAGMA " + name);
+    q.step();
+    std::string value;
+    q.get(0, value);
+    return value;
   };
+  auto wal_size = []() {
+    std::ifstream wal("test.db-wal", std::ios::binary | std::ios::ate);
+    return wal ? static_cast<int64_t>(wal.tellg()) : int64_t(0);
+  };
+
+  sqldsml::feature_cache<my_int_feature> feature_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  sqldsml::sync_coordinator coordinator(db);
+  coordinator.add_entity_cache(feature_cache);
+  ASSERT_TRUE(coordinator.set_profile(sqldsml::connection_profile::bulk_load()));
+  ASSERT_EQ(pragma("journal_mode"), "wal");
+  ASSERT_EQ(pragma("synchronous"), "0");
+  ASSERT_EQ(pragma("temp_store"), "2");
+  ASSERT_EQ(pragma("wal_autocheckpoint"), "0");
+  for (int i = 0; i < 1000; ++i) {
+    feature_cache.add(my_int_feature(std::tuple<int64_t>(i)));
+  }
+  ASSERT_TRUE(coordinator.sync());
+  // Truncated by the checkpoint after the sync
+  ASSERT_EQ(wal_size(), 0);
+
+  ASSERT_TRUE(coordinator.set_profile(sqldsml::connection_profile::steady_state()));
+  ASSERT_EQ(pragma("synchronous"), "1");
+  // The schedule is backed up by SQLite's own checkpoints, the WAL never grows unbounded
+  ASSERT_NE(pragma("wal_autocheckpoint"), "0");
+  for (int k = 1; k <= 3; ++k) {
+    feature_cache.add(my_int_feature(std::tuple<int64_t>(1000 + k)));
+    ASSERT_TRUE(coordinator.sync());
+  }
+  ASSERT_GT(wal_size(), 0);
+  ASSERT_TRUE(coordinator.checkpoint());
+
+  {
+    // A reader on an old snapshot keeps even the escalated checkpoint from completing
+    sqlite::database::type_ptr reader(new sqlite::database("test.db"));
+    sqlite::query read(reader, "SELECT * FROM `" + feature_table_name + "`");
+    read.step();
+    ASSERT_EQ(read.result_code(), SQLITE_ROW);
+    feature_cache.add(my_int_feature(std::tuple<int64_t>(2000)));
+    ASSERT_TRUE(coordinator.sync());
+    ASSERT_FALSE(coordinator.checkpoint());
+  }
+  ASSERT_TRUE(coordinator.checkpoint());
+
+  sqldsml::execute(db, "PRAGMA journal_mode = DELETE");
+}
+
+TEST_F(SqldsmlTest, BackgroundWriter) {
+  create_feature_table();
+  create_sample_table();
+  create_value_table();
 
-  class my_real_value : public
-  ::sqldsml::value<my_int_sample, my_int_feature, std::tuple<double>> {
-  public:
-    using ::sqldsml::value<my_int_sample, my_int_feature, std::tuple<double>>::value;
-    typedef my_real_value type;
-    typedef std::shared_ptr<type> type_ptr;
+  sqldsml::background_writer writer(db);
+  sqldsml::double_buffer<batch> buffers(db, *this);
+  auto write = [](batch& b) {
+    b.feature_cache.sync();
+    b.sample_cache.sync();
+    b.value_cache.sync();
+    const bool resolved = b.value_cache.pending_size() == 0;
+    b.sample_cache.clear();
+    b.value_cache.clear();
+    return resolved;
   };
+  std::vector<std::shared_future<bool>> flushes;
+  for (int k = 0; k < 50; ++k) {
+    batch& b = buffers.front();
+    auto s = b.sample_cache.add(my_int_sample(std::tuple<int64_t>(k)));
+    for (int i = 0; i < 10; ++i) {
+      auto f = b.feature_cache.add(my_int_feature(std::tuple<int64_t>((k + i) % 20)));
+      b.value_cache.add(my_real_value(s, f, std::tuple<double>(0.5)));
+    }
+    if ((k + 1) % 10 == 0) {
+      flushes.push_back(buffers.flush(writer, write));
+    }
+  }
+  writer.wait();
+  for (auto &f : flushes) {
+    ASSERT_TRUE(f.get());
+  }
 
-  void create_feature_table() {
-    sqlite::query drop_table(db, "DROP TABLE IF EXISTS `" + feature_table_name + "`");
-    drop_table.step();
-    ASSERT_EQ(SQLITE_DONE, drop_table.result_code());
-    sqlite::query create_table(db, "CREATE TABLE `" + feature_table_name + "` \
-(`id` INTEGER PRIMARY KEY AUTOINCREMENT, `" + feature_parameter_fields[0] +"` INTEGER NOT NULL)");
-    create_table.step();
-    ASSERT_EQ(SQLITE_DONE, create_table.result_code());
+  for (auto &table : std::vector<std::pair<std::string, int>>{{feature_table_name, 20},
+                                                              {sample_table_name, 50},
+                                                              {value_table_name, 500}}) {
+    ASSERT_EQ(count_rows(db, table.first), table.second);
   }
+}
 
-  void create_sample_table() {
-    sqlite::query drop_table(db, "DROP TABLE IF EXISTS `" + sample_table_name + "`");
-    drop_table.step();
-    ASSERT_EQ(SQLITE_DONE, drop_table.result_code());
-    sqlite::query create_table(db, "CREATE TABLE `" + sample_table_name + "` \
-(`id` INTEGER PRIMARY KEY AUTOINCREMENT, `" + sample_parameter_fields[0] + "` INTEGER NOT NULL)");
-    create_table.step();
-    ASSERT_EQ(SQLITE_DONE, create_table.result_code());
+TEST_F(SqldsmlTest, PreparedStatementsReused) {
+  create_feature_table();
+  sqldsml::feature_cache<my_int_feature> feature_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  size_t prepared = 0;
+  for (int k = 0; k < 5; ++k) {
+    for (int i = 0; i < 300; ++i) {
+      feature_cache.add(my_int_feature(std::tuple<int64_t>(k * 100 + i)));
+    }
+    feature_cache.sync();
+    if (k == 0) {
+      prepared = feature_cache.stats().statements_prepared;
+    }
+    ASSERT_EQ(feature_cache.stats().statements_prepared, prepared);
+  }
+  ASSERT_EQ(feature_cache.size(), 700);
+  for (auto &f : feature_cache) {
+    ASSERT_NE(std::get<0>(f->id()), 0);
   }
 
-  void create_value_table() {
-    sqlite::query drop_table(db, "DROP TABLE IF EXISTS `" + value_table_name + "`");
-    drop_table.step();
-    ASSERT_EQ(SQLITE_DONE, drop_table.result_code());
-    sqlite::query create_table(db, "CREATE TABLE `" + value_table_name + "` \
-(`sample_id` INTEGER, `feature_id` INTEGER, `" + value_parameter_fields[0] + "` FLOAT NOT NULL, \
-PRIMARY KEY(sample_id, feature_id) )");
-    create_table.step();
-    ASSERT_EQ(SQLITE_DONE, create_table.result_code());
+  sqldsml::feature_cache<my_int_feature> reloaded_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  for (auto &f : feature_cache) {
+    reloaded_cache.add(my_int_feature(f->parameters()));
   }
+  ASSERT_EQ(reloaded_cache.load_ids(), 700);
+  ASSERT_EQ(reloaded_cache.load_ids(), 0);
+  ASSERT_EQ(reloaded_cache.stats().statements_prepared, 1);
+}
 
-  virtual void SetUp() {
-    db = ::sqlite::database::type_ptr(new sqlite::database("test.db"));
+TEST_F(SqldsmlTest, LoadIdsThroughJoin) {
+  create_feature_table();
+  sqldsml::feature_cache<my_int_feature> feature_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  for (int i = 0; i < 1000; ++i) {
+    feature_cache.add(my_int_feature(std::tuple<int64_t>(i)));
   }
-  
-  virtual void TearDown() {
-  }
-
-  typename ::sqlite::database::type_ptr db;
-  std::string feature_table_name = "test_features";
-  std::vector<std::string> feature_id_fields = {"id"};
-  std::vector<std::string> feature_parameter_fields = {"feature_index"};
-  std::string sample_table_name = "test_samples";
-  std::vector<std::string> sample_id_fields = {"id"};
-  std::vector<std::string> sample_parameter_fields = {"sample_natural_id"};
-  std::string value_table_name = "test_values";
-  std::vector<std::string> value_id_fields = {"sample_id", "feature_id"};
-  std::vector<std::string> value_parameter_fields = {"value"};
-};
+  feature_cache.insert_ids();
+
+  sqldsml::feature_cache<my_int_feature> reloaded_cache(db, feature_table_name, feature_id_fields, feature_parameter_fields);
+  reloaded_cache.set_load_join_threshold(100);
+  for (int i = 0; i < 1200; ++i) {
+    reloaded_cache.add(my_int_feature(std::tuple<int64_t>(i)));
+  }
+  ASSERT_EQ(reloaded_cache.load_ids(), 1000);
+  ASSERT_EQ(reloaded_cache.pending_size(), 200);
+  for (auto &f : feature_cache) {
+    ASSERT_EQ(reloaded_cache.find_by_parameters(f->parameters())->id(), f->id());
+  }
+}
+
+TEST_F(SqldsmlTest, Schema) {
+  sqldsml::execute(db, "DROP TABLE IF EXISTS `" + feature_table_name + "`");
+  sqldsml::execute(db, "CREATE TABLE `" + feature_table_name + "` (`id` INTEGER PRIMARY KEY AUTOINCREMENT, `" +
+                   feature_parameter_fields[0] + "` INTEGER NOT NULL)");
+  ASSERT_FALSE(sqldsml::check_entity_schema(db, feature_table_name, feature_parameter_fields));
+  ASSERT_FALSE(sqldsml::check_entity_schema(db, "missing_table", feature_parameter_fields));
+
+  const auto statements = sqldsml::entity_schema<my_int_feature>(feature_table_name, feature_id_fields,
+                                                                 feature_parameter_fields);
+  ASSERT_EQ(statements.size(), 2);
+  ASSERT_NE(statements[0].find("`feature_index` INTEGER NOT NULL"), std::string::npos);
+  ASSERT_TRUE(sqldsml::create_schema(db, statements));
+  ASSERT_TRUE(sqldsml::check_entity_schema(db, feature_table_name, feature_parameter_fields));
+
+  // Both the batched and the joined lookups of links need the index on their endpoints
+  sqldsml::execute(db, "DROP TABLE IF EXISTS `" + value_table_name + "`");
+  sqldsml::execute(db, "CREATE TABLE `" + value_table_name + "` (`sample_id` INTEGER, `feature_id` INTEGER, `value` REAL)");
+  ASSERT_FALSE(sqldsml::check_link_schema(db, value_table_name, value_id_fields));
+  create_value_table();
+  ASSERT_TRUE(sqldsml::check_link_schema(db, value_table_name, value_id_fields));
+  ASSERT_TRUE(sqldsml::plan_scans_table("SCAN TABLE test_values", value_table_name));
+  ASSERT_TRUE(sqldsml::plan_scans_table("SCAN test_values USING COVERING INDEX i", value_table_name));
+  ASSERT_TRUE(sqldsml::plan_scans_table("SEARCH test_values USING AUTOMATIC COVERING INDEX (sample_id=?)",
+                                        value_table_name));
+  ASSERT_FALSE(sqldsml::plan_scans_table("SCAN temp.sqldsml_keys_2", value_table_name));
+  ASSERT_FALSE(sqldsml::plan_scans_table("SEARCH test_values USING INDEX i (sample_id=? AND feature_id=?)",
+                                         value_table_name));
+  ASSERT_NE(sqldsml::link_schema<my_real_value>(value_table_name, value_id_fields, value_parameter_fields)[0].find(
+              "`value` REAL NOT NULL"), std::string::npos);
+  sqldsml::execute(db, "DROP TABLE IF EXISTS `schema_test`");
+  ASSERT_FALSE(sqldsml::create_schema(db, std::vector<std::string>{"CREATE TABLE `schema_test` (`a` INTEGER)",
+                                                                   "INSERT INTO `schema_test` VALUES (1)",
+                                                                   "INSERT INTO `schema_test` VALUES (1)",
+                                                                   "CREATE UNIQUE INDEX `schema_test_a` ON `schema_test` (`a`)"}));
+  sqlite::query count_query(db, "SELECT count(*) FROM `sqlite_master` WHERE `name` = 'schema_test'");
+  count_query.step();
+  int count;
+  count_query.get(0, count);
+  ASSERT_EQ(count, 0);
+}
 
 TEST_F(SqldsmlTest, CreateSamplesAndLinks) {
   const size_t max_samples = 200;
@@ -0,0 +1,115 @@
+#pragma once
+
+// Fixture shared by the sqldsml test programs, each defines its configuration macros
+// before including this header
+
+#include <gtest/gtest.h>
+
+#include <iostream>
+
+#include <sqldsml>
+
+#include <algorithm>
+#include <cmath>
+
+#include <sstream>
+#include <random>
+#include <limits>
+#include <fstream>
+#include <map>
+#include <set>
+#include <thread>
+
+class SqldsmlTest : public ::testing::Test {
+
+protected:
+
+  class my_int_feature : public
+  ::sqldsml::feature<std::tuple<int64_t>> {
+  public:
+    using ::sqldsml::feature<std::tuple<int64_t>>::feature;
+    typedef my_int_feature type;
+    typedef std::shared_ptr<type> type_ptr;
+  };
+
+  class my_int_sample : public
+  ::sqldsml::sample<std::tuple<int64_t>,
+                    std::tuple<int64_t>> {
+  public:
+    using ::sqldsml::sample<std::tuple<int64_t>,
+                            std::tuple<int64_t>>::sample;
+    typedef my_int_sample type;
+    typedef std::shared_ptr<type> type_ptr;
+  };
+
+  class my_real_value : public
+  ::sqldsml::value<my_int_sample, my_int_feature, std::tuple<double>> {
+  public:
+    using ::sqldsml::value<my_int_sample, my_int_feature, std::tuple<double>>::value;
+    typedef my_real_value type;
+    typedef std::shared_ptr<type> type_ptr;
+  };
+
+  // Caches of one batch of samples
+  struct batch {
+    batch(sqlite::database::type_ptr db, const SqldsmlTest& t) :
+      feature_cache(db, t.feature_table_name, t.feature_id_fields, t.feature_parameter_fields),
+      sample_cache(db, t.sample_table_name, t.sample_id_fields, t.sample_parameter_fields),
+      value_cache(db, t.value_table_name, t.value_id_fields, t.value_parameter_fields) {
+    }
+
+    sqldsml::feature_cache<my_int_feature> feature_cache;
+    sqldsml::sample_cache<my_int_sample> sample_cache;
+    sqldsml::value_cache<my_real_value> value_cache;
+  };
+
+  void create_feature_table() {
+    sqlite::query drop_table(db, "DROP TABLE IF EXISTS `" + feature_table_name + "`");
+    drop_table.step();
+    ASSERT_EQ(SQLITE_DONE, drop_table.result_code());
+    ASSERT_TRUE(sqldsml::create_schema(db, sqldsml::entity_schema<my_int_feature>(feature_table_name, feature_id_fields,
+                                                                                 feature_parameter_fields)));
+  }
+
+  void create_sample_table() {
+    sqlite::query drop_table(db, "DROP TABLE IF EXISTS `" + sample_table_name + "`");
+    drop_table.step();
+    ASSERT_EQ(SQLITE_DONE, drop_table.result_code());
+    ASSERT_TRUE(sqldsml::create_schema(db, sqldsml::entity_schema<my_int_sample>(sample_table_name, sample_id_fields,
+                                                                                sample_parameter_fields)));
+  }
+
+  void create_value_table() {
+    sqlite::query drop_table(db, "DROP TABLE IF EXISTS `" + value_table_name + "`");
+    drop_table.step();
+    ASSERT_EQ(SQLITE_DONE, drop_table.result_code());
+    ASSERT_TRUE(sqldsml::create_schema(db, sqldsml::link_schema<my_real_value>(value_table_name, value_id_fields,
+                                                                              value_parameter_fields)));
+  }
+
+  static int count_rows(const sqlite::database::type_ptr& db, const std::string& table_name) {
+    sqlite::query count_query(db, "SELECT count(*) FROM `" + table_name + "`");
+    count_query.step();
+    int count;
+    count_query.get(0, count);
+    return count;
+  }
+
+  virtual void SetUp() {
+    db = ::sqlite::database::type_ptr(new sqlite::database("test.db"));
+  }
+  
+  virtual void TearDown() {
+  }
+
+  typename ::sqlite::database::type_ptr db;
+  std::string feature_table_name = "test_features";
+  std::vector<std::string> feature_id_fields = {"id"};
+  std::vector<std::string> feature_parameter_fields = {"feature_index"};
+  std::string sample_table_name = "test_samples";
+  std::vector<std::string> sample_id_fields = {"id"};
+  std::vector<std::string> sample_parameter_fields = {"sample_natural_id"};
+  std::string value_table_name = "test_values";
+  std::vector<std::string> value_id_fields = {"sample_id", "feature_id"};
+  std::vector<std::string> value_parameter_fields = {"value"};
+};